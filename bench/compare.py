@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+
+# Compare two sets of results from run_bench.py:
+#
+#   ./compare.py [-t PERCENT] BASE.json NEW.json
+#
+# For every workload in both, print the change in MIPS, peak RSS and
+# startup time. Exits with status 1 if any workload got slower by
+# more than PERCENT (5 by default), or failed in NEW but not in BASE.
+
+import sys
+import json
+import getopt
+
+class color:
+    PASS = '\033[92m'
+    FAIL = '\033[91m'
+    END = '\033[0m'
+
+def load(filename):
+    with open(filename) as f:
+        report = json.load(f)
+    return report, dict(((r['model'], r['workload']), r) for r in report['results'])
+
+def change(old, new):
+    if old is None or new is None or old == 0:
+        return None
+    return 100.0 * (new - old) / old
+
+def show(percent):
+    return '     n/a' if percent is None else '{:+7.1f}%'.format(percent)
+
+def main():
+    threshold = 5.0
+    opts, args = getopt.getopt(sys.argv[1:], 't:')
+    for opt, arg in opts:
+        if opt == '-t':
+            threshold = float(arg)
+    if len(args) != 2:
+        print >> sys.stderr, 'usage: compare.py [-t PERCENT] BASE.json NEW.json'
+        sys.exit(2)
+
+    base_report, base = load(args[0])
+    new_report, new = load(args[1])
+    print '{} -> {}'.format(base_report['describe'], new_report['describe'])
+    print '{:<40} {:>10} {:>10} {:>8} {:>8} {:>8}'.format('workload', 'base MIPS', 'new MIPS', 'MIPS', 'RSS', 'startup')
+
+    regressed = False
+    for key in sorted(set(base) & set(new)):
+        b, n = base[key], new[key]
+        name = '/'.join(key)
+        if n['status'] != 'ok':
+            if b['status'] == 'ok':
+                regressed = True
+            print '{:<40} {}fail{}'.format(name, color.FAIL, color.END)
+            continue
+        if b['status'] != 'ok':
+            print '{:<40} {}fixed{}'.format(name, color.PASS, color.END)
+            continue
+        mips = change(b['mips'], n['mips'])
+        slower = mips is not None and mips < -threshold
+        regressed = regressed or slower
+        print '{:<40} {:>10} {:>10} {}{}{} {} {}'.format(
+            name, b['mips'], n['mips'],
+            color.FAIL if slower else '', show(mips), color.END if slower else '',
+            show(change(b['max_rss_kb'], n['max_rss_kb'])),
+            show(change(b['startup_seconds'], n['startup_seconds'])))
+
+    sys.exit(1 if regressed else 0)
+
+main()
@@ -0,0 +1,180 @@
+#!/usr/bin/env python
+
+# Measure the speed of the C emulators generated from the RISC-V and
+# ARMv8 (no_vector) specifications, and write the results as JSON.
+#
+#   ./run_bench.py [-r REPEATS] [-o FILE] [-k] [WORKLOAD...]
+#
+# Each workload is run REPEATS times (3 by default) and the fastest
+# run is reported, along with the peak resident set size of the
+# emulator and its startup time. With WORKLOAD arguments only the
+# workloads whose names contain one of them are run. -k keeps going
+# when a workload fails, recording the failure in the results.
+#
+# See README for how to compare the results of two runs.
+
+import os
+import re
+import sys
+import json
+import glob
+import time
+import socket
+import getopt
+import subprocess
+
+bench_dir = os.path.dirname(os.path.abspath(__file__))
+sail_dir = os.environ.get('SAIL_DIR', os.path.dirname(bench_dir))
+
+riscv_sim = os.path.join(sail_dir, 'riscv', 'riscv_sim')
+aarch64_c = os.path.join(sail_dir, 'aarch64', 'aarch64_c')
+
+class color:
+    NOTICE = '\033[94m'
+    PASS = '\033[92m'
+    FAIL = '\033[91m'
+    END = '\033[0m'
+
+# Each model says how to run an ELF file, and how to find what it
+# reports on stderr: the instructions executed, and (if it measures
+# it) how long it took to start.
+models = {
+    'riscv': {
+        'emulator': riscv_sim,
+        'command': lambda elf: [riscv_sim, '--stats', '--terminal-log', os.devnull, elf],
+        'instructions': r'\[Sail\] Executed (\d+) instructions',
+        'startup': r'\[Sail\] Started in ([0-9.]+) s',
+    },
+    'aarch64': {
+        'emulator': aarch64_c,
+        'command': lambda elf: [aarch64_c, '--elf', elf],
+        'instructions': r'\[Sail\] Exiting after (\d+) cycles',
+        'startup': None,
+    },
+}
+
+def workloads():
+    found = []
+    for elf in sorted(glob.glob(os.path.join(sail_dir, 'test', 'riscv', 'tests', '*.elf'))):
+        found.append(('riscv', os.path.basename(elf), elf))
+    for elf in sorted(glob.glob(os.path.join(bench_dir, 'workloads', '*.elf'))):
+        found.append(('riscv', os.path.basename(elf), elf))
+    for elf in sorted(glob.glob(os.path.join(sail_dir, 'test', 'arm', '*.elf'))):
+        found.append(('aarch64', os.path.basename(elf), elf))
+    return found
+
+# Run a command, returning its exit status, stderr, wall clock time in
+# seconds and peak RSS in kilobytes.
+def run(command):
+    start = time.time()
+    with open(os.devnull, 'w') as null:
+        proc = subprocess.Popen(command, stdout=null, stderr=subprocess.PIPE)
+        err = proc.stderr.read()
+        _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.time() - start
+    if os.WIFEXITED(status):
+        proc.returncode = os.WEXITSTATUS(status)
+    else:
+        proc.returncode = -os.WTERMSIG(status)
+    return proc.returncode, err, elapsed, usage.ru_maxrss
+
+def measure(model, elf, repeats):
+    m = models[model]
+    best = None
+    for i in range(repeats):
+        status, err, elapsed, rss = run(m['command'](elf))
+        if status != 0:
+            return { 'status': 'fail', 'exit_status': status }
+        insns = re.search(m['instructions'], err)
+        if insns is None:
+            return { 'status': 'fail', 'error': 'no instruction count reported' }
+        result = {
+            'status': 'ok',
+            'instructions': int(insns.group(1)),
+            'seconds': round(elapsed, 6),
+            'max_rss_kb': rss,
+        }
+        if m['startup'] is not None:
+            startup = re.search(m['startup'], err)
+            result['startup_seconds'] = float(startup.group(1)) if startup else None
+        else:
+            # Stop at the first instruction: what is left is the time
+            # taken to initialise the model and load the ELF file.
+            _, _, elapsed, _ = run(m['command'](elf) + ['--cyclelimit', '1'])
+            result['startup_seconds'] = round(elapsed, 6)
+        if best is None or result['seconds'] < best['seconds']:
+            best = result
+    run_time = best['seconds'] - (best['startup_seconds'] or 0)
+    best['mips'] = round(best['instructions'] / run_time / 1e6, 3) if run_time > 0 else None
+    return best
+
+def git(*args):
+    try:
+        with open(os.devnull, 'w') as null:
+            return subprocess.check_output(['git', '-C', sail_dir] + list(args), stderr=null).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def compiler():
+    try:
+        return subprocess.check_output(['gcc', '--version']).splitlines()[0]
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def main():
+    repeats = 3
+    output = None
+    keep_going = False
+    opts, names = getopt.getopt(sys.argv[1:], 'r:o:k')
+    for opt, arg in opts:
+        if opt == '-r':
+            repeats = max(1, int(arg))
+        elif opt == '-o':
+            output = arg
+        elif opt == '-k':
+            keep_going = True
+
+    for model in sorted(models):
+        if not os.path.exists(models[model]['emulator']):
+            print >> sys.stderr, '{}{} is not built, skipping {} workloads{}'.format(
+                color.NOTICE, models[model]['emulator'], model, color.END)
+
+    results = []
+    failed = False
+    for model, name, elf in workloads():
+        if not os.path.exists(models[model]['emulator']):
+            continue
+        if names and not any(n in name for n in names):
+            continue
+        result = measure(model, elf, repeats)
+        result['model'] = model
+        result['workload'] = name
+        results.append(result)
+        if result['status'] == 'ok':
+            print >> sys.stderr, '{}/{}: {}{} MIPS{}, {} kB, started in {} s'.format(
+                model, name, color.PASS, result['mips'], color.END,
+                result['max_rss_kb'], result['startup_seconds'])
+        else:
+            print >> sys.stderr, '{}/{}: {}fail{}'.format(model, name, color.FAIL, color.END)
+            failed = True
+            if not keep_going:
+                break
+
+    report = {
+        'commit': git('rev-parse', 'HEAD'),
+        'describe': git('describe', '--always', '--dirty'),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'host': socket.gethostname(),
+        'compiler': compiler(),
+        'repeats': repeats,
+        'results': results,
+    }
+    text = json.dumps(report, indent=2, sort_keys=True, separators=(',', ': '))
+    if output is None:
+        print text
+    else:
+        with open(output, 'w') as f:
+            f.write(text + '\n')
+    sys.exit(1 if failed else 0)
+
+main()
@@ -0,0 +1,227 @@
+/*
+ * A CoreMark-style workload for the bare metal RISC-V emulator: the
+ * same mix of kernels (linked list search and sort, small matrix
+ * arithmetic, a state machine scanning a string, CRC16 of the
+ * results), written from scratch so it can be freely distributed and
+ * built without a C library.
+ *
+ * Each pass folds its results into a CRC. The workload runs the same
+ * passes twice and exits with 0 if both agree, so an emulator that
+ * gets something wrong is likely to fail rather than just be fast.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ITERATIONS 40
+#define LIST_SIZE 64
+#define MATRIX_SIZE 12
+
+/* gcc may turn loops into calls to these, even with -ffreestanding. */
+void *memset(void *s, int c, size_t n)
+{
+  unsigned char *p = s;
+  while (n--) *p++ = (unsigned char)c;
+  return s;
+}
+
+void *memcpy(void *dest, const void *src, size_t n)
+{
+  unsigned char *d = dest;
+  const unsigned char *s = src;
+  while (n--) *d++ = *s++;
+  return dest;
+}
+
+static uint16_t crc16(uint16_t crc, uint32_t data)
+{
+  for (int i = 0; i < 32; i++) {
+    uint16_t bit = (crc ^ data) & 1;
+    crc >>= 1;
+    data >>= 1;
+    if (bit) crc ^= 0xa001;
+  }
+  return crc;
+}
+
+/* ***** Linked lists ***** */
+
+struct node {
+  struct node *next;
+  int32_t key;
+  int32_t value;
+};
+
+static struct node nodes[LIST_SIZE];
+
+static struct node *list_init(uint32_t seed)
+{
+  struct node *head = NULL;
+  for (int i = 0; i < LIST_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    nodes[i].key = (int32_t)(seed >> 16) & 0xff;
+    nodes[i].value = i;
+    nodes[i].next = head;
+    head = &nodes[i];
+  }
+  return head;
+}
+
+static struct node *list_find(struct node *list, int32_t key)
+{
+  while (list && list->key != key) list = list->next;
+  return list;
+}
+
+static struct node *list_reverse(struct node *list)
+{
+  struct node *prev = NULL;
+  while (list) {
+    struct node *next = list->next;
+    list->next = prev;
+    prev = list;
+    list = next;
+  }
+  return prev;
+}
+
+/* Merge sort by key, as in CoreMark. */
+static struct node *list_sort(struct node *list)
+{
+  for (int width = 1; ; width *= 2) {
+    struct node *p = list, *tail = NULL;
+    int merges = 0;
+    list = NULL;
+    while (p) {
+      merges++;
+      struct node *q = p;
+      int psize = 0;
+      for (int i = 0; i < width && q; i++) {
+        psize++;
+        q = q->next;
+      }
+      int qsize = width;
+      while (psize > 0 || (qsize > 0 && q)) {
+        struct node *e;
+        if (psize == 0) {
+          e = q; q = q->next; qsize--;
+        } else if (qsize == 0 || !q || p->key <= q->key) {
+          e = p; p = p->next; psize--;
+        } else {
+          e = q; q = q->next; qsize--;
+        }
+        if (tail) tail->next = e; else list = e;
+        tail = e;
+      }
+      p = q;
+    }
+    tail->next = NULL;
+    if (merges <= 1) return list;
+  }
+}
+
+static uint16_t bench_list(uint16_t crc, uint32_t seed)
+{
+  struct node *list = list_init(seed);
+  for (int32_t key = 0; key < 32; key++) {
+    struct node *found = list_find(list, key * 7 & 0xff);
+    crc = crc16(crc, found ? (uint32_t)found->value : 0xffffffff);
+  }
+  list = list_sort(list_reverse(list));
+  for (struct node *n = list; n; n = n->next) crc = crc16(crc, n->key);
+  return crc;
+}
+
+/* ***** Matrices ***** */
+
+static int32_t matrix_a[MATRIX_SIZE][MATRIX_SIZE];
+static int32_t matrix_b[MATRIX_SIZE][MATRIX_SIZE];
+static int32_t matrix_c[MATRIX_SIZE][MATRIX_SIZE];
+
+static uint16_t bench_matrix(uint16_t crc, uint32_t seed)
+{
+  for (int i = 0; i < MATRIX_SIZE; i++)
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      seed = seed * 1103515245 + 12345;
+      matrix_a[i][j] = (int32_t)(seed >> 20) - 2048;
+      matrix_b[i][j] = (int32_t)(seed & 0xfff) - 2048;
+    }
+
+  for (int i = 0; i < MATRIX_SIZE; i++)
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      int32_t sum = 0;
+      for (int k = 0; k < MATRIX_SIZE; k++) sum += matrix_a[i][k] * matrix_b[k][j];
+      matrix_c[i][j] = sum;
+    }
+
+  uint32_t total = 0;
+  for (int i = 0; i < MATRIX_SIZE; i++)
+    for (int j = 0; j < MATRIX_SIZE; j++) {
+      int32_t x = matrix_c[i][j];
+      total += x > 0 ? (uint32_t)x >> 3 : (uint32_t)-x;
+    }
+  return crc16(crc, total);
+}
+
+/* ***** State machine ***** */
+
+enum state { START, INT, FLOAT, EXPONENT, SCIENTIFIC, INVALID, STATES };
+
+static const char input[] =
+  "5012,1234,-874,+122,35.54,.1234,-110.7,+0.64,5.500e+3,"
+  "-.123e-2,-87e+832,+0.6e-12,T0.3e-1F,-T.T++Tq,1T3.4e4z,34.0e-T^";
+
+static uint16_t bench_state(uint16_t crc, uint32_t seed)
+{
+  uint32_t counts[STATES] = {0};
+  enum state s = START;
+  for (const char *p = input; *p; p++) {
+    char c = *p ^ (char)(seed & 1);
+    if (c == ',') {
+      counts[s]++;
+      s = START;
+      continue;
+    }
+    int digit = c >= '0' && c <= '9';
+    switch (s) {
+    case START:
+      s = digit ? INT : (c == '+' || c == '-') ? START : c == '.' ? FLOAT : INVALID;
+      break;
+    case INT:
+      s = digit ? INT : c == '.' ? FLOAT : INVALID;
+      break;
+    case FLOAT:
+      s = digit ? FLOAT : (c == 'e' || c == 'E') ? EXPONENT : INVALID;
+      break;
+    case EXPONENT:
+      s = (digit || c == '+' || c == '-') ? SCIENTIFIC : INVALID;
+      break;
+    case SCIENTIFIC:
+      s = digit ? SCIENTIFIC : INVALID;
+      break;
+    default:
+      break;
+    }
+  }
+  counts[s]++;
+  for (int i = 0; i < STATES; i++) crc = crc16(crc, counts[i]);
+  return crc;
+}
+
+static uint16_t run(void)
+{
+  uint16_t crc = 0;
+  for (uint32_t i = 0; i < ITERATIONS; i++) {
+    crc = bench_list(crc, i);
+    crc = bench_matrix(crc, i);
+    crc = bench_state(crc, i);
+  }
+  return crc;
+}
+
+int main(void)
+{
+  uint16_t first = run();
+  uint16_t second = run();
+  return first == second ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python
+"""Decode a binary trace written by the Sail C runtime (sail -c -trace,
+run with --trace-file FILE) into the textual [TRACE] format printed
+when tracing to stderr. See the tracing section of lib/rts.c for the
+encoding.
+
+usage: decode_trace.py TRACE [OUTPUT]
+"""
+
+import sys
+
+MAGIC = b'SAILTRC1'
+
+(NAME, START, END, RESET, BITS64, UNIT, STRING, INT, BIGINT, BITS,
+ TRUE, FALSE, UNKNOWN, ARGSEP, ARGEND, RETEND) = range(16)
+
+def bits_string(length, value):
+    if length % 4 == 0:
+        return '0x' + ('%0*X' % (length // 4, value) if length > 0 else '')
+    else:
+        return '0b' + ''.join('1' if (value >> i) & 1 else '0' for i in range(length - 1, -1, -1))
+
+def decode(data, out):
+    if data[:len(MAGIC)] != MAGIC:
+        sys.exit('not a Sail binary trace')
+    buf = bytearray(data)
+    pos = [len(MAGIC)]
+
+    def varint():
+        v, shift = 0, 0
+        while True:
+            b = buf[pos[0]]
+            pos[0] += 1
+            v |= (b & 0x7f) << shift
+            shift += 7
+            if b < 0x80:
+                return v
+
+    def raw(n):
+        s = buf[pos[0]:pos[0] + n]
+        pos[0] += n
+        return s
+
+    def little_endian(s):
+        v = 0
+        for b in reversed(s):
+            v = (v << 8) | b
+        return v
+
+    names = {}
+    depth = 0
+    while pos[0] < len(buf):
+        tag = buf[pos[0]]
+        pos[0] += 1
+        if tag == NAME:
+            ident = varint()
+            names[ident] = raw(varint()).decode('utf-8', 'replace')
+        elif tag == START:
+            out.write('[TRACE] ' + '|   ' * depth + names[varint()] + '(')
+            depth += 1
+        elif tag == END:
+            out.write('[TRACE] ' + '|   ' * depth)
+            depth -= 1
+        elif tag == RESET:
+            depth = 0
+        elif tag == BITS64:
+            out.write('0x%x' % varint())
+        elif tag == UNIT:
+            out.write('()')
+        elif tag == STRING:
+            out.write(raw(varint()).decode('utf-8', 'replace'))
+        elif tag == INT:
+            v = varint()
+            out.write(str((v >> 1) ^ -(v & 1)))
+        elif tag == BIGINT:
+            negative = varint()
+            v = little_endian(raw(varint()))
+            out.write(str(-v if negative else v))
+        elif tag == BITS:
+            length = varint()
+            out.write(bits_string(length, little_endian(raw((length + 7) // 8))))
+        elif tag == TRUE:
+            out.write('true')
+        elif tag == FALSE:
+            out.write('false')
+        elif tag == UNKNOWN:
+            out.write('?')
+        elif tag == ARGSEP:
+            out.write(', ')
+        elif tag == ARGEND:
+            out.write(')\n')
+        elif tag == RETEND:
+            out.write('\n')
+        else:
+            sys.exit('unknown trace event %d at offset %d' % (tag, pos[0] - 1))
+
+if __name__ == '__main__':
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__)
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    if len(sys.argv) == 3:
+        with open(sys.argv[2], 'w') as out:
+            decode(data, out)
+    else:
+        decode(data, sys.stdout)
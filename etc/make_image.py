@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+"""Convert a text image (address and byte pairs, as read by -i) or an
+ELF file into the binary image format of the Sail C runtime, which -i
+and -b load by mapping the file and copying an extent at a time. See
+load_image in lib/rts.c for the layout.
+
+usage: make_image.py INPUT OUTPUT
+"""
+
+import sys
+import struct
+
+MAGIC = b'SAILIMG1'
+ENTRY = 1
+PAGE = 4096
+
+HEADER = '<8s6Q'
+EXTENT = '<4Q'
+SYMBOL = '<2Q'
+
+PT_LOAD = 1
+SHT_SYMTAB = 2
+
+class Image(object):
+    def __init__(self):
+        self.entry = None
+        self.extents = []   # (address, data, mem_length)
+        self.symbols = []   # (name, value)
+
+def read_text(data):
+    image = Image()
+    lines = data.decode('ascii').split('\n')
+    start, run = None, bytearray()
+    for i in range(0, len(lines) - 1, 2):
+        if lines[i] == 'elf_entry':
+            image.entry = int(lines[i + 1])
+            continue
+        address, byte = int(lines[i]), int(lines[i + 1])
+        if start is not None and address != start + len(run):
+            image.extents.append((start, bytes(run), len(run)))
+            start, run = None, bytearray()
+        if start is None:
+            start = address
+        run.append(byte & 0xff)
+    if start is not None:
+        image.extents.append((start, bytes(run), len(run)))
+    return image
+
+def read_elf(data):
+    image = Image()
+    is64 = bytearray(data)[4] == 2
+    e = '<' if bytearray(data)[5] == 1 else '>'
+    if is64:
+        (entry, phoff, shoff, phentsize, phnum, shentsize, shnum) = \
+            struct.unpack_from(e + '24xQQQ6xHHHH', data)[:7]
+    else:
+        (entry, phoff, shoff, phentsize, phnum, shentsize, shnum) = \
+            struct.unpack_from(e + '24xIII6xHHHH', data)[:7]
+    image.entry = entry
+
+    for i in range(phnum):
+        off = phoff + i * phentsize
+        if is64:
+            p_type, _, p_offset, _, p_paddr, p_filesz, p_memsz = struct.unpack_from(e + 'IIQQQQQ', data, off)
+        else:
+            p_type, p_offset, _, p_paddr, p_filesz, p_memsz = struct.unpack_from(e + 'IIIIII', data, off)
+        # As in lib/elf.c, segments are loaded at their physical address.
+        if p_type == PT_LOAD:
+            image.extents.append((p_paddr, data[p_offset:p_offset + p_filesz], p_memsz))
+
+    sections = []
+    for i in range(shnum):
+        off = shoff + i * shentsize
+        if is64:
+            sections.append(struct.unpack_from(e + 'IIQQQQII', data, off))
+        else:
+            sections.append(struct.unpack_from(e + 'IIIIIIII', data, off))
+    seen = set()
+    for sh in sections:
+        if sh[1] != SHT_SYMTAB:
+            continue
+        strtab = sections[sh[6]]
+        strings = data[strtab[4]:strtab[4] + strtab[5]]
+        entsize = 24 if is64 else 16
+        for off in range(sh[4], sh[4] + sh[5], entsize):
+            if is64:
+                name, _, _, _, value, _ = struct.unpack_from(e + 'IBBHQQ', data, off)
+            else:
+                name, value = struct.unpack_from(e + 'II', data, off)
+            name = strings[name:strings.index(b'\0', name)]
+            # The runtime keeps the first symbol with a name, as here.
+            if name not in seen:
+                seen.add(name)
+                image.symbols.append((name, value))
+    return image
+
+def align(n):
+    return (n + PAGE - 1) // PAGE * PAGE
+
+def write_image(image, out):
+    strings = b''.join(name + b'\0' for name, _ in image.symbols)
+    strings_offset = (struct.calcsize(HEADER) + len(image.extents) * struct.calcsize(EXTENT)
+                      + len(image.symbols) * struct.calcsize(SYMBOL))
+    flags = 0 if image.entry is None else ENTRY
+    tables = [struct.pack(HEADER, MAGIC, flags, image.entry or 0, len(image.extents),
+                          len(image.symbols), strings_offset, len(strings))]
+    offset = align(strings_offset + len(strings))
+    for address, data, mem_length in image.extents:
+        tables.append(struct.pack(EXTENT, address, len(data), mem_length, offset if data else 0))
+        if data:
+            offset = align(offset + len(data))
+    name = 0
+    for sym, value in image.symbols:
+        tables.append(struct.pack(SYMBOL, value, name))
+        name += len(sym) + 1
+    tables.append(strings)
+    out.write(b''.join(tables))
+
+    for _, data, _ in image.extents:
+        if data:
+            out.seek(align(out.tell()))
+            out.write(data)
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    if data[:4] == b'\x7fELF':
+        image = read_elf(data)
+    else:
+        image = read_text(data)
+    with open(sys.argv[2], 'wb') as out:
+        write_image(image, out)
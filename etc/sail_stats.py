@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+"""Print the statistics of a running Sail C model (run with
+--stats-file FILE), as text, or with --prometheus in the Prometheus
+text exposition format, e.g. for the node exporter's textfile
+collector. Reading the file does not disturb the model, so this can be
+run under watch. See the statistics section of lib/rts.c for the
+layout.
+
+usage: sail_stats.py [--prometheus] FILE
+"""
+
+import sys
+import struct
+
+MAGIC = b'SAILSTA1'
+
+HEADER = '<8s15Q'
+
+# In the order of enum sail_stat in lib/rts.h.
+COUNTERS = ['instructions', 'mem_blocks', 'loads', 'stores',
+            'tlb_hits', 'tlb_misses', 'decode_hits', 'decode_misses']
+
+THREADS = 64
+
+def read_stats(data):
+    (magic, pid, counters, slot_size, threads, cycles, kips,
+     start_ns, update_ns) = struct.unpack_from(HEADER, data)[:9]
+    if magic != MAGIC:
+        sys.exit('not a Sail statistics file')
+    stats = {'pid': pid, 'cycles': cycles, 'mips': kips / 1000.0,
+             'seconds': max(update_ns - start_ns, 0) / 1e9}
+    totals = [0] * counters
+    offset = struct.calcsize(HEADER)
+    for i in range(min(threads, THREADS)):
+        slot = struct.unpack_from('<%dQ' % counters, data, offset + i * slot_size * 8)
+        totals = [t + c for t, c in zip(totals, slot)]
+    for name, total in zip(COUNTERS, totals):
+        stats[name] = total
+    return stats
+
+def rate(hits, misses):
+    return '-' if hits + misses == 0 else '%.2f%%' % (100.0 * hits / (hits + misses))
+
+def print_text(stats, out):
+    out.write('pid           %d\n' % stats['pid'])
+    out.write('seconds       %.1f\n' % stats['seconds'])
+    out.write('cycles        %d\n' % stats['cycles'])
+    out.write('instructions  %d\n' % stats['instructions'])
+    out.write('MIPS          %.2f\n' % stats['mips'])
+    out.write('blocks        %d\n' % stats['mem_blocks'])
+    out.write('loads         %d\n' % stats['loads'])
+    out.write('stores        %d\n' % stats['stores'])
+    out.write('TLB hits      %s\n' % rate(stats['tlb_hits'], stats['tlb_misses']))
+    out.write('decode hits   %s\n' % rate(stats['decode_hits'], stats['decode_misses']))
+
+def print_prometheus(stats, out):
+    labels = '{pid="%d"}' % stats['pid']
+    out.write('# TYPE sail_cycles_total counter\n')
+    out.write('sail_cycles_total%s %d\n' % (labels, stats['cycles']))
+    for name in COUNTERS:
+        out.write('# TYPE sail_%s_total counter\n' % name)
+        out.write('sail_%s_total%s %d\n' % (name, labels, stats[name]))
+    out.write('# TYPE sail_mips gauge\n')
+    out.write('sail_mips%s %.3f\n' % (labels, stats['mips']))
+    out.write('# TYPE sail_seconds gauge\n')
+    out.write('sail_seconds%s %.3f\n' % (labels, stats['seconds']))
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    prometheus = '--prometheus' in args
+    args = [a for a in args if a != '--prometheus']
+    if len(args) != 1:
+        sys.exit(__doc__)
+    with open(args[0], 'rb') as f:
+        data = f.read()
+    stats = read_stats(data)
+    if prometheus:
+        print_prometheus(stats, sys.stdout)
+    else:
+        print_text(stats, sys.stdout)
@@ -10,6 +10,13 @@
 // Use the zlib library to uncompress ELF.gz files
 #include <zlib.h>
 
+// Uncompressed files are mapped rather than read
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // Define ELF constants/types. These come from the
 // Tool Interface Standard Executable and Linking Format Specification 1.2
 
@@ -246,15 +253,9 @@ typedef struct
 } Elf64_Sym;
 
 void loadBlock32(const char* buffer, Elf32_Off off, Elf32_Addr addr, Elf32_Word filesz, Elf32_Word memsz) {
-    //// std::cout << "Loading block from " << off << " to " << addr << "+:" << filesz << std::endl;
-    for(Elf32_Off i = 0; i < filesz; ++i) {
-        //// std::cout << "Writing " << (int)buffer[off+i] << " to " << addr+i << std::endl;
-	write_mem(addr+i, 0xff & buffer[off+i]);
-    }
+    write_mem_block(addr, buffer + off, filesz);
     // Zero fill if p_memsz > p_filesz
-    for(Elf32_Off i = filesz; i < memsz; ++i) {
-	write_mem(addr+i, 0);
-    }
+    if (memsz > filesz) zero_mem_block(addr + filesz, memsz - filesz);
 }
 
 void loadProgHdr32(bool le, const char* buffer, Elf32_Off off, const int total_file_size) {
@@ -276,16 +277,10 @@ void loadProgHdr32(bool le, const char* buffer, Elf32_Off off, const int total_f
     }
 }
 
-void loadBlock64(const char* buffer, Elf64_Off off, Elf64_Addr addr, Elf64_Word filesz, Elf64_Word memsz) {
-    //// std::cout << "Loading block from " << off << " to " << addr << "+:" << filesz << std::endl;
-    for(Elf64_Off i = 0; i < filesz; ++i) {
-        // fprintf(stderr, "Writing 0x%x to 0x%lx\n", (int)buffer[off+i], addr+i);
-	write_mem(addr+i, 0xff & buffer[off+i]);
-    }
+void loadBlock64(const char* buffer, Elf64_Off off, Elf64_Addr addr, Elf64_Xword filesz, Elf64_Xword memsz) {
+    write_mem_block(addr, buffer + off, filesz);
     // Zero fill if p_memsz > p_filesz
-    for(Elf64_Off i = filesz; i < memsz; ++i) {
-	write_mem(addr+i, 0);
-    }
+    if (memsz > filesz) zero_mem_block(addr + filesz, memsz - filesz);
 }
 
 void loadProgHdr64(bool le, const char* buffer, Elf64_Off off, const int total_file_size) {
@@ -298,7 +293,7 @@ void loadProgHdr64(bool le, const char* buffer, Elf64_Off off, const int total_f
     // Only PT_LOAD segments should be loaded;
     if (rdWord64(le, phdr->p_type) == PT_LOAD) {
         Elf64_Off off = rdOff64(le, phdr->p_offset);
-        Elf64_Word filesz = rdXword64(le, phdr->p_filesz);
+        Elf64_Xword filesz = rdXword64(le, phdr->p_filesz);
         if (filesz > total_file_size - off) {
 	  fprintf(stderr, "Invalid ELF file, section overruns end of file\n");
 	  exit(EXIT_FAILURE);
@@ -374,25 +369,84 @@ void loadELFHdr(const char* buffer, const int total_file_size, bool *is32bit_p,
     }
 }
 
-void load_elf(char *filename, bool *is32bit_p, uint64_t *entry) {
-    // Read input file into memory
+/*
+ * The ELF file most recently loaded or queried for symbols. It is kept
+ * open so that lookup_sym, which is usually called for a few symbols
+ * right after load_elf, does not read the file again. Uncompressed
+ * files are mapped, gzipped ones are decompressed into a buffer.
+ */
+struct elf_sym {
+    const char *name;  // Points into the image's string table
+    uint64_t    value;
+};
+
+static struct {
+    char   *filename;
+    char   *buffer;
+    int     size;
+    bool    mapped;
+    bool    syms_loaded;
+    int     syms_status;
+    struct elf_sym *syms;  // Open addressed hash table of symbols
+    size_t  sym_mask;      // Table size - 1, a power of two minus one
+} elf_image;
+
+void close_elf(void) {
+    if (elf_image.mapped) {
+        munmap(elf_image.buffer, elf_image.size);
+    } else {
+        free(elf_image.buffer);
+    }
+    free(elf_image.filename);
+    free(elf_image.syms);
+    memset(&elf_image, 0, sizeof(elf_image));
+}
+
+static bool mapELF(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    unsigned char magic[2];
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 2 || st.st_size > INT_MAX
+        || pread(fd, magic, 2, 0) != 2 || (magic[0] == 0x1f && magic[1] == 0x8b)) {
+        close(fd);
+        return false;
+    }
+
+    void *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) return false;
+
+    elf_image.buffer = buffer;
+    elf_image.size = st.st_size;
+    elf_image.mapped = true;
+    return true;
+}
+
+static void readELF(const char *filename) {
     char* buffer = NULL;
     int   size   = 0;
-    int   chunk  = (1<<24); // increments output buffer this much
+    int   chunk  = (1<<24); // initial size of output buffer, doubled as needed
     int   read   = 0;
     gzFile in = gzopen(filename, "rb");
     if (in == NULL) { goto fail; }
     while (!gzeof(in)) {
-        size = read + chunk;
-        buffer = (char*)realloc(buffer, size);
-        if (buffer == NULL) { goto fail; }
+        if (read == size) {
+            if (size > INT_MAX / 2) { goto fail; }
+            size = size ? size * 2 : chunk;
+            buffer = (char*)realloc(buffer, size);
+            if (buffer == NULL) { goto fail; }
+        }
 
         int s = gzread(in, buffer+read, size - read);
         if (s < 0) { goto fail; }
         read += s;
     }
-    loadELFHdr(buffer, read, is32bit_p, entry);
-    free(buffer);
+    gzclose(in);
+    elf_image.buffer = buffer;
+    elf_image.size = read;
+    elf_image.mapped = false;
     return;
 
 fail:
@@ -400,10 +454,63 @@ fail:
     exit(EXIT_FAILURE);
 }
 
-// symbol lookup for very simple ELF files (single symtab, two strtabs): looks up a
-// single symbol at a time, but avoids retaining memory.
+static void openELF(const char *filename) {
+    if (elf_image.filename != NULL && !strcmp(elf_image.filename, filename)) return;
+    close_elf();
+    if (!mapELF(filename)) readELF(filename);
+    elf_image.filename = strdup(filename);
+}
+
+void load_elf(char *filename, bool *is32bit_p, uint64_t *entry) {
+    openELF(filename);
+    loadELFHdr(elf_image.buffer, elf_image.size, is32bit_p, entry);
+}
+
+static uint64_t hashSymbol(const char *name) {
+    // FNV-1a
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (; *name; name++) {
+        h = (h ^ (uint8_t) *name) * UINT64_C(0x100000001b3);
+    }
+    return h;
+}
 
-int lookupSymbol(const char *buffer, const int total_file_size, const char *symname, uint64_t *value) {
+static void allocSymbols(uint64_t count) {
+    size_t n = 16;
+    while (n < 2 * count) n *= 2;
+    elf_image.syms = calloc(n, sizeof(struct elf_sym));
+    if (elf_image.syms == NULL) {
+        fprintf(stderr, "Unable to allocate ELF symbol table\n");
+        exit(EXIT_FAILURE);
+    }
+    elf_image.sym_mask = n - 1;
+}
+
+// The first symbol with a given name wins, as with a linear search.
+static void insertSymbol(const char *name, uint64_t value) {
+    for (size_t i = hashSymbol(name) & elf_image.sym_mask; ; i = (i + 1) & elf_image.sym_mask) {
+        struct elf_sym *sym = &elf_image.syms[i];
+        if (sym->name == NULL) {
+            sym->name = name;
+            sym->value = value;
+            return;
+        }
+        if (!strcmp(sym->name, name)) return;
+    }
+}
+
+static struct elf_sym *findSymbol(const char *name) {
+    for (size_t i = hashSymbol(name) & elf_image.sym_mask; ; i = (i + 1) & elf_image.sym_mask) {
+        struct elf_sym *sym = &elf_image.syms[i];
+        if (sym->name == NULL) return NULL;
+        if (!strcmp(sym->name, name)) return sym;
+    }
+}
+
+// symbol table for very simple ELF files (single symtab, two strtabs): reads every
+// symbol into the hash table of elf_image.
+
+int loadSymbols(const char *buffer, const int total_file_size) {
     checkELFHdr(buffer, total_file_size);
     Elf32_Ehdr *hdr = (Elf32_Ehdr*) &buffer[0];
     if (hdr->e_ident[EI_CLASS] == ELFCLASS32) {
@@ -445,6 +552,7 @@ int lookupSymbol(const char *buffer, const int total_file_size, const char *symn
         const char *strtab = buffer + rdOff32(le, shdr[strtabidx].sh_offset);
         Elf32_Word strtab_size = rdWord32(le, shdr[strtabidx].sh_size);
         Elf32_Sym *sym_ent = (Elf32_Sym *)(buffer + rdOff32(le, shdr[symtabidx].sh_offset));
+        allocSymbols(rdWord32(le, shdr[symtabidx].sh_size)/sizeof(*sym_ent));
         for (Elf32_Word i = 0; i < rdWord32(le, shdr[symtabidx].sh_size)/sizeof(*sym_ent); i++) {
             Elf32_Word sidx = rdWord32(le, sym_ent[i].st_name);
             if (sidx >= strtab_size) {
@@ -457,12 +565,9 @@ int lookupSymbol(const char *buffer, const int total_file_size, const char *symn
                 fprintf(stderr, "Unterminated symbol name\n");
                 exit(EXIT_FAILURE);
             }
-            if (!strcmp(sname, symname)) {
-                if (value) *value = (uint64_t) rdAddr32(le, sym_ent[i].st_value);
-                return 0;
-            }
+            insertSymbol(sname, (uint64_t) rdAddr32(le, sym_ent[i].st_value));
         }
-        return -1;
+        return 0;
     } else if (hdr->e_ident[EI_CLASS] == ELFCLASS64) {
         bool le = hdr->e_ident[EI_DATA] == ELFDATA2LSB;
         Elf64_Ehdr *ehdr = (Elf64_Ehdr*) &buffer[0];
@@ -502,6 +607,7 @@ int lookupSymbol(const char *buffer, const int total_file_size, const char *symn
         const char *strtab = buffer + rdOff64(le, shdr[strtabidx].sh_offset);
         Elf64_Xword strtab_size = rdXword64(le, shdr[strtabidx].sh_size);
         Elf64_Sym *sym_ent = (Elf64_Sym *)(buffer + rdOff64(le, shdr[symtabidx].sh_offset));
+        allocSymbols(rdXword64(le, shdr[symtabidx].sh_size)/sizeof(*sym_ent));
         for (Elf64_Xword i = 0; i < rdXword64(le, shdr[symtabidx].sh_size)/sizeof(*sym_ent); i++) {
             Elf64_Word sidx = rdWord64(le, sym_ent[i].st_name);
             if (sidx >= strtab_size) {
@@ -514,12 +620,9 @@ int lookupSymbol(const char *buffer, const int total_file_size, const char *symn
                 fprintf(stderr, "Unterminated symbol name\n");
                 exit(EXIT_FAILURE);
             }
-            if (!strcmp(sname, symname)) {
-                if (value) *value = (uint64_t) rdAddr64(le, sym_ent[i].st_value);
-                return 0;
-            }
+            insertSymbol(sname, (uint64_t) rdAddr64(le, sym_ent[i].st_value));
         }
-        return -1;
+        return 0;
     } else {
         fprintf(stderr, "Unrecognized ELF file format\n");
         exit(EXIT_FAILURE);
@@ -527,33 +630,19 @@ int lookupSymbol(const char *buffer, const int total_file_size, const char *symn
 }
 
 int lookup_sym(const char *filename, const char *symname, uint64_t *value) {
-    // Read input file into memory
-    char* buffer = NULL;
-    int   size   = 0;
-    int   chunk  = (1<<24); // increments output buffer this much
-    int   read   = 0;
-    int   ret    = 0;
-    gzFile in = gzopen(filename, "rb");
-    if (in == NULL) { goto fail; }
-    while (!gzeof(in)) {
-        size = read + chunk;
-        buffer = (char*)realloc(buffer, size);
-        if (buffer == NULL) { goto fail; }
-
-        int s = gzread(in, buffer+read, size - read);
-        if (s < 0) { goto fail; }
-        read += s;
+    openELF(filename);
+    if (!elf_image.syms_loaded) {
+        if (image_symbols(filename, elf_image.buffer, elf_image.size, allocSymbols, insertSymbol)) {
+            elf_image.syms_status = 0;
+        } else {
+            elf_image.syms_status = loadSymbols(elf_image.buffer, elf_image.size);
+        }
+        elf_image.syms_loaded = true;
     }
-    ret = lookupSymbol(buffer, read, symname, value);
-    free(buffer);
-    return ret;
+    if (elf_image.syms_status < 0) return -1;
 
-fail:
-    fprintf(stderr, "Unable to read file %s\n", filename);
-    exit(EXIT_FAILURE);
+    struct elf_sym *sym = findSymbol(symname);
+    if (sym == NULL) return -1;
+    if (value) *value = sym->value;
+    return 0;
 }
-
-////////////////////////////////////////////////////////////////
-// ELF Loader
-////////////////////////////////////////////////////////////////
-
@@ -6,3 +6,9 @@
 
 void load_elf(char *filename, bool *is32bit_p, uint64_t *entry);
 int  lookup_sym(const char *filename, const char *symname, uint64_t *value);
+
+/*
+ * Release the ELF file kept open by load_elf and lookup_sym. Called by
+ * cleanup_rts.
+ */
+void close_elf(void);
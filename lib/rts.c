@@ -1,11 +1,23 @@
 #include<string.h>
 #include<getopt.h>
 #include<inttypes.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<sched.h>
+#include<stdatomic.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<time.h>
+#include<unistd.h>
 
 #include"sail.h"
 #include"rts.h"
 #include"elf.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include<x86intrin.h>
+#endif
+
 static uint64_t g_elf_entry;
 uint64_t g_cycle_count = 0;
 static uint64_t g_cycle_limit;
@@ -46,412 +58,2143 @@ unit sleep_request(const unit u)
   return UNIT;
 }
 
-unit wakeup_request(const unit u)
+unit wakeup_request(const unit u)
+{
+  fprintf(stderr, "Sail CPU model waking up\n");
+  g_sleeping = false;
+  return UNIT;
+}
+
+bool sleeping(const unit u)
+{
+    return g_sleeping;
+}
+
+/* ***** Sail memory builtins ***** */
+
+/*
+ * We organise memory available to the sail model into dynamically
+ * allocated MASK + 1 size blocks. Blocks are found via a radix page
+ * table indexed by the high bits of the address (address >> BLOCK_BITS),
+ * with a one entry cache in front of it for the most recently used
+ * block, so lookup is constant time regardless of how many blocks
+ * have been allocated.
+ *
+ * Several threads may share the memory (see share_mem). Nodes and
+ * leaves are only ever added while the model runs, so lookups need no
+ * lock, only the allocation of a new block takes one. The cache is
+ * kept per thread.
+ */
+#define BLOCK_BITS 24
+#define LEVEL_BITS 10
+#define LEVELS ((64 - BLOCK_BITS + LEVEL_BITS - 1) / LEVEL_BITS)
+#define LEVEL_SIZE (UINT64_C(1) << LEVEL_BITS)
+
+/*
+ * Must be one less than a power of two.
+ */
+uint64_t MASK = (UINT64_C(1) << BLOCK_BITS) - 1;
+
+/*
+ * Each node in the page table is an array of LEVEL_SIZE pointers,
+ * either to further nodes or, at the last level, to the memory for
+ * a block.
+ */
+struct page_table {
+  void **root;
+  pthread_mutex_t lock;
+};
+
+struct pt_cache {
+  /* Block id of the last block accessed, or 1 (which can never be a
+     block id because the low BLOCK_BITS of a block id are zero) if
+     the cache is empty. */
+  uint64_t last_id;
+  void *last_leaf;
+};
+
+static struct page_table sail_memory = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local struct pt_cache g_pt_cache = { 1, NULL };
+
+/*
+ * Each leaf holds the MASK + 1 bytes of a block followed by its tags,
+ * a bitmap with one bit for each tag granule of 2^g_tag_granule_bits
+ * bytes (see set_tag_granule). The bitmap is padded to a whole number
+ * of TAG_PAD bytes, so that leaves stay page aligned one after another
+ * in a checkpoint.
+ */
+#define TAG_PAD 4096
+#define MAX_TAG_GRANULE_BITS 12
+
+static unsigned g_tag_granule_bits = 0;
+
+static inline size_t tags_size(void)
+{
+  size_t bytes = ((MASK + 1) >> g_tag_granule_bits) / 8;
+  return (bytes + TAG_PAD - 1) / TAG_PAD * TAG_PAD;
+}
+
+static inline size_t block_size(void)
+{
+  return (MASK + 1) + tags_size();
+}
+
+static inline uint64_t *block_tags(void *leaf)
+{
+  return (uint64_t *) ((uint8_t *) leaf + MASK + 1);
+}
+
+/*
+ * A range of memory reserved up front by map_mem, as consecutive
+ * leaves g_ram_stride bytes apart in one mapping, so the leaf for an
+ * address in the range is found by arithmetic alone. g_ram_size is
+ * zero if there is no such range.
+ */
+static uint64_t g_ram_base = 0;
+static uint64_t g_ram_size = 0;
+static size_t g_ram_stride = 0;
+static uint8_t *g_ram_host = NULL;
+static size_t g_ram_mapped = 0;
+
+static inline bool in_ram(const void *ptr)
+{
+  return (const uint8_t *) ptr >= g_ram_host && (const uint8_t *) ptr < g_ram_host + g_ram_mapped;
+}
+
+static inline uint64_t level_index(const uint64_t address, const int level)
+{
+  return (address >> (BLOCK_BITS + (LEVELS - 1 - level) * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+}
+
+static inline void *pt_load(void **slot)
+{
+  return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Find the leaf for the block containing address, or NULL if no such
+ * block has been allocated.
+ */
+static inline void *pt_lookup(struct page_table *pt, const uint64_t address)
+{
+  if (address - g_ram_base < g_ram_size) {
+    return g_ram_host + ((address - g_ram_base) >> BLOCK_BITS) * g_ram_stride;
+  }
+
+  uint64_t block_id = address & ~MASK;
+  if (g_pt_cache.last_id == block_id) return g_pt_cache.last_leaf;
+
+  void **node = pt_load((void **) &pt->root);
+  for (int level = 0; level < LEVELS; level++) {
+    if (node == NULL) return NULL;
+    node = (void **) pt_load(&node[level_index(address, level)]);
+  }
+
+  if (node != NULL) {
+    g_pt_cache.last_id = block_id;
+    g_pt_cache.last_leaf = node;
+  }
+  return node;
+}
+
+/*
+ * Return the slot in the last level node of the page table that holds
+ * the leaf for the block containing address, allocating the root and
+ * any intermediate nodes if they do not exist yet. Must be called
+ * with pt->lock held, or before any other thread has been started.
+ */
+static void **pt_slot(struct page_table *pt, const uint64_t address)
+{
+  if (pt->root == NULL) {
+    __atomic_store_n(&pt->root, calloc(LEVEL_SIZE, sizeof(void *)), __ATOMIC_RELEASE);
+  }
+  void **node = pt->root;
+  for (int level = 0; level < LEVELS - 1; level++) {
+    void **next = (void **) node[level_index(address, level)];
+    if (next == NULL) {
+      next = calloc(LEVEL_SIZE, sizeof(void *));
+      __atomic_store_n(&node[level_index(address, level)], next, __ATOMIC_RELEASE);
+    }
+    node = next;
+  }
+  return &node[level_index(address, LEVELS - 1)];
+}
+
+/*
+ * Like pt_lookup, but allocate the leaf (zero filled, size bytes) and
+ * any intermediate nodes if they do not exist yet.
+ */
+static void *pt_lookup_alloc(struct page_table *pt, const uint64_t address, const size_t size, const char *kind)
+{
+  void *leaf = pt_lookup(pt, address);
+  if (leaf != NULL) return leaf;
+
+  uint64_t block_id = address & ~MASK;
+  pthread_mutex_lock(&pt->lock);
+  void **slot = pt_slot(pt, address);
+
+  /* Another thread may have allocated the block in the meantime. */
+  leaf = *slot;
+  if (leaf == NULL) {
+    fprintf(stderr, "[Sail] Allocating new %s0x%" PRIx64 "\n", kind, block_id);
+    leaf = calloc(size, 1);
+    if (leaf == NULL) {
+      fprintf(stderr, "[Sail] Could not allocate memory for block 0x%" PRIx64 "\n", block_id);
+      exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+    sail_stat_add(STAT_MEM_BLOCKS, 1);
+  }
+  pthread_mutex_unlock(&pt->lock);
+
+  g_pt_cache.last_id = block_id;
+  g_pt_cache.last_leaf = leaf;
+  return leaf;
+}
+
+/*
+ * The leaves are also entered in the page table, so that everything
+ * that walks it (such as saving a checkpoint) sees them. Leaves are
+ * rounded up to a multiple of the huge page size when asking for huge
+ * pages, so that each block starts on one.
+ */
+#define HUGE_PAGE (UINT64_C(1) << 21)
+
+void map_mem(const uint64_t address, const uint64_t size, const bool huge_pages)
+{
+  if ((address & MASK) != 0 || size == 0 || g_ram_size != 0 || sail_memory.root != NULL) {
+    fprintf(stderr, "[Sail] Cannot map memory at 0x%" PRIx64 ", it must be block aligned and mapped before use\n", address);
+    exit(EXIT_FAILURE);
+  }
+  uint64_t blocks = (size + MASK) / (MASK + 1);
+  size_t stride = block_size();
+  if (huge_pages) stride = (stride + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+  size_t len = blocks * stride;
+  void *host = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (host == MAP_FAILED) {
+    fprintf(stderr, "[Sail] Could not map %" PRIu64 " bytes of memory at 0x%" PRIx64 "\n", size, address);
+    exit(EXIT_FAILURE);
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages && madvise(host, len, MADV_HUGEPAGE) != 0) {
+    fprintf(stderr, "[Sail] Huge pages are not available, using normal pages\n");
+  }
+#endif
+
+  for (uint64_t i = 0; i < blocks; i++) {
+    *pt_slot(&sail_memory, address + i * (MASK + 1)) = (uint8_t *) host + i * stride;
+  }
+  g_ram_host = host;
+  g_ram_mapped = len;
+  g_ram_stride = stride;
+  g_ram_base = address;
+  g_ram_size = blocks * (MASK + 1);
+}
+
+/*
+ * Call f on the id and leaf of every allocated block, in address order.
+ */
+static void pt_walk(void **node, const int level, const uint64_t prefix,
+                    void (*f)(uint64_t, void *, void *), void *env)
+{
+  if (node == NULL) return;
+  for (uint64_t i = 0; i < LEVEL_SIZE; i++) {
+    if (node[i] == NULL) continue;
+    uint64_t id = prefix | (i << (BLOCK_BITS + (LEVELS - 1 - level) * LEVEL_BITS));
+    if (level < LEVELS - 1) {
+      pt_walk((void **) node[i], level + 1, id, f, env);
+    } else {
+      f(id, node[i], env);
+    }
+  }
+}
+
+/*
+ * Leaves restored from a checkpoint point into its mapping rather than
+ * being individually allocated (see below).
+ */
+static char *g_checkpoint_base = NULL;
+static size_t g_checkpoint_size = 0;
+
+static inline bool in_checkpoint(const void *ptr)
+{
+  return (const char *) ptr >= g_checkpoint_base
+    && (const char *) ptr < g_checkpoint_base + g_checkpoint_size;
+}
+
+static void pt_free_node(void **node, const int level)
+{
+  if (node == NULL) return;
+  for (uint64_t i = 0; i < LEVEL_SIZE; i++) {
+    if (level < LEVELS - 1) {
+      pt_free_node((void **) node[i], level + 1);
+    } else if (!in_checkpoint(node[i]) && !in_ram(node[i])) {
+      free(node[i]);
+    }
+  }
+  free(node);
+}
+
+static void pt_free(struct page_table *pt)
+{
+  pt_free_node(pt->root, 0);
+  pt->root = NULL;
+  g_pt_cache.last_id = 1;
+  g_pt_cache.last_leaf = NULL;
+}
+
+/*
+ * Watched pages are kept in a bitmap indexed by the low bits of the
+ * page number, with a generation for each bit, so a write to a watched
+ * page also bumps the generation of the pages that share its bit.
+ */
+static uint64_t g_watch_bitmap[WATCH_SLOTS / 64];
+uint64_t sail_page_generations[WATCH_SLOTS];
+static bool g_watching = false;
+
+static inline void mem_watched(const uint64_t address, const uint64_t len)
+{
+  uint64_t last = (address + len - 1) >> WATCH_PAGE_BITS;
+  for (uint64_t page = address >> WATCH_PAGE_BITS; page <= last; page++) {
+    uint64_t slot = page & (WATCH_SLOTS - 1);
+    uint64_t bit = UINT64_C(1) << (slot % 64);
+    if (__atomic_load_n(&g_watch_bitmap[slot / 64], __ATOMIC_RELAXED) & bit) {
+      /* Clear the mark before publishing the new generation, so that a
+         thread which reads the new generation marks the page again
+         after the clear. */
+      __atomic_fetch_and(&g_watch_bitmap[slot / 64], ~bit, __ATOMIC_SEQ_CST);
+      __atomic_fetch_add(&sail_page_generations[slot], 1, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+uint64_t watch_mem_page(const uint64_t address)
+{
+  uint64_t slot = (address >> WATCH_PAGE_BITS) & (WATCH_SLOTS - 1);
+  uint64_t generation = __atomic_load_n(&sail_page_generations[slot], __ATOMIC_ACQUIRE);
+  if (!__atomic_load_n(&g_watching, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&g_watching, true, __ATOMIC_SEQ_CST);
+  }
+  __atomic_fetch_or(&g_watch_bitmap[slot / 64], UINT64_C(1) << (slot % 64), __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return generation;
+}
+
+/*
+ * Once share_mem has been called, every write takes the lock for the
+ * 8 byte granules it touches, from a fixed table of locks indexed by
+ * a hash of the granule address, and bumps the version of the lock.
+ * A thread can hold (at most) one of those locks across a sequence of
+ * accesses with lock_mem, so that the sequence is atomic with respect
+ * to the writes of other threads, and compare versions to find out
+ * whether anybody else wrote to the granule since it last looked.
+ */
+#define MEM_LOCK_BITS 12
+#define MEM_GRANULE_BITS 3
+
+struct mem_lock {
+  atomic_flag held;
+  uint64_t version;
+  char pad[64 - sizeof(atomic_flag) - sizeof(uint64_t)];
+};
+
+static bool g_mem_shared = false;
+static struct mem_lock g_mem_locks[1 << MEM_LOCK_BITS];
+
+/* The lock held by this thread through lock_mem, or NULL. */
+static _Thread_local struct mem_lock *g_mem_held = NULL;
+
+void share_mem(void)
+{
+  for (size_t i = 0; i < (1 << MEM_LOCK_BITS); i++) {
+    atomic_flag_clear(&g_mem_locks[i].held);
+  }
+  g_mem_shared = true;
+}
+
+static inline struct mem_lock *mem_lock_for(const uint64_t address)
+{
+  uint64_t granule = address >> MEM_GRANULE_BITS;
+  return &g_mem_locks[(granule ^ (granule >> MEM_LOCK_BITS)) & ((1 << MEM_LOCK_BITS) - 1)];
+}
+
+static inline void mem_lock_acquire(struct mem_lock *l)
+{
+  while (atomic_flag_test_and_set_explicit(&l->held, memory_order_acquire)) {
+    sched_yield();
+  }
+}
+
+static inline void mem_lock_release(struct mem_lock *l)
+{
+  atomic_flag_clear_explicit(&l->held, memory_order_release);
+}
+
+unit lock_mem(const mach_bits address)
+{
+  if (!g_mem_shared) return UNIT;
+  struct mem_lock *l = mem_lock_for(address);
+  if (g_mem_held != l) {
+    if (g_mem_held != NULL) mem_lock_release(g_mem_held);
+    mem_lock_acquire(l);
+    g_mem_held = l;
+  }
+  return UNIT;
+}
+
+unit unlock_mem(const unit u)
+{
+  if (g_mem_held != NULL) {
+    mem_lock_release(g_mem_held);
+    g_mem_held = NULL;
+  }
+  return UNIT;
+}
+
+uint64_t locked_mem_version(void)
+{
+  if (g_mem_held == NULL) return 0;
+  /* Include which lock it is, so versions of different locks differ. */
+  return (g_mem_held->version << MEM_LOCK_BITS) | (uint64_t) (g_mem_held - g_mem_locks);
+}
+
+/*
+ * Lock the granules written by a write of len bytes to address, in
+ * ascending order so that two writes can't deadlock, and bump their
+ * versions. Writes of more than a granule's worth (which only happen
+ * when loading) lock nothing, the loader runs before the threads.
+ */
+static inline void mem_write_begin(const uint64_t address, const uint64_t len, struct mem_lock **locks)
+{
+  locks[0] = locks[1] = NULL;
+  if (!g_mem_shared || len == 0 || len > (1 << MEM_GRANULE_BITS)) return;
+  struct mem_lock *a = mem_lock_for(address);
+  struct mem_lock *b = mem_lock_for(address + len - 1);
+  if (b < a) {
+    struct mem_lock *t = a;
+    a = b;
+    b = t;
+  }
+  if (a != g_mem_held) {
+    mem_lock_acquire(a);
+    locks[0] = a;
+  }
+  if (b != a && b != g_mem_held) {
+    mem_lock_acquire(b);
+    locks[1] = b;
+  }
+  a->version++;
+  if (b != a) b->version++;
+}
+
+/*
+ * Check for watched pages once the bytes have been stored, and before
+ * the locks are released. A thread that marks a page and then reads
+ * it either sees the new bytes, or is seen by the check here.
+ */
+static inline void mem_write_end(const uint64_t address, const uint64_t len, struct mem_lock **locks)
+{
+  if (__atomic_load_n(&g_watching, __ATOMIC_RELAXED) && len != 0) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    mem_watched(address, len);
+  }
+  if (locks[1] != NULL) mem_lock_release(locks[1]);
+  if (locks[0] != NULL) mem_lock_release(locks[0]);
+}
+
+/*
+ * All sail vectors are at least 64-bits, but only the bottom 8 bits
+ * are used in the second argument.
+ */
+void write_mem(uint64_t address, uint64_t byte)
+{
+  struct mem_lock *locks[2];
+  uint8_t *mem = pt_lookup_alloc(&sail_memory, address, block_size(), "block ");
+  mem_write_begin(address, 1, locks);
+  mem[address & MASK] = (uint8_t) byte;
+  mem_write_end(address, 1, locks);
+}
+
+uint64_t read_mem(uint64_t address)
+{
+  uint8_t *mem = pt_lookup(&sail_memory, address);
+  return mem == NULL ? 0x00 : (uint64_t) mem[address & MASK];
+}
+
+/*
+ * Copy len bytes from data to memory starting at address, one block
+ * at a time.
+ */
+void write_mem_block(uint64_t address, const void *data, uint64_t len)
+{
+  struct mem_lock *locks[2];
+  mem_write_begin(address, len, locks);
+  const uint8_t *src = data;
+  for (uint64_t done = 0; done < len;) {
+    uint64_t offset = (address + done) & MASK;
+    uint64_t chunk = MASK + 1 - offset < len - done ? MASK + 1 - offset : len - done;
+    uint8_t *mem = pt_lookup_alloc(&sail_memory, address + done, block_size(), "block ");
+    memcpy(mem + offset, src + done, chunk);
+    done += chunk;
+  }
+  mem_write_end(address, len, locks);
+}
+
+/*
+ * Blocks that have not been allocated already read as zero, so only
+ * allocated ones need clearing.
+ */
+void zero_mem_block(uint64_t address, uint64_t len)
+{
+  struct mem_lock *locks[2];
+  mem_write_begin(address, len, locks);
+  for (uint64_t done = 0; done < len;) {
+    uint64_t offset = (address + done) & MASK;
+    uint64_t chunk = MASK + 1 - offset < len - done ? MASK + 1 - offset : len - done;
+    uint8_t *mem = pt_lookup(&sail_memory, address + done);
+    if (mem != NULL) memset(mem + offset, 0, chunk);
+    done += chunk;
+  }
+  mem_write_end(address, len, locks);
+}
+
+void set_tag_granule(const uint64_t bytes)
+{
+  if (bytes == 0 || (bytes & (bytes - 1)) != 0 || bytes > (UINT64_C(1) << MAX_TAG_GRANULE_BITS)) {
+    fprintf(stderr, "[Sail] Tag granule must be a power of two of at most %d bytes\n", 1 << MAX_TAG_GRANULE_BITS);
+    exit(EXIT_FAILURE);
+  }
+  if (sail_memory.root != NULL) {
+    fprintf(stderr, "[Sail] Tag granule must be set before memory is written\n");
+    exit(EXIT_FAILURE);
+  }
+  g_tag_granule_bits = __builtin_ctzll(bytes);
+}
+
+/*
+ * With share_mem, other threads may be writing the tags of nearby
+ * granules, which share the word.
+ */
+static inline void tag_word_and(uint64_t *word, const uint64_t mask)
+{
+  if (g_mem_shared) {
+    __atomic_fetch_and(word, mask, __ATOMIC_RELAXED);
+  } else {
+    *word &= mask;
+  }
+}
+
+unit write_tag_bool(const uint64_t address, const bool tag)
+{
+  uint64_t granule = (address & MASK) >> g_tag_granule_bits;
+  uint64_t bit = UINT64_C(1) << (granule % 64);
+  uint64_t *tags = block_tags(pt_lookup_alloc(&sail_memory, address, block_size(), "block "));
+  if (!tag) {
+    tag_word_and(&tags[granule / 64], ~bit);
+  } else if (g_mem_shared) {
+    __atomic_fetch_or(&tags[granule / 64], bit, __ATOMIC_RELAXED);
+  } else {
+    tags[granule / 64] |= bit;
+  }
+  return UNIT;
+}
+
+bool read_tag_bool(const uint64_t address)
+{
+  void *leaf = pt_lookup(&sail_memory, address);
+  if (leaf == NULL) return false;
+  uint64_t granule = (address & MASK) >> g_tag_granule_bits;
+  return (block_tags(leaf)[granule / 64] >> (granule % 64)) & 1;
+}
+
+/*
+ * Clear the bits first to last (inclusive) of a tag bitmap, a word at
+ * a time.
+ */
+static void clear_tag_bits(uint64_t *tags, const uint64_t first, const uint64_t last)
+{
+  uint64_t w0 = first / 64, w1 = last / 64;
+  uint64_t lo = ~UINT64_C(0) << (first % 64);
+  uint64_t hi = ~UINT64_C(0) >> (63 - last % 64);
+  if (w0 == w1) {
+    tag_word_and(&tags[w0], ~(lo & hi));
+    return;
+  }
+  tag_word_and(&tags[w0], ~lo);
+  if (w1 > w0 + 1) memset(&tags[w0 + 1], 0, (w1 - w0 - 1) * sizeof(uint64_t));
+  tag_word_and(&tags[w1], ~hi);
+}
+
+unit clear_tags(const mach_bits address, const mach_bits len)
+{
+  uint64_t addr = address;
+  uint64_t left = len;
+  while (left > 0) {
+    uint64_t offset = addr & MASK;
+    uint64_t chunk = MASK + 1 - offset < left ? MASK + 1 - offset : left;
+    void *leaf = pt_lookup(&sail_memory, addr);
+    if (leaf != NULL) {
+      clear_tag_bits(block_tags(leaf), offset >> g_tag_granule_bits, (offset + chunk - 1) >> g_tag_granule_bits);
+    }
+    addr += chunk;
+    left -= chunk;
+  }
+  return UNIT;
+}
+
+void kill_mem()
+{
+  pt_free(&sail_memory);
+  if (g_ram_host != NULL) {
+    munmap(g_ram_host, g_ram_mapped);
+    g_ram_host = NULL;
+    g_ram_mapped = 0;
+    g_ram_size = 0;
+  }
+  if (g_checkpoint_base != NULL) {
+    munmap(g_checkpoint_base, g_checkpoint_size);
+    g_checkpoint_base = NULL;
+    g_checkpoint_size = 0;
+  }
+}
+
+// ***** Memory builtins *****
+
+/*
+ * Return a pointer to the host memory backing the len bytes starting
+ * at address, or NULL if they do not all lie in the same block. If
+ * alloc is false, NULL is also returned when the block has not been
+ * allocated yet, in which case *in_block tells the caller whether the
+ * range would have fit in a single block.
+ */
+static inline uint8_t *mem_range(const uint64_t address, const uint64_t len, const bool alloc, bool *in_block)
+{
+  *in_block = (address & MASK) + len <= MASK + 1;
+  if (!*in_block) return NULL;
+
+  uint8_t *mem;
+  if (alloc) {
+    mem = pt_lookup_alloc(&sail_memory, address, block_size(), "block ");
+  } else {
+    mem = pt_lookup(&sail_memory, address);
+  }
+  return mem == NULL ? NULL : mem + (address & MASK);
+}
+
+/*
+ * These assume a little-endian host, as does the ELF loader.
+ */
+unit fast_write_ram(const mach_int data_size, const mach_bits addr, const mach_bits data)
+{
+  sail_stat_add(STAT_STORES, 1);
+  bool in_block;
+  uint8_t *mem = mem_range(addr, data_size, true, &in_block);
+
+  if (mem != NULL) {
+    struct mem_lock *locks[2];
+    mem_write_begin(addr, data_size, locks);
+    memcpy(mem, &data, data_size);
+    mem_write_end(addr, data_size, locks);
+  } else {
+    for (mach_int i = 0; i < data_size; ++i) {
+      write_mem(addr + i, (data >> (8 * i)) & 0xFF);
+    }
+  }
+  return UNIT;
+}
+
+mach_bits fast_read_ram(const mach_int data_size, const mach_bits addr)
+{
+  sail_stat_add(STAT_LOADS, 1);
+  bool in_block;
+  uint8_t *mem = mem_range(addr, data_size, false, &in_block);
+  uint64_t data = 0;
+
+  if (mem != NULL) {
+    memcpy(&data, mem, data_size);
+  } else if (!in_block) {
+    for (mach_int i = data_size; i > 0; --i) {
+      data = (data << 8) | read_mem(addr + (i - 1));
+    }
+  }
+  return data;
+}
+
+bool write_ram(const sail_int addr_size,     // Either 32 or 64
+	       const sail_int data_size_mpz, // Number of bytes
+	       const sail_bits  hex_ram,       // Currently unused
+	       const sail_bits  addr_bv,
+	       const sail_bits  data)
+{
+  uint64_t addr = CONVERT_OF(mach_bits, sail_bits)(addr_bv, true);
+  uint64_t data_size = sail_int_get_ui(data_size_mpz);
+
+  if (data_size <= 8) {
+    fast_write_ram(data_size, addr, CONVERT_OF(mach_bits, sail_bits)(data, true));
+    return true;
+  }
+
+  sail_stat_add(STAT_STORES, 1);
+  mpz_t buf;
+  mpz_init(buf);
+  mpz_of_sail_bits(buf, data);
+
+  bool in_block;
+  uint8_t *mem = mem_range(addr, data_size, true, &in_block);
+  if (mem != NULL) {
+    struct mem_lock *locks[2];
+    mem_write_begin(addr, data_size, locks);
+    // mpz_export only writes as many bytes as are significant.
+    memset(mem, 0, data_size);
+    mpz_export(mem, NULL, -1, 1, 0, 0, buf);
+    mem_write_end(addr, data_size, locks);
+    mpz_clear(buf);
+    return true;
+  }
+
+  uint64_t byte;
+  for(uint64_t i = 0; i < data_size; ++i) {
+    // Take the 8 low bits of buf and write to addr.
+    byte = mpz_get_ui(buf) & 0xFF;
+    write_mem(addr + i, byte);
+
+    // Then shift buf 8 bits right.
+    mpz_fdiv_q_2exp(buf, buf, 8);
+  }
+
+  mpz_clear(buf);
+  return true;
+}
+
+void read_ram(sail_bits *data,
+	      const sail_int addr_size,
+	      const sail_int data_size_mpz,
+	      const sail_bits hex_ram,
+	      const sail_bits addr_bv)
+{
+  uint64_t addr = CONVERT_OF(mach_bits, sail_bits)(addr_bv, true);
+  uint64_t data_size = sail_int_get_ui(data_size_mpz);
+
+  if (data_size <= 8) {
+    RECREATE_OF(sail_bits, mach_bits)(data, fast_read_ram(data_size, addr), data_size * 8, true);
+    return;
+  }
+
+  sail_stat_add(STAT_LOADS, 1);
+  mpz_t buf;
+  mpz_init(buf);
+
+  bool in_block;
+  uint8_t *mem = mem_range(addr, data_size, false, &in_block);
+  if (mem != NULL) {
+    mpz_import(buf, data_size, -1, 1, 0, 0, mem);
+  } else if (!in_block) {
+    for(uint64_t i = data_size; i > 0; --i) {
+      mpz_mul_2exp(buf, buf, 8);
+      mpz_add_ui(buf, buf, read_mem(addr + (i - 1)));
+    }
+  }
+
+  sail_bits_of_mpz(data, data_size * 8, buf);
+  mpz_clear(buf);
+}
+
+/*
+ * A binary image is a header, a table of extents and a table of
+ * symbols, followed by the data of each extent at a page aligned
+ * offset, so that loading it is a mapping and a copy per extent. The
+ * bytes of an extent from file_length up to mem_length are zero, as
+ * for the bss of an ELF file. Numbers are little-endian.
+ * etc/make_image.py converts text images and ELF files to this format.
+ */
+#define IMAGE_MAGIC "SAILIMG1"
+#define IMAGE_ENTRY 1              /* flags: entry is set */
+
+struct image_header {
+  char     magic[8];
+  uint64_t flags;
+  uint64_t entry;
+  uint64_t extents;         /* struct image_extent, after the header */
+  uint64_t symbols;         /* struct image_symbol, after the extents */
+  uint64_t strings_offset;  /* NUL terminated symbol names */
+  uint64_t strings_size;
+};
+
+struct image_extent {
+  uint64_t address;
+  uint64_t file_length;
+  uint64_t mem_length;
+  uint64_t offset;
+};
+
+struct image_symbol {
+  uint64_t value;
+  uint64_t name;            /* offset of the name in the strings */
+};
+
+static bool is_image(const char *buffer, const size_t size)
+{
+  return size >= sizeof(struct image_header) && !memcmp(buffer, IMAGE_MAGIC, 8);
+}
+
+/*
+ * Check that the tables of an image fit in the file, and everything
+ * they point to is inside it.
+ */
+static const struct image_header *image_header(const char *file, const char *buffer, const size_t size)
+{
+  const struct image_header *hdr = (const struct image_header *) buffer;
+  const struct image_extent *ext = (const struct image_extent *) (hdr + 1);
+  size_t tables = size - sizeof(*hdr);
+
+  if (hdr->extents > tables / sizeof(*ext)) goto corrupt;
+  tables -= hdr->extents * sizeof(*ext);
+  const struct image_symbol *sym = (const struct image_symbol *) (ext + hdr->extents);
+  if (hdr->symbols > tables / sizeof(*sym)) goto corrupt;
+  if (hdr->strings_offset > size || hdr->strings_size > size - hdr->strings_offset) goto corrupt;
+  if (hdr->strings_size > 0 && buffer[hdr->strings_offset + hdr->strings_size - 1] != '\0') goto corrupt;
+  for (uint64_t i = 0; i < hdr->extents; i++) {
+    if (ext[i].offset > size || ext[i].file_length > size - ext[i].offset) goto corrupt;
+    if (ext[i].file_length > ext[i].mem_length) goto corrupt;
+  }
+  for (uint64_t i = 0; i < hdr->symbols; i++) {
+    if (sym[i].name >= hdr->strings_size) goto corrupt;
+  }
+  return hdr;
+
+corrupt:
+  fprintf(stderr, "[Sail] Image file %s is corrupt\n", file);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Load file if it is a binary image, adding base to its addresses.
+ * Returns false, having done nothing, if it is not an image.
+ */
+static bool load_binary_image(const char *file, const uint64_t base)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  char magic[8];
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < sizeof(struct image_header)
+      || pread(fd, magic, 8, 0) != 8 || memcmp(magic, IMAGE_MAGIC, 8) != 0) {
+    close(fd);
+    return false;
+  }
+
+  char *buffer = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buffer == MAP_FAILED) {
+    fprintf(stderr, "[Sail] Image file %s could not be mapped\n", file);
+    exit(EXIT_FAILURE);
+  }
+  madvise(buffer, st.st_size, MADV_SEQUENTIAL);
+
+  const struct image_header *hdr = image_header(file, buffer, st.st_size);
+  const struct image_extent *ext = (const struct image_extent *) (hdr + 1);
+  for (uint64_t i = 0; i < hdr->extents; i++) {
+    uint64_t address = base + ext[i].address;
+    write_mem_block(address, buffer + ext[i].offset, ext[i].file_length);
+    zero_mem_block(address + ext[i].file_length, ext[i].mem_length - ext[i].file_length);
+  }
+  if (hdr->flags & IMAGE_ENTRY) {
+    g_elf_entry = base + hdr->entry;
+    fprintf(stderr, "[Sail] Elf entry point: %" PRIx64 "\n", g_elf_entry);
+  }
+
+  munmap(buffer, st.st_size);
+  return true;
+}
+
+bool image_symbols(const char *file, const char *buffer, const size_t size,
+                   void (*alloc)(uint64_t), void (*insert)(const char *, uint64_t))
+{
+  if (!is_image(buffer, size)) return false;
+
+  const struct image_header *hdr = image_header(file, buffer, size);
+  const struct image_symbol *sym = (const struct image_symbol *) ((const struct image_extent *) (hdr + 1) + hdr->extents);
+  const char *strings = buffer + hdr->strings_offset;
+  alloc(hdr->symbols);
+  for (uint64_t i = 0; i < hdr->symbols; i++) {
+    insert(strings + sym[i].name, sym[i].value);
+  }
+  return true;
+}
+
+unit load_raw(mach_bits addr, const sail_string file)
+{
+  if (load_binary_image(file, addr)) return UNIT;
+
+  FILE *fp = fopen(file, "r");
+
+  if (!fp) {
+    fprintf(stderr, "[Sail] Raw file %s could not be loaded\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  uint8_t buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    write_mem_block(addr, buf, n);
+    addr += n;
+  }
+  fclose(fp);
+
+  return UNIT;
+}
+
+/*
+ * Text images are pairs of lines, an address and the byte there, or
+ * elf_entry and the entry point, both in decimal. Runs of consecutive
+ * addresses are collected and written with write_mem_block.
+ */
+void load_image(char *file)
+{
+  if (load_binary_image(file, 0)) return;
+
+  FILE *fp = fopen(file, "r");
+
+  if (!fp) {
+    fprintf(stderr, "[Sail] Image file %s could not be loaded\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  char *addr = NULL;
+  char *data = NULL;
+  size_t addr_size = 0;
+  size_t data_size = 0;
+
+  uint8_t run[1 << 16];
+  uint64_t run_start = 0;
+  size_t run_len = 0;
+
+  while (true) {
+    ssize_t addr_len = getline(&addr, &addr_size, fp);
+    if (addr_len == -1) break;
+    ssize_t data_len = getline(&data, &data_size, fp);
+    if (data_len == -1) break;
+
+    if (!strcmp(addr, "elf_entry\n")) {
+      if (sscanf(data, "%" PRIu64 "\n", &g_elf_entry) != 1) {
+	fprintf(stderr, "[Sail] Failed to parse elf_entry\n");
+        exit(EXIT_FAILURE);
+      };
+      fprintf(stderr, "[Sail] Elf entry point: %" PRIx64 "\n", g_elf_entry);
+    } else {
+      uint64_t address = strtoull(addr, NULL, 10);
+      if (run_len == sizeof(run) || (run_len > 0 && address != run_start + run_len)) {
+        write_mem_block(run_start, run, run_len);
+        run_len = 0;
+      }
+      if (run_len == 0) run_start = address;
+      run[run_len++] = (uint8_t) strtoull(data, NULL, 10);
+    }
+  }
+  if (run_len > 0) write_mem_block(run_start, run, run_len);
+
+  free(addr);
+  free(data);
+  fclose(fp);
+}
+
+// ***** Tracing support *****
+
+/*
+ * Trace events are printed to stderr as text, unless trace_to_file has
+ * been called (--trace-file), in which case a binary encoding of the
+ * same events is written to that file instead. In binary mode events
+ * are appended to a ring buffer that a background thread drains, so the
+ * model only pays for encoding them. etc/decode_trace.py turns a binary
+ * trace back into the textual [TRACE] format.
+ *
+ * A binary trace is TRACE_MAGIC followed by events, each a tag byte and
+ * its operands. Numbers are LEB128 varints, zigzag encoded if signed.
+ * Function names are sent once with TRACE_NAME and then referred to by
+ * id.
+ */
+#define TRACE_MAGIC "SAILTRC1"
+
+enum trace_tag {
+  TRACE_NAME,    /* id, length, bytes */
+  TRACE_START,   /* id */
+  TRACE_END,
+  TRACE_RESET,   /* depth reset by enable_tracing */
+  TRACE_BITS64,  /* value */
+  TRACE_UNIT,
+  TRACE_STRING,  /* length, bytes */
+  TRACE_INT,     /* zigzag value */
+  TRACE_BIGINT,  /* sign (0 or 1 for negative), byte count, magnitude bytes */
+  TRACE_BITS,    /* length in bits, (length + 7) / 8 bytes */
+  TRACE_TRUE,
+  TRACE_FALSE,
+  TRACE_UNKNOWN,
+  TRACE_ARGSEP,
+  TRACE_ARGEND,
+  TRACE_RETEND
+};
+
+static int64_t g_trace_depth;
+//static int64_t g_trace_max_depth;
+static bool g_trace_enabled;
+
+/*
+ * Single producer, single consumer ring buffer. The model advances
+ * head after writing, the writer thread advances tail after flushing.
+ */
+#define TRACE_RING_SIZE (UINT64_C(1) << 24)
+
+static FILE *g_trace_file = NULL;
+static uint8_t *g_trace_ring;
+static _Atomic uint64_t g_trace_head, g_trace_tail;
+static atomic_bool g_trace_stop;
+static pthread_t g_trace_writer;
+
+static void *trace_writer(void *arg)
+{
+  while (true) {
+    uint64_t tail = atomic_load_explicit(&g_trace_tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&g_trace_head, memory_order_acquire);
+    if (head == tail) {
+      if (atomic_load(&g_trace_stop)) break;
+      struct timespec pause = { 0, 100000 };
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    uint64_t start = tail & (TRACE_RING_SIZE - 1);
+    uint64_t len = head - tail;
+    if (start + len > TRACE_RING_SIZE) len = TRACE_RING_SIZE - start;
+    fwrite(g_trace_ring + start, 1, len, g_trace_file);
+    atomic_store_explicit(&g_trace_tail, tail + len, memory_order_release);
+  }
+  return NULL;
+}
+
+static void trace_put(const void *data, size_t len)
+{
+  const uint8_t *src = data;
+  uint64_t head = atomic_load_explicit(&g_trace_head, memory_order_relaxed);
+  while (len > 0) {
+    uint64_t space = TRACE_RING_SIZE - (head - atomic_load_explicit(&g_trace_tail, memory_order_acquire));
+    if (space == 0) {
+      sched_yield();
+      continue;
+    }
+    uint64_t start = head & (TRACE_RING_SIZE - 1);
+    uint64_t n = len < space ? len : space;
+    if (start + n > TRACE_RING_SIZE) n = TRACE_RING_SIZE - start;
+    memcpy(g_trace_ring + start, src, n);
+    head += n;
+    src += n;
+    len -= n;
+    atomic_store_explicit(&g_trace_head, head, memory_order_release);
+  }
+}
+
+static inline size_t put_varint(uint8_t *buf, uint64_t v)
+{
+  size_t n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (uint8_t) v | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = (uint8_t) v;
+  return n;
+}
+
+static inline void trace_event(const uint8_t tag)
+{
+  trace_put(&tag, 1);
+}
+
+static inline void trace_event_varint(const uint8_t tag, const uint64_t v)
+{
+  uint8_t buf[11];
+  buf[0] = tag;
+  trace_put(buf, 1 + put_varint(buf + 1, v));
+}
+
+static void trace_event_bytes(const uint8_t tag, const uint64_t v, const void *data, size_t len)
+{
+  trace_event_varint(tag, v);
+  trace_put(data, len);
+}
+
+/*
+ * Function names are the string literals passed to trace_start by
+ * the generated code, so they are interned by address. A name reached
+ * through two different pointers just gets two ids.
+ */
+#define TRACE_NAMES_INITIAL 1024
+
+static const char **g_trace_names = NULL;
+static uint64_t *g_trace_name_ids = NULL;
+static uint64_t g_trace_names_size = 0;
+static uint64_t g_trace_names_count = 0;
+
+static void trace_names_grow(void);
+
+static uint64_t trace_name_id(const char *name)
+{
+  uint64_t mask = g_trace_names_size - 1;
+  uint64_t i = ((uintptr_t) name >> 3) * UINT64_C(0x9E3779B97F4A7C15) >> 40 & mask;
+  for (; g_trace_names[i] != NULL; i = (i + 1) & mask) {
+    if (g_trace_names[i] == name) return g_trace_name_ids[i];
+  }
+
+  uint64_t id = g_trace_names_count++;
+  g_trace_names[i] = name;
+  g_trace_name_ids[i] = id;
+  size_t len = strlen(name);
+  uint8_t buf[11];
+  size_t n = put_varint(buf, id);
+  trace_event(TRACE_NAME);
+  trace_put(buf, n);
+  trace_put(buf, put_varint(buf, len));
+  trace_put(name, len);
+
+  if (2 * g_trace_names_count > g_trace_names_size) trace_names_grow();
+  return id;
+}
+
+static void trace_names_grow(void)
+{
+  const char **names = g_trace_names;
+  uint64_t *ids = g_trace_name_ids;
+  uint64_t size = g_trace_names_size;
+
+  g_trace_names_size = size == 0 ? TRACE_NAMES_INITIAL : 2 * size;
+  g_trace_names = calloc(g_trace_names_size, sizeof(char *));
+  g_trace_name_ids = calloc(g_trace_names_size, sizeof(uint64_t));
+  uint64_t mask = g_trace_names_size - 1;
+  for (uint64_t j = 0; j < size; j++) {
+    if (names[j] == NULL) continue;
+    uint64_t i = ((uintptr_t) names[j] >> 3) * UINT64_C(0x9E3779B97F4A7C15) >> 40 & mask;
+    while (g_trace_names[i] != NULL) i = (i + 1) & mask;
+    g_trace_names[i] = names[j];
+    g_trace_name_ids[i] = ids[j];
+  }
+  free(names);
+  free(ids);
+}
+
+static mpz_t g_trace_int;
+
+static void trace_close(void)
+{
+  if (g_trace_file == NULL) return;
+  atomic_store(&g_trace_stop, true);
+  pthread_join(g_trace_writer, NULL);
+  fclose(g_trace_file);
+  g_trace_file = NULL;
+  free(g_trace_ring);
+  free(g_trace_names);
+  free(g_trace_name_ids);
+  g_trace_names = NULL;
+  g_trace_name_ids = NULL;
+  g_trace_names_size = 0;
+  g_trace_names_count = 0;
+  mpz_clear(g_trace_int);
+}
+
+void trace_to_file(const char *file)
+{
+  trace_close();
+  g_trace_file = fopen(file, "wb");
+  if (g_trace_file == NULL) {
+    fprintf(stderr, "[Sail] Could not open trace file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  fputs(TRACE_MAGIC, g_trace_file);
+
+  g_trace_ring = malloc(TRACE_RING_SIZE);
+  atomic_store(&g_trace_head, 0);
+  atomic_store(&g_trace_tail, 0);
+  atomic_store(&g_trace_stop, false);
+  trace_names_grow();
+  mpz_init(g_trace_int);
+  if (pthread_create(&g_trace_writer, NULL, trace_writer, NULL) != 0) {
+    fprintf(stderr, "[Sail] Could not start trace writer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The model usually finishes by calling exit() */
+  static bool registered = false;
+  if (!registered) atexit(trace_close);
+  registered = true;
+}
+
+/*
+ * Without a trace file, each thread builds its trace a line at a time
+ * in g_trace_line, which is written to stderr with a single fwrite
+ * when the line ends (and when tracing stops), rather than with a
+ * write for every piece of it.
+ */
+static _Thread_local char *g_trace_line = NULL;
+static _Thread_local size_t g_trace_line_len = 0;
+static _Thread_local size_t g_trace_line_size = 0;
+
+static char *trace_text_reserve(const size_t len)
+{
+  if (g_trace_line_len + len > g_trace_line_size) {
+    size_t size = 2 * g_trace_line_size;
+    if (size < g_trace_line_len + len) size = g_trace_line_len + len;
+    if (size < 256) size = 256;
+    g_trace_line = realloc(g_trace_line, size);
+    g_trace_line_size = size;
+  }
+  return g_trace_line + g_trace_line_len;
+}
+
+static void trace_text(const char *str, const size_t len)
+{
+  memcpy(trace_text_reserve(len), str, len);
+  g_trace_line_len += len;
+}
+
+static void trace_text_str(const char *str)
+{
+  trace_text(str, strlen(str));
+}
+
+static void trace_text_flush(void)
+{
+  if (g_trace_line_len > 0) {
+    fwrite(g_trace_line, 1, g_trace_line_len, stderr);
+    g_trace_line_len = 0;
+  }
+}
+
+static void trace_text_indent(void)
+{
+  trace_text("[TRACE] ", 8);
+  for (int64_t i = 0; i < g_trace_depth; ++i) {
+    trace_text("|   ", 4);
+  }
+}
+
+unit enable_tracing(const unit u)
+{
+  g_trace_depth = 0;
+  g_trace_enabled = true;
+  if (g_trace_file != NULL) trace_event(TRACE_RESET);
+  return UNIT;
+}
+
+unit disable_tracing(const unit u)
+{
+  trace_text_flush();
+  g_trace_depth = 0;
+  g_trace_enabled = false;
+  return UNIT;
+}
+
+bool is_tracing(const unit u)
+{
+  return g_trace_enabled;
+}
+
+void trace_mach_bits(const mach_bits x) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event_varint(TRACE_BITS64, x);
+  } else {
+    g_trace_line_len += snprintf(trace_text_reserve(19), 19, "0x%" PRIx64, x);
+  }
+}
+
+void trace_unit(const unit u) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event(TRACE_UNIT);
+  } else {
+    trace_text("()", 2);
+  }
+}
+
+void trace_sail_string(const sail_string str) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    size_t len = strlen(str);
+    trace_event_bytes(TRACE_STRING, len, str, len);
+  } else {
+    trace_text_str(str);
+  }
+}
+
+/*
+ * Write the magnitude of op, which must be non-negative, as bytes
+ * (little-endian host)
+ */
+static void trace_magnitude(const mpz_t op, size_t len)
+{
+  static const uint8_t zeros[sizeof(mp_limb_t)];
+  size_t limb_bytes = mpz_size(op) * sizeof(mp_limb_t);
+  trace_put(mpz_limbs_read(op), len < limb_bytes ? len : limb_bytes);
+  for (size_t n = limb_bytes; n < len; n += sizeof(zeros)) {
+    trace_put(zeros, len - n < sizeof(zeros) ? len - n : sizeof(zeros));
+  }
+}
+
+static void trace_mpz(const mpz_t op) {
+  if (g_trace_file == NULL) {
+    char *digits = trace_text_reserve(mpz_sizeinbase(op, 10) + 2);
+    mpz_get_str(digits, 10, op);
+    g_trace_line_len += strlen(digits);
+  } else if (mpz_fits_slong_p(op)) {
+    int64_t v = mpz_get_si(op);
+    trace_event_varint(TRACE_INT, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+  } else {
+    uint8_t sign = mpz_sgn(op) < 0;
+    size_t len = mpz_size(op) * sizeof(mp_limb_t);
+    trace_event_varint(TRACE_BIGINT, sign);
+    uint8_t buf[10];
+    trace_put(buf, put_varint(buf, len));
+    mpz_abs(g_trace_int, op);
+    trace_magnitude(g_trace_int, len);
+  }
+}
+
+void trace_sail_int(const sail_int op) {
+  if (!g_trace_enabled) return;
+#ifndef USE_INT128
+  trace_mpz(op);
+#else
+  mpz_t v;
+  mpz_init(v);
+  mpz_set_sail_int(v, op);
+  trace_mpz(v);
+  mpz_clear(v);
+#endif
+}
+
+void trace_sail_bits(const sail_bits op) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file == NULL) {
+    g_trace_line_len += format_bits(trace_text_reserve(op.len + 2), op);
+    return;
+  }
+  uint64_t len = op.len;
+  trace_event_varint(TRACE_BITS, len);
+  if (len <= 64) {
+    uint64_t v = CONVERT_OF(mach_bits, sail_bits)(op, true);
+    trace_put(&v, (len + 7) / 8);
+  } else {
+    mpz_of_sail_bits(g_trace_int, op);
+    trace_magnitude(g_trace_int, (len + 7) / 8);
+  }
+}
+
+void trace_bool(const bool b) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event(b ? TRACE_TRUE : TRACE_FALSE);
+  } else {
+    trace_text_str(b ? "true" : "false");
+  }
+}
+
+void trace_unknown(void) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event(TRACE_UNKNOWN);
+  } else {
+    trace_text("?", 1);
+  }
+}
+
+void trace_argsep(void) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event(TRACE_ARGSEP);
+  } else {
+    trace_text(", ", 2);
+  }
+}
+
+void trace_argend(void) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event(TRACE_ARGEND);
+  } else {
+    trace_text(")\n", 2);
+    trace_text_flush();
+  }
+}
+
+void trace_retend(void) {
+  if (!g_trace_enabled) return;
+  if (g_trace_file != NULL) {
+    trace_event(TRACE_RETEND);
+  } else {
+    trace_text("\n", 1);
+    trace_text_flush();
+  }
+}
+
+void trace_start(char *name)
 {
-  fprintf(stderr, "Sail CPU model waking up\n");
-  g_sleeping = false;
-  return UNIT;
+  if (g_trace_enabled) {
+    if (g_trace_file != NULL) {
+      trace_event_varint(TRACE_START, trace_name_id(name));
+    } else {
+      trace_text_indent();
+      trace_text_str(name);
+      trace_text("(", 1);
+    }
+    g_trace_depth++;
+  }
 }
 
-bool sleeping(const unit u)
+void trace_end(void)
 {
-    return g_sleeping;
+  if (g_trace_enabled) {
+    if (g_trace_file != NULL) {
+      trace_event(TRACE_END);
+    } else {
+      trace_text_indent();
+    }
+    g_trace_depth--;
+  }
 }
 
-/* ***** Sail memory builtins ***** */
+/* ***** Profiling ***** */
 
 /*
- * We organise memory available to the sail model into a linked list
- * of dynamically allocated MASK + 1 size blocks.
+ * With sail -c -c_profile every call to a Sail function is bracketed
+ * by profile_start(N) and profile_end(), where N indexes the table of
+ * function names passed to profile_functions. Each call is charged to
+ * a node in a calling context tree (one node per distinct call
+ * stack), which is all the hot path updates. The flat per-function
+ * report and the collapsed stacks are both derived from the tree when
+ * the model exits.
+ *
+ * Times are TSC ticks on x86, and nanoseconds elsewhere.
  */
-struct block {
-  uint64_t block_id;
-  uint8_t *mem;
-  struct block *next;
-};
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t profile_clock(void)
+{
+  return __rdtsc();
+}
+#define PROFILE_UNIT "TSC ticks"
+#else
+static inline uint64_t profile_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + (uint64_t) ts.tv_nsec;
+}
+#define PROFILE_UNIT "ns"
+#endif
 
-struct block *sail_memory = NULL;
+#define PROFILE_REPORT_LINES 50
 
-struct tag_block {
-  uint64_t block_id;
-  bool *mem;
-  struct tag_block *next;
+struct profile_node {
+  uint32_t fn;
+  uint32_t parent;
+  uint32_t child;
+  uint32_t sibling;
+  uint64_t calls;
+  uint64_t self;
 };
 
-struct tag_block *sail_tags = NULL;
+struct profile_frame {
+  uint32_t node;
+  uint64_t start;
+  uint64_t callees;
+};
 
-/*
- * Must be one less than a power of two.
- */
-uint64_t MASK = 0xFFFFFFul;
+static const char *const *g_profile_names = NULL;
+static uint32_t g_profile_count = 0;
 
-/*
- * All sail vectors are at least 64-bits, but only the bottom 8 bits
- * are used in the second argument.
- */
-void write_mem(uint64_t address, uint64_t byte)
-{
-  uint64_t mask = address & ~MASK;
-  uint64_t offset = address & MASK;
+static struct profile_node *g_profile_nodes = NULL;
+static uint32_t g_profile_nodes_count = 0;
+static uint32_t g_profile_nodes_size = 0;
 
-  //if ((byte >= 97 && byte <= 122) || (byte >= 64 && byte <= 90) || (byte >= 48 && byte <= 57) || byte == 10 || byte == 32) {
-  //  fprintf(stderr, "%c", (char) byte);
-  //}
+static struct profile_frame *g_profile_stack = NULL;
+static uint32_t g_profile_depth = 0;
+static uint32_t g_profile_stack_size = 0;
 
-  struct block *current = sail_memory;
+static char *g_profile_file = NULL;
 
-  while (current != NULL) {
-    if (current->block_id == mask) {
-      current->mem[offset] = (uint8_t) byte;
-      return;
-    } else {
-      current = current->next;
-    }
-  }
+static void profile_report(void);
 
-  /*
-   * If we couldn't find a block matching the mask, allocate a new
-   * one, write the byte, and put it at the front of the block list.
-   */
-  fprintf(stderr, "[Sail] Allocating new block 0x%" PRIx64 "\n", mask);
-  struct block *new_block = malloc(sizeof(struct block));
-  new_block->block_id = mask;
-  new_block->mem = calloc(MASK + 1, sizeof(uint8_t));
-  new_block->mem[offset] = (uint8_t) byte;
-  new_block->next = sail_memory;
-  sail_memory = new_block;
+void profile_functions(const uint32_t count, const char *const *names)
+{
+  g_profile_names = names;
+  g_profile_count = count;
+
+  g_profile_nodes_size = 1024;
+  g_profile_nodes = malloc(g_profile_nodes_size * sizeof(struct profile_node));
+  g_profile_nodes[0] = (struct profile_node) { 0 };
+  g_profile_nodes_count = 1;
+
+  g_profile_stack_size = 256;
+  g_profile_stack = malloc(g_profile_stack_size * sizeof(struct profile_frame));
+  g_profile_stack[0] = (struct profile_frame) { 0 };
+  g_profile_depth = 0;
+
+  /* The model usually finishes by calling exit() */
+  static bool registered = false;
+  if (!registered) atexit(profile_report);
+  registered = true;
 }
 
-uint64_t read_mem(uint64_t address)
+static uint32_t profile_new_node(const uint32_t parent, const uint32_t fn)
 {
-  uint64_t mask = address & ~MASK;
-  uint64_t offset = address & MASK;
+  if (g_profile_nodes_count == g_profile_nodes_size) {
+    g_profile_nodes_size *= 2;
+    g_profile_nodes = realloc(g_profile_nodes, g_profile_nodes_size * sizeof(struct profile_node));
+  }
+  uint32_t n = g_profile_nodes_count++;
+  g_profile_nodes[n] = (struct profile_node) {
+    .fn = fn,
+    .parent = parent,
+    .child = 0,
+    .sibling = g_profile_nodes[parent].child,
+  };
+  g_profile_nodes[parent].child = n;
+  return n;
+}
 
-  struct block *current = sail_memory;
+void profile_start(const uint32_t fn)
+{
+  struct profile_frame *frame = &g_profile_stack[g_profile_depth];
+  uint32_t parent = frame->node;
+
+  /* Look for the callee among the caller's children, and move it to
+     the front so that repeated calls from the same site are cheap. */
+  uint32_t prev = 0;
+  uint32_t n = g_profile_nodes[parent].child;
+  while (n != 0 && g_profile_nodes[n].fn != fn) {
+    prev = n;
+    n = g_profile_nodes[n].sibling;
+  }
+  if (n == 0) {
+    n = profile_new_node(parent, fn);
+  } else if (prev != 0) {
+    g_profile_nodes[prev].sibling = g_profile_nodes[n].sibling;
+    g_profile_nodes[n].sibling = g_profile_nodes[parent].child;
+    g_profile_nodes[parent].child = n;
+  }
 
-  while (current != NULL) {
-    if (current->block_id == mask) {
-      return (uint64_t) current->mem[offset];
-    } else {
-      current = current->next;
-    }
+  if (++g_profile_depth == g_profile_stack_size) {
+    g_profile_stack_size *= 2;
+    g_profile_stack = realloc(g_profile_stack, g_profile_stack_size * sizeof(struct profile_frame));
   }
+  frame = &g_profile_stack[g_profile_depth];
+  frame->node = n;
+  frame->callees = 0;
+  frame->start = profile_clock();
+}
 
-  return 0x00;
+void profile_end(void)
+{
+  uint64_t now = profile_clock();
+  struct profile_frame *frame = &g_profile_stack[g_profile_depth--];
+  uint64_t elapsed = now - frame->start;
+  struct profile_node *node = &g_profile_nodes[frame->node];
+  node->calls++;
+  node->self += elapsed - frame->callees;
+  g_profile_stack[g_profile_depth].callees += elapsed;
 }
 
-unit write_tag_bool(const uint64_t address, const bool tag)
+static uint64_t *g_profile_exclusive;
+
+static int profile_compare(const void *a, const void *b)
 {
-  uint64_t mask = address & ~MASK;
-  uint64_t offset = address & MASK;
+  uint64_t x = g_profile_exclusive[*(const uint32_t *) a];
+  uint64_t y = g_profile_exclusive[*(const uint32_t *) b];
+  return (x < y) - (x > y);
+}
 
-  struct tag_block *current = sail_tags;
+static void profile_report(void)
+{
+  if (g_profile_nodes == NULL) return;
+
+  /* Calls still in progress (e.g. when the model exits from inside a
+     Sail function) are charged up to now. */
+  while (g_profile_depth > 0) profile_end();
+
+  uint32_t count = g_profile_nodes_count;
+  struct profile_node *nodes = g_profile_nodes;
+
+  /* Children always come after their parents in the node array. */
+  uint64_t *total = malloc(count * sizeof(uint64_t));
+  for (uint32_t n = 0; n < count; n++) total[n] = nodes[n].self;
+  for (uint32_t n = count - 1; n > 0; n--) total[nodes[n].parent] += total[n];
+
+  uint64_t *calls = calloc(g_profile_count, sizeof(uint64_t));
+  uint64_t *inclusive = calloc(g_profile_count, sizeof(uint64_t));
+  uint64_t *exclusive = calloc(g_profile_count, sizeof(uint64_t));
+  uint32_t *active = calloc(g_profile_count, sizeof(uint32_t));
+  uint32_t *path = malloc(count * sizeof(uint32_t));
+
+  const char *file = g_profile_file == NULL ? "sail_profile.folded" : g_profile_file;
+  FILE *folded = fopen(file, "w");
+  if (folded == NULL) fprintf(stderr, "[Sail] Could not open profile file %s\n", file);
+
+  /* Walk the tree depth first. A function's inclusive time only counts
+     its outermost activation on each stack, so recursion is not
+     counted twice. */
+  uint32_t depth = 0;
+  uint32_t n = nodes[0].child;
+  while (n != 0) {
+    uint32_t fn = nodes[n].fn;
+    path[depth++] = n;
+    calls[fn] += nodes[n].calls;
+    exclusive[fn] += nodes[n].self;
+    if (active[fn]++ == 0) inclusive[fn] += total[n];
+
+    if (folded != NULL && nodes[n].self > 0) {
+      for (uint32_t i = 0; i < depth; i++) {
+        if (i > 0) fputc(';', folded);
+        fputs(g_profile_names[nodes[path[i]].fn], folded);
+      }
+      fprintf(folded, " %" PRIu64 "\n", nodes[n].self);
+    }
 
-  while (current != NULL) {
-    if (current->block_id == mask) {
-      current->mem[offset] = tag;
-      return UNIT;
-    } else {
-      current = current->next;
+    if (nodes[n].child != 0) {
+      n = nodes[n].child;
+      continue;
+    }
+    while (n != 0) {
+      active[nodes[n].fn]--;
+      depth--;
+      if (nodes[n].sibling != 0) {
+        n = nodes[n].sibling;
+        break;
+      }
+      n = nodes[n].parent;
     }
   }
+  if (folded != NULL) fclose(folded);
 
-  /*
-   * If we couldn't find a block matching the mask, allocate a new
-   * one, write the byte, and put it at the front of the block list.
-   */
-  fprintf(stderr, "[Sail] Allocating new tag block 0x%" PRIx64 "\n", mask);
-  struct tag_block *new_block = malloc(sizeof(struct tag_block));
-  new_block->block_id = mask;
-  new_block->mem = calloc(MASK + 1, sizeof(bool));
-  new_block->mem[offset] = tag;
-  new_block->next = sail_tags;
-  sail_tags = new_block;
+  uint32_t called = 0;
+  uint32_t *order = malloc((g_profile_count + 1) * sizeof(uint32_t));
+  for (uint32_t fn = 0; fn < g_profile_count; fn++) {
+    if (calls[fn] > 0) order[called++] = fn;
+  }
+  g_profile_exclusive = exclusive;
+  qsort(order, called, sizeof(uint32_t), profile_compare);
+
+  double all = total[0] == 0 ? 1.0 : (double) total[0];
+  fprintf(stderr, "[Sail] Profile, %" PRIu64 " " PROFILE_UNIT " in %" PRIu32 " functions (collapsed stacks in %s)\n",
+          total[0], called, file);
+  fprintf(stderr, "[Sail] %12s %16s %7s %16s %7s  %s\n",
+          "calls", "inclusive", "%", "exclusive", "%", "function");
+  for (uint32_t i = 0; i < called && i < PROFILE_REPORT_LINES; i++) {
+    uint32_t fn = order[i];
+    fprintf(stderr, "[Sail] %12" PRIu64 " %16" PRIu64 " %6.2f%% %16" PRIu64 " %6.2f%%  %s\n",
+            calls[fn], inclusive[fn], 100.0 * inclusive[fn] / all,
+            exclusive[fn], 100.0 * exclusive[fn] / all, g_profile_names[fn]);
+  }
+  if (called > PROFILE_REPORT_LINES) {
+    fprintf(stderr, "[Sail] ... and %" PRIu32 " more\n", called - PROFILE_REPORT_LINES);
+  }
 
-  return UNIT;
+  free(order);
+  free(path);
+  free(active);
+  free(exclusive);
+  free(inclusive);
+  free(calls);
+  free(total);
+  free(g_profile_nodes);
+  free(g_profile_stack);
+  free(g_profile_file);
+  g_profile_nodes = NULL;
+  g_profile_stack = NULL;
+  g_profile_file = NULL;
 }
 
-bool read_tag_bool(const uint64_t address)
+void profile_to_file(const char *file)
 {
-  uint64_t mask = address & ~MASK;
-  uint64_t offset = address & MASK;
-
-  struct tag_block *current = sail_tags;
+  free(g_profile_file);
+  g_profile_file = strdup(file);
+}
 
-  while (current != NULL) {
-    if (current->block_id == mask) {
-      return current->mem[offset];
-    } else {
-      current = current->next;
-    }
-  }
+/* ***** Statistics ***** */
 
-  return false;
-}
+/*
+ * The counters live in a segment, a header followed by a slot of
+ * counters for each thread that has counted anything, in the order of
+ * enum sail_stat. Slots are a multiple of a cache line apart, so
+ * threads do not share lines, and are only written by their own
+ * thread, so a reader adds them up to get the totals. Threads beyond
+ * the last slot share it, and may lose counts. The segment is static
+ * until stats_to_file moves it into a file, with these fields as its
+ * layout (little-endian on the hosts we run on), for
+ * etc/sail_stats.py.
+ *
+ * While there is a file or an interval, a sampler thread updates the
+ * cycle count and the host MIPS over the last STATS_WINDOW samples in
+ * the header, and prints the summary if asked to. It samples with
+ * g_stats_lock held, which stats_to_file takes to move the segment,
+ * so the sampler may already be running by then.
+ */
+#define STATS_MAGIC "SAILSTA1"
+#define STATS_THREADS 64
+#define STATS_SLOT 16
+#define STATS_WINDOW 10
+#define STATS_FILE_PERIOD 1.0
+
+struct stats_header {
+  char     magic[8];
+  uint64_t pid;
+  uint64_t counters;    /* STAT_COUNT */
+  uint64_t slot_size;   /* STATS_SLOT */
+  uint64_t threads;     /* slots in use */
+  uint64_t cycles;
+  uint64_t kips;        /* thousands of instructions per second */
+  uint64_t start_ns;    /* CLOCK_REALTIME */
+  uint64_t update_ns;
+  uint64_t pad[7];
+};
 
-void kill_mem()
-{
-  while (sail_memory != NULL) {
-    struct block *next = sail_memory->next;
+struct stats_segment {
+  struct stats_header header;
+  uint64_t slots[STATS_THREADS][STATS_SLOT];
+};
 
-    free(sail_memory->mem);
-    free(sail_memory);
+static struct stats_segment g_stats_static;
+static struct stats_segment *g_stats = &g_stats_static;
+static char *g_stats_file = NULL;
 
-    sail_memory = next;
-  }
+_Thread_local uint64_t *sail_stats = NULL;
 
-  while (sail_tags != NULL) {
-    struct tag_block *next = sail_tags->next;
+static double g_stats_interval = 0.0;
+static bool g_stats_sampling = false;
+static bool g_stats_stop;
+static pthread_t g_stats_sampler;
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_stats_wakeup;
 
-    free(sail_tags->mem);
-    free(sail_tags);
+static inline struct stats_segment *stats_segment(void)
+{
+  return __atomic_load_n(&g_stats, __ATOMIC_ACQUIRE);
+}
 
-    sail_tags = next;
+uint64_t *stats_slot(void)
+{
+  struct stats_segment *stats = stats_segment();
+  uint64_t n = __atomic_fetch_add(&stats->header.threads, 1, __ATOMIC_RELAXED);
+  if (n >= STATS_THREADS) {
+    n = STATS_THREADS - 1;
+    __atomic_store_n(&stats->header.threads, STATS_THREADS, __ATOMIC_RELAXED);
   }
+  sail_stats = stats->slots[n];
+  return sail_stats;
 }
 
-// ***** Memory builtins *****
-
-bool write_ram(const mpz_t addr_size,     // Either 32 or 64
-	       const mpz_t data_size_mpz, // Number of bytes
-	       const sail_bits  hex_ram,       // Currently unused
-	       const sail_bits  addr_bv,
-	       const sail_bits  data)
+static uint64_t realtime_ns(void)
 {
-  uint64_t addr = mpz_get_ui(*addr_bv.bits);
-  uint64_t data_size = mpz_get_ui(data_size_mpz);
-
-  mpz_t buf;
-  mpz_init_set(buf, *data.bits);
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  return t.tv_sec * UINT64_C(1000000000) + t.tv_nsec;
+}
 
-  uint64_t byte;
-  for(uint64_t i = 0; i < data_size; ++i) {
-    // Take the 8 low bits of buf and write to addr.
-    byte = mpz_get_ui(buf) & 0xFF;
-    write_mem(addr + i, byte);
+static void stats_init(struct stats_segment *stats)
+{
+  memcpy(stats->header.magic, STATS_MAGIC, sizeof(stats->header.magic));
+  stats->header.pid = getpid();
+  stats->header.counters = STAT_COUNT;
+  stats->header.slot_size = STATS_SLOT;
+  stats->header.start_ns = realtime_ns();
+}
 
-    // Then shift buf 8 bits right.
-    mpz_fdiv_q_2exp(buf, buf, 8);
+static void stats_totals(struct stats_segment *stats, uint64_t *totals)
+{
+  uint64_t threads = __atomic_load_n(&stats->header.threads, __ATOMIC_RELAXED);
+  memset(totals, 0, STAT_COUNT * sizeof(uint64_t));
+  for (uint64_t i = 0; i < threads && i < STATS_THREADS; i++) {
+    for (int j = 0; j < STAT_COUNT; j++) {
+      totals[j] += __atomic_load_n(&stats->slots[i][j], __ATOMIC_RELAXED);
+    }
   }
-
-  mpz_clear(buf);
-  return true;
 }
 
-void read_ram(sail_bits *data,
-	      const mpz_t addr_size,
-	      const mpz_t data_size_mpz,
-	      const sail_bits hex_ram,
-	      const sail_bits addr_bv)
+static void print_rate(const char *name, const uint64_t hits, const uint64_t misses)
 {
-  uint64_t addr = mpz_get_ui(*addr_bv.bits);
-  uint64_t data_size = mpz_get_ui(data_size_mpz);
+  if (hits + misses > 0) {
+    fprintf(stderr, ", %s %.2f%% hits", name, 100.0 * hits / (hits + misses));
+  }
+}
 
-  mpz_set_ui(*data->bits, 0);
-  data->len = data_size * 8;
+/* The time and instruction count of the last STATS_WINDOW samples. */
+static struct timespec g_stats_times[STATS_WINDOW];
+static uint64_t g_stats_instructions[STATS_WINDOW];
+static uint64_t g_stats_samples = 0;
 
-  mpz_t byte;
-  mpz_init(byte);
-  for(uint64_t i = data_size; i > 0; --i) {
-    mpz_set_ui(byte, read_mem(addr + (i - 1)));
-    mpz_mul_2exp(*data->bits, *data->bits, 8);
-    mpz_add(*data->bits, *data->bits, byte);
+static void stats_sample(const bool print)
+{
+  struct stats_segment *stats = stats_segment();
+  uint64_t totals[STAT_COUNT];
+  stats_totals(stats, totals);
+  uint64_t cycles = __atomic_load_n(&g_cycle_count, __ATOMIC_RELAXED);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  /* The rate is over the last STATS_WINDOW samples, this one included,
+     so once the ring is full the oldest of them is in the slot after
+     the one this sample replaces. */
+  uint64_t i = g_stats_samples % STATS_WINDOW;
+  uint64_t oldest = g_stats_samples < STATS_WINDOW ? 0 : (g_stats_samples + 1) % STATS_WINDOW;
+  struct timespec then = g_stats_samples == 0 ? now : g_stats_times[oldest];
+  uint64_t before = g_stats_samples == 0 ? totals[STAT_INSTRUCTIONS] : g_stats_instructions[oldest];
+  g_stats_times[i] = now;
+  g_stats_instructions[i] = totals[STAT_INSTRUCTIONS];
+  g_stats_samples++;
+  double elapsed = (now.tv_sec - then.tv_sec) + (now.tv_nsec - then.tv_nsec) / 1e9;
+  double mips = elapsed > 0 ? (totals[STAT_INSTRUCTIONS] - before) / elapsed / 1e6 : 0.0;
+
+  __atomic_store_n(&stats->header.cycles, cycles, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->header.kips, (uint64_t) (mips * 1000), __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->header.update_ns, realtime_ns(), __ATOMIC_RELAXED);
+
+  if (print) {
+    fprintf(stderr, "[Sail] %.1f s: %" PRIu64 " cycles, %" PRIu64 " instructions (%.2f MIPS), "
+            "%" PRIu64 " blocks, %" PRIu64 " loads, %" PRIu64 " stores",
+            (stats->header.update_ns - stats->header.start_ns) / 1e9, cycles,
+            totals[STAT_INSTRUCTIONS], mips, totals[STAT_MEM_BLOCKS], totals[STAT_LOADS], totals[STAT_STORES]);
+    print_rate("TLB", totals[STAT_TLB_HITS], totals[STAT_TLB_MISSES]);
+    print_rate("decode cache", totals[STAT_DECODE_HITS], totals[STAT_DECODE_MISSES]);
+    fputc('\n', stderr);
   }
-
-  mpz_clear(byte);
 }
 
-unit load_raw(mach_bits addr, const sail_string file)
+static void *stats_sampler(void *arg)
 {
-  FILE *fp = fopen(file, "r");
-
-  if (!fp) {
-    fprintf(stderr, "[Sail] Raw file %s could not be loaded\n", file);
-    exit(EXIT_FAILURE);
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  pthread_mutex_lock(&g_stats_lock);
+  stats_sample(false);
+  while (!g_stats_stop) {
+    double period = g_stats_interval > 0 ? g_stats_interval : STATS_FILE_PERIOD;
+    uint64_t ns = next.tv_nsec + (uint64_t) (period * 1e9);
+    next.tv_sec += ns / 1000000000;
+    next.tv_nsec = ns % 1000000000;
+    while (!g_stats_stop && pthread_cond_timedwait(&g_stats_wakeup, &g_stats_lock, &next) == 0);
+    if (!g_stats_stop) stats_sample(g_stats_interval > 0);
   }
+  pthread_mutex_unlock(&g_stats_lock);
+  return NULL;
+}
 
-  uint64_t byte;
-  while ((byte = (uint64_t)fgetc(fp)) != EOF) {
-    write_mem(addr, byte);
-    addr++;
+static void stats_close(void)
+{
+  if (g_stats_sampling) {
+    pthread_mutex_lock(&g_stats_lock);
+    g_stats_stop = true;
+    pthread_cond_signal(&g_stats_wakeup);
+    pthread_mutex_unlock(&g_stats_lock);
+    pthread_join(g_stats_sampler, NULL);
+    g_stats_sampling = false;
+    /* Leave the final counts in the file. */
+    stats_sample(g_stats_interval > 0);
   }
-
-  return UNIT;
 }
 
-void load_image(char *file)
+static void stats_start(void)
 {
-  FILE *fp = fopen(file, "r");
-
-  if (!fp) {
-    fprintf(stderr, "[Sail] Image file %s could not be loaded\n", file);
+  if (g_stats_sampling) return;
+  if (g_stats->header.start_ns == 0) stats_init(g_stats);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&g_stats_wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+  g_stats_stop = false;
+  if (pthread_create(&g_stats_sampler, NULL, stats_sampler, NULL) != 0) {
+    fprintf(stderr, "[Sail] Could not start statistics sampler\n");
     exit(EXIT_FAILURE);
   }
+  g_stats_sampling = true;
 
-  char *addr = NULL;
-  char *data = NULL;
-  size_t len = 0;
-
-  while (true) {
-    ssize_t addr_len = getline(&addr, &len, fp);
-    if (addr_len == -1) break;
-    ssize_t data_len = getline(&data, &len, fp);
-    if (data_len == -1) break;
+  static bool registered = false;
+  if (!registered) atexit(stats_close);
+  registered = true;
+}
 
-    if (!strcmp(addr, "elf_entry\n")) {
-      if (sscanf(data, "%" PRIu64 "\n", &g_elf_entry) != 1) {
-	fprintf(stderr, "[Sail] Failed to parse elf_entry\n");
-        exit(EXIT_FAILURE);
-      };
-      fprintf(stderr, "[Sail] Elf entry point: %" PRIx64 "\n", g_elf_entry);
-    } else {
-      write_mem((uint64_t) atoll(addr), (uint64_t) atoll(data));
-    }
+void stats_to_file(const char *file)
+{
+  if (g_stats != &g_stats_static) {
+    fprintf(stderr, "[Sail] Statistics are already in %s\n", g_stats_file);
+    exit(EXIT_FAILURE);
+  }
+  int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(struct stats_segment)) != 0) {
+    fprintf(stderr, "[Sail] Could not create statistics file %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  struct stats_segment *stats = mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, fd, 0);
+  close(fd);
+  if (stats == MAP_FAILED) {
+    fprintf(stderr, "[Sail] Could not map statistics file %s\n", file);
+    exit(EXIT_FAILURE);
   }
 
-  free(addr);
-  free(data);
-  fclose(fp);
+  /* Keep what has been counted so far, such as by loading an ELF. */
+  pthread_mutex_lock(&g_stats_lock);
+  memcpy(stats, &g_stats_static, sizeof(struct stats_segment));
+  stats_init(stats);
+  if (sail_stats != NULL) {
+    sail_stats = stats->slots[(sail_stats - g_stats_static.slots[0]) / STATS_SLOT];
+  }
+  __atomic_store_n(&g_stats, stats, __ATOMIC_RELEASE);
+  g_stats_file = strdup(file);
+  pthread_mutex_unlock(&g_stats_lock);
+  stats_start();
 }
 
-// ***** Tracing support *****
-
-static int64_t g_trace_depth;
-//static int64_t g_trace_max_depth;
-static bool g_trace_enabled;
-
-unit enable_tracing(const unit u)
+void stats_every(const double seconds)
 {
-  g_trace_depth = 0;
-  g_trace_enabled = true;
-  return UNIT;
+  pthread_mutex_lock(&g_stats_lock);
+  g_stats_interval = seconds;
+  pthread_mutex_unlock(&g_stats_lock);
+  stats_start();
 }
 
-unit disable_tracing(const unit u)
+/* ***** ELF functions ***** */
+
+void elf_entry(sail_int *rop, const unit u)
 {
-  g_trace_depth = 0;
-  g_trace_enabled = false;
-  return UNIT;
+  sail_int_set_ui(rop, g_elf_entry);
 }
 
-bool is_tracing(const unit u)
+void elf_tohost(sail_int *rop, const unit u)
 {
-  return g_trace_enabled;
+  sail_int_set_ui(rop, 0x0ul);
 }
 
-void trace_mach_bits(const mach_bits x) {
-  if (g_trace_enabled) fprintf(stderr, "0x%" PRIx64, x);
-}
+/* ***** Checkpoints ***** */
 
-void trace_unit(const unit u) {
-  if (g_trace_enabled) fputs("()", stderr);
-}
+/*
+ * A checkpoint file is a header, the ids of the memory blocks that
+ * were allocated, the contents of those blocks (including their tags)
+ * starting at the page aligned data_offset, and finally whatever the
+ * model's register save function wrote. Pages of a block that are entirely
+ * zero are skipped when writing, leaving holes in the file.
+ *
+ * Restoring maps the file privately, and points the page tables
+ * straight into the mapping, so a checkpoint is loaded in time
+ * proportional to the number of blocks rather than their size, and
+ * the pages are copied on write.
+ */
+#define CHECKPOINT_MAGIC "SAILCKP2"
+#define CHECKPOINT_PAGE 4096
 
-void trace_sail_string(const sail_string str) {
-  if (g_trace_enabled) fputs(str, stderr);
-}
+struct checkpoint_header {
+  char     magic[8];
+  uint64_t block_size;
+  uint64_t cycle_count;
+  uint64_t elf_entry;
+  uint64_t sleeping;
+  uint64_t mem_blocks;
+  uint64_t tag_granule_bits;
+  uint64_t data_offset;
+  uint64_t regs_offset;
+};
 
-void trace_sail_int(const sail_int op) {
-  if (g_trace_enabled) mpz_out_str(stderr, 10, op);
-}
+static void (*g_save_registers)(FILE *) = NULL;
+static void (*g_restore_registers)(FILE *) = NULL;
 
-void trace_sail_bits(const sail_bits op) {
-  if (g_trace_enabled) fprint_bits("", op, "", stderr);
+void checkpoint_registers(void (*save)(FILE *), void (*restore)(FILE *))
+{
+  g_save_registers = save;
+  g_restore_registers = restore;
 }
 
-void trace_bool(const bool b) {
-  if (g_trace_enabled) {
-    if (b) {
-      fprintf(stderr, "true");
-    } else {
-      fprintf(stderr, "false");
-    }
-  }
+void checkpoint_unsupported(const char *reg)
+{
+  fprintf(stderr, "[Sail] Register %s cannot be checkpointed\n", reg);
+  exit(EXIT_FAILURE);
 }
 
-void trace_unknown(void) {
-  if (g_trace_enabled) fputs("?", stderr);
+void restore_length(FILE *f, const size_t len)
+{
+  uint64_t saved;
+  restore_bytes(f, &saved, sizeof(saved));
+  if (saved != len) {
+    fprintf(stderr, "[Sail] Checkpoint does not match model, vector of length %" PRIu64 " where %zu expected\n",
+            saved, len);
+    exit(EXIT_FAILURE);
+  }
 }
 
-void trace_argsep(void) {
-  if (g_trace_enabled) fputs(", ", stderr);
-}
+struct checkpoint_writer {
+  FILE *f;
+  uint64_t count;
+  size_t block_size;
+};
 
-void trace_argend(void) {
-  if (g_trace_enabled) fputs(")\n", stderr);
+static void count_block(uint64_t id, void *leaf, void *env)
+{
+  ((struct checkpoint_writer *) env)->count++;
 }
 
-void trace_retend(void) {
-  if (g_trace_enabled) fputs("\n", stderr);
+static void write_block_id(uint64_t id, void *leaf, void *env)
+{
+  save_bytes(((struct checkpoint_writer *) env)->f, &id, sizeof(id));
 }
 
-void trace_start(char *name)
+static void write_block_data(uint64_t id, void *leaf, void *env)
 {
-  if (g_trace_enabled) {
-    fprintf(stderr, "[TRACE] ");
-    for (int64_t i = 0; i < g_trace_depth; ++i) {
-      fprintf(stderr, "%s", "|   ");
+  struct checkpoint_writer *w = env;
+  static const uint8_t zero_page[CHECKPOINT_PAGE];
+  for (size_t offset = 0; offset < w->block_size; offset += CHECKPOINT_PAGE) {
+    const uint8_t *page = (const uint8_t *) leaf + offset;
+    if (memcmp(page, zero_page, CHECKPOINT_PAGE) == 0) {
+      fseek(w->f, CHECKPOINT_PAGE, SEEK_CUR);
+    } else {
+      save_bytes(w->f, page, CHECKPOINT_PAGE);
     }
-    fprintf(stderr, "%s(", name);
-    g_trace_depth++;
   }
 }
 
-void trace_end(void)
+void save_checkpoint(const char *file)
 {
-  if (g_trace_enabled) {
-    fprintf(stderr, "[TRACE] ");
-    for (int64_t i = 0; i < g_trace_depth; ++i) {
-      fprintf(stderr, "%s", "|   ");
-    }
-    g_trace_depth--;
+  FILE *f = fopen(file, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "[Sail] Could not open checkpoint %s for writing\n", file);
+    exit(EXIT_FAILURE);
   }
-}
-
-/* ***** ELF functions ***** */
 
-void elf_entry(mpz_t *rop, const unit u)
-{
-  mpz_set_ui(*rop, g_elf_entry);
+  struct checkpoint_writer mem = { f, 0, block_size() };
+  pt_walk(sail_memory.root, 0, 0, count_block, &mem);
+
+  struct checkpoint_header hdr;
+  memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+  hdr.block_size = MASK + 1;
+  hdr.cycle_count = g_cycle_count;
+  hdr.elf_entry = g_elf_entry;
+  hdr.sleeping = g_sleeping;
+  hdr.mem_blocks = mem.count;
+  hdr.tag_granule_bits = g_tag_granule_bits;
+  uint64_t ids_end = sizeof(hdr) + mem.count * sizeof(uint64_t);
+  hdr.data_offset = (ids_end + CHECKPOINT_PAGE - 1) / CHECKPOINT_PAGE * CHECKPOINT_PAGE;
+  hdr.regs_offset = hdr.data_offset + mem.count * mem.block_size;
+  save_bytes(f, &hdr, sizeof(hdr));
+
+  pt_walk(sail_memory.root, 0, 0, write_block_id, &mem);
+  fseek(f, hdr.data_offset, SEEK_SET);
+  pt_walk(sail_memory.root, 0, 0, write_block_data, &mem);
+
+  fseek(f, hdr.regs_offset, SEEK_SET);
+  if (g_save_registers != NULL) g_save_registers(f);
+
+  /* Seeking over trailing zero pages does not extend the file */
+  fflush(f);
+  if (ftruncate(fileno(f), ftell(f)) != 0 || fclose(f) != 0) {
+    fprintf(stderr, "[Sail] Failed to write checkpoint %s\n", file);
+    exit(EXIT_FAILURE);
+  }
 }
 
-void elf_tohost(mpz_t *rop, const unit u)
+void load_checkpoint(const char *file)
 {
-  mpz_set_ui(*rop, 0x0ul);
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  struct checkpoint_header hdr;
+  if (fd < 0 || fstat(fd, &st) != 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+    fprintf(stderr, "[Sail] Could not read checkpoint %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  if (memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0 || hdr.block_size != MASK + 1
+      || hdr.tag_granule_bits != g_tag_granule_bits || hdr.regs_offset > (uint64_t) st.st_size) {
+    fprintf(stderr, "[Sail] %s is not a checkpoint for this runtime\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  kill_mem();
+  void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "[Sail] Could not map checkpoint %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  g_checkpoint_base = base;
+  g_checkpoint_size = st.st_size;
+
+  const uint64_t *ids = (const uint64_t *) (g_checkpoint_base + sizeof(hdr));
+  char *data = g_checkpoint_base + hdr.data_offset;
+  for (uint64_t i = 0; i < hdr.mem_blocks; i++, data += block_size()) {
+    *pt_slot(&sail_memory, ids[i]) = data;
+  }
+
+  __atomic_store_n(&g_cycle_count, hdr.cycle_count, __ATOMIC_RELAXED);
+  g_elf_entry = hdr.elf_entry;
+  g_sleeping = hdr.sleeping;
+
+  FILE *f = fdopen(fd, "rb");
+  fseek(f, hdr.regs_offset, SEEK_SET);
+  if (g_restore_registers != NULL) g_restore_registers(f);
+  fclose(f);
+
+  fprintf(stderr, "[Sail] Restored checkpoint %s at cycle %" PRIu64 "\n", file, g_cycle_count);
 }
 
+static char *g_checkpoint_load = NULL;
+static char *g_checkpoint_save = NULL;
+static uint64_t g_checkpoint_save_cycle = 0;
+
 /* ***** Cycle limit ***** */
 
 /* NB Also increments cycle_count */
 bool cycle_limit_reached(const unit u)
 {
-  return ++g_cycle_count >= g_cycle_limit && g_cycle_limit != 0;
+  /* Stored atomically as the statistics sampler reads it. */
+  uint64_t cycles = g_cycle_count + 1;
+  __atomic_store_n(&g_cycle_count, cycles, __ATOMIC_RELAXED);
+  return cycles >= g_cycle_limit && g_cycle_limit != 0;
 }
 
 unit cycle_count(const unit u)
 {
+  if (g_checkpoint_load != NULL) {
+    load_checkpoint(g_checkpoint_load);
+    free(g_checkpoint_load);
+    g_checkpoint_load = NULL;
+    return UNIT;
+  }
   if (cycle_limit_reached(UNIT)) {
     printf("\n[Sail] TIMEOUT: exceeded %" PRId64 " cycles\n", g_cycle_limit);
     exit(EXIT_SUCCESS);
   }
+  if (g_checkpoint_save != NULL && g_cycle_count == g_checkpoint_save_cycle) {
+    save_checkpoint(g_checkpoint_save);
+    fprintf(stderr, "[Sail] Saved checkpoint %s at cycle %" PRIu64 "\n", g_checkpoint_save, g_cycle_count);
+    exit(EXIT_SUCCESS);
+  }
   return UNIT;
 }
 
 void get_cycle_count(sail_int *rop, const unit u)
 {
-    mpz_init_set_ui(*rop, g_cycle_count);
+  sail_int_set_ui(rop, g_cycle_count);
 }
 
 /* ***** Argument Parsing ***** */
 
 static struct option options[] = {
   {"binary",     required_argument, 0, 'b'},
+  {"checkpoint-save", required_argument, 0, 'S'},
+  {"checkpoint-load", required_argument, 0, 'R'},
+  {"trace-file", required_argument, 0, 'T'},
+  {"profile-file", required_argument, 0, 'P'},
+  {"stats-file", required_argument, 0, 'F'},
+  {"stats-interval", required_argument, 0, 'I'},
   {"cyclelimit", required_argument, 0, 'l'},
   {"config",     required_argument, 0, 'C'},
   {"elf",        required_argument, 0, 'e'},
   {"entry",      required_argument, 0, 'n'},
   {"image",      required_argument, 0, 'i'},
   {"verbosity",  required_argument, 0, 'v'},
+  {"tag-granule", required_argument, 0, 'g'},
   {"help",       no_argument,       0, 'h'},
   {0, 0, 0, 0}
 };
@@ -474,7 +2217,7 @@ int process_arguments(int argc, char *argv[])
 
   while (true) {
     int option_index = 0;
-    c = getopt_long(argc, argv, "e:n:i:b:l:C:h", options, &option_index);
+    c = getopt_long(argc, argv, "e:n:i:b:l:C:S:R:T:P:F:I:g:h", options, &option_index);
 
     if (c == -1) break;
 
@@ -496,10 +2239,11 @@ int process_arguments(int argc, char *argv[])
           return -1;
         };
 #ifdef HAVE_SETCONFIG
-        mpz_t s_value;
-        mpz_init_set_ui(s_value, value);
+        sail_int s_value;
+        CREATE(sail_int)(&s_value);
+        sail_int_set_ui(&s_value, value);
         z__SetConfig(arg, s_value);
-        mpz_clear(s_value);
+        KILL(sail_int)(&s_value);
 #else
         fprintf(stderr, "Ignoring flag -C %s", optarg);
 #endif
@@ -519,6 +2263,41 @@ int process_arguments(int argc, char *argv[])
       free(file);
       break;
 
+    case 'S':
+      free(g_checkpoint_save);
+      g_checkpoint_save = NULL;
+      if (sscanf(optarg, "%" PRIu64 ",%ms", &g_checkpoint_save_cycle, &g_checkpoint_save) != 2) {
+	fprintf(stderr, "Could not parse argument %s\n", optarg);
+	return -1;
+      };
+      break;
+
+    case 'R':
+      free(g_checkpoint_load);
+      g_checkpoint_load = strdup(optarg);
+      break;
+
+    case 'T':
+      trace_to_file(optarg);
+      break;
+
+    case 'P':
+      profile_to_file(optarg);
+      break;
+
+    case 'F':
+      stats_to_file(optarg);
+      break;
+
+    case 'I': ;
+      double interval;
+      if (sscanf(optarg, "%lf", &interval) != 1 || interval <= 0) {
+	fprintf(stderr, "Could not parse statistics interval %s\n", optarg);
+	return -1;
+      }
+      stats_every(interval);
+      break;
+
     case 'i':
       load_image(optarg);
       break;
@@ -549,6 +2328,15 @@ int process_arguments(int argc, char *argv[])
       }
       break;
 
+    case 'g': ;
+      uint64_t granule;
+      if (!sscanf(optarg, "%" PRIu64, &granule)) {
+	fprintf(stderr, "Could not parse tag granule %s\n", optarg);
+	return -1;
+      }
+      set_tag_granule(granule);
+      break;
+
     case 'h':
       print_usage();
       break;
@@ -582,4 +2370,12 @@ void cleanup_rts(void)
 {
   cleanup_library();
   kill_mem();
+  close_elf();
+  trace_text_flush();
+  free(g_trace_line);
+  g_trace_line = NULL;
+  g_trace_line_size = 0;
+  trace_close();
+  profile_report();
+  stats_close();
 }
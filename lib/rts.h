@@ -50,28 +50,128 @@ bool sleeping(const unit u);
 void write_mem(uint64_t, uint64_t);
 uint64_t read_mem(uint64_t);
 
+/*
+ * Bulk versions of write_mem, for loaders. write_mem_block copies len
+ * bytes from data into memory at address, and zero_mem_block sets len
+ * bytes at address to zero.
+ */
+void write_mem_block(uint64_t address, const void *data, uint64_t len);
+void zero_mem_block(uint64_t address, uint64_t len);
+
+/*
+ * Memory is normally allocated a block at a time, on first use.
+ * map_mem instead reserves host memory for size bytes starting at
+ * address (which must be aligned to a block) up front, as a single
+ * MAP_NORESERVE mapping, so addresses in the range are translated
+ * with an offset and never allocate. With huge_pages the mapping is
+ * advised to use transparent huge pages. It must be called before
+ * anything is written to memory, and addresses outside the range are
+ * still allocated a block at a time.
+ */
+void map_mem(const uint64_t address, const uint64_t size, const bool huge_pages);
+
+/*
+ * For models that cache something derived from memory, such as decoded
+ * instructions. watch_mem_page marks the page (4K) holding address and
+ * returns its generation. The next write to a marked page clears the
+ * mark and bumps the generation, so whatever was read from the page
+ * after watch_mem_page returned g is still current while
+ * mem_page_generation gives g. Pages whose numbers have the same low
+ * WATCH_SLOT_BITS bits share a mark and a generation, so a write can
+ * also make the caches of another page stale.
+ *
+ * The check is made after the write has stored its bytes, so a page
+ * has to be marked before reading what is cached from it: a write
+ * that the read missed then always sees the mark.
+ */
+#define WATCH_PAGE_BITS 12
+#define WATCH_SLOT_BITS 16
+#define WATCH_SLOTS (UINT64_C(1) << WATCH_SLOT_BITS)
+
+extern uint64_t sail_page_generations[WATCH_SLOTS];
+
+uint64_t watch_mem_page(const uint64_t address);
+
+static inline uint64_t mem_page_generation(const uint64_t address)
+{
+  uint64_t slot = (address >> WATCH_PAGE_BITS) & (WATCH_SLOTS - 1);
+  return __atomic_load_n(&sail_page_generations[slot], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Call share_mem before starting threads that access memory at the
+ * same time, such as the harts of a multiprocessor. Writes then lock
+ * the 8 byte granules they touch (via a table of locks indexed by a
+ * hash of the address), and bump a version number for each lock.
+ *
+ * Between lock_mem(address) and unlock_mem() the calling thread holds
+ * the lock for the granule of address, which makes a read-modify-write
+ * of that granule atomic. locked_mem_version returns the version of
+ * the lock held, so that a later access can tell whether the granule
+ * may have been written in between. Without share_mem, these do
+ * nothing.
+ */
+void share_mem(void);
+unit lock_mem(const mach_bits address);
+unit unlock_mem(const unit u);
+uint64_t locked_mem_version(void);
+
 // These memory builtins are intended to match the semantics for the
 // __ReadRAM and __WriteRAM functions in ASL.
 
-bool write_ram(const mpz_t addr_size,     // Either 32 or 64
-	       const mpz_t data_size_mpz, // Number of bytes
+bool write_ram(const sail_int addr_size,     // Either 32 or 64
+	       const sail_int data_size_mpz, // Number of bytes
 	       const sail_bits hex_ram,       // Currently unused
 	       const sail_bits addr_bv,
 	       const sail_bits data);
 
 void read_ram(sail_bits *data,
-	      const mpz_t addr_size,
-	      const mpz_t data_size_mpz,
+	      const sail_int addr_size,
+	      const sail_int data_size_mpz,
 	      const sail_bits hex_ram,
 	      const sail_bits addr_bv);
 
+/*
+ * Versions of write_ram and read_ram for accesses of at most 8 bytes,
+ * which avoid sail_bits altogether. The C backend uses fast_read_ram
+ * in place of read_ram when the result fits in a mach_bits.
+ */
+unit fast_write_ram(const mach_int data_size, const mach_bits addr, const mach_bits data);
+mach_bits fast_read_ram(const mach_int data_size, const mach_bits addr);
+
+/*
+ * Tags are kept one bit per tag granule, a power of two number of
+ * bytes (1 by default) set with set_tag_granule or --tag-granule
+ * before anything is written to memory. write_tag_bool and
+ * read_tag_bool act on the tag of the granule containing the address,
+ * and clear_tags clears the tags of every granule overlapping len
+ * bytes from address.
+ */
+void set_tag_granule(const uint64_t bytes);
+
 unit write_tag_bool(const mach_bits, const bool);
 bool read_tag_bool(const mach_bits);
+unit clear_tags(const mach_bits address, const mach_bits len);
 
+/*
+ * load_raw copies a file into memory at addr, and load_image loads
+ * a text image of address and byte pairs. Both also accept a binary
+ * image (written by etc/make_image.py from a text image or an ELF
+ * file), which is mapped and copied an extent at a time. load_raw
+ * adds addr to the image's addresses.
+ */
 unit load_raw(mach_bits addr, const sail_string file);
 
 void load_image(char *);
 
+/*
+ * If buffer holds a binary image, call alloc with the number of
+ * symbols it has and insert for each of them, and return true. This
+ * is how lookup_sym finds the symbols of an image.
+ */
+bool image_symbols(const char *file, const char *buffer, const size_t size,
+                   void (*alloc)(uint64_t), void (*insert)(const char *, uint64_t));
+
 /* ***** Tracing ***** */
 
 /*
@@ -89,6 +189,12 @@ unit disable_tracing(const unit);
 
 bool is_tracing(const unit);
 
+/*
+ * Write a binary trace to file instead of printing text to stderr
+ * (--trace-file). Decode it with etc/decode_trace.py.
+ */
+void trace_to_file(const char *file);
+
 /*
  * Tracing is implemented by void trace_TYPE functions, each of which
  * takes the Sail value to print as the first argument, and prints it
@@ -116,6 +222,67 @@ void trace_retend(void);
 void trace_start(char *);
 void trace_end(void);
 
+/* ***** Profiling ***** */
+
+/*
+ * Compile with sail -c -c_profile to count calls and time spent in each
+ * Sail function. model_init passes the table of function names to
+ * profile_functions, and every call to function N is bracketed by
+ * profile_start(N) and profile_end().
+ *
+ * On exit a report sorted by exclusive time is printed to stderr, and
+ * the call stacks are written in the collapsed format used by
+ * flamegraph.pl to sail_profile.folded, or the file given by
+ * --profile-file.
+ */
+void profile_functions(const uint32_t count, const char *const *names);
+void profile_to_file(const char *file);
+
+void profile_start(const uint32_t fn);
+void profile_end(void);
+
+/* ***** Statistics ***** */
+
+/*
+ * Counters for watching a long run while it goes. Each thread adds to
+ * its own copy of the counters, so counting costs an increment. With
+ * --stats-file FILE (stats_to_file), the copies are kept in FILE,
+ * mapped shared, where etc/sail_stats.py can read them at any time
+ * without disturbing the model; a file in /dev/shm is never written
+ * to disk. With --stats-interval SECONDS (stats_every), a one-line
+ * summary is printed to stderr that often.
+ *
+ * The runtime counts memory blocks allocated, and the loads and stores
+ * made through the RAM builtins, and publishes the cycle count.
+ * Models count the rest with sail_stat_add. Both functions may be
+ * called in either order, but stats_to_file only moves the counters
+ * of the thread calling it, so it must be called before the model
+ * starts any threads that count.
+ */
+enum sail_stat {
+  STAT_INSTRUCTIONS,
+  STAT_MEM_BLOCKS,
+  STAT_LOADS,
+  STAT_STORES,
+  STAT_TLB_HITS,
+  STAT_TLB_MISSES,
+  STAT_DECODE_HITS,
+  STAT_DECODE_MISSES,
+  STAT_COUNT
+};
+
+extern _Thread_local uint64_t *sail_stats;
+uint64_t *stats_slot(void);
+
+static inline void sail_stat_add(const enum sail_stat stat, const uint64_t n)
+{
+  uint64_t *counters = sail_stats != NULL ? sail_stats : stats_slot();
+  __atomic_store_n(&counters[stat], counters[stat] + n, __ATOMIC_RELAXED);
+}
+
+void stats_to_file(const char *file);
+void stats_every(const double seconds);
+
 /*
  * Functions for counting and limiting cycles
  */
@@ -138,6 +305,30 @@ void elf_tohost(sail_int *rop, const unit u);
 
 int process_arguments(int, char**);
 
+/*
+ * Checkpoints hold the memory, tags, cycle count and ELF entry point,
+ * and the model's registers. The C backend generates functions that
+ * save and restore every register, and registers them with
+ * checkpoint_registers from model_init.
+ *
+ * With --checkpoint-save N,FILE, the state is written to FILE when
+ * cycle_count() reaches cycle N, and the model exits. With
+ * --checkpoint-load FILE, the state is restored from FILE on the first
+ * call to cycle_count(), so a model whose main loop resets the
+ * processor and then calls cycle_count() after every step resumes at
+ * the step following the checkpoint.
+ */
+void save_checkpoint(const char *file);
+void load_checkpoint(const char *file);
+
+void checkpoint_registers(void (*save)(FILE *), void (*restore)(FILE *));
+
+/*
+ * Called by the generated register save and restore functions.
+ */
+void checkpoint_unsupported(const char *reg);
+void restore_length(FILE *f, const size_t len);
+
 /*
  * setup_rts and cleanup_rts are responsible for calling setup_library
  * and cleanup_library in sail.h.
@@ -1,39 +1,315 @@
 #define _GNU_SOURCE
 #include<assert.h>
 #include<inttypes.h>
+#include<stdarg.h>
 #include<stdbool.h>
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
 #include<time.h>
+#include<sys/mman.h>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include<immintrin.h>
+#elif defined(__ARM_NEON)
+#include<arm_neon.h>
+#endif
 
 #include"sail.h"
 
 /*
  * Temporary mpzs for use in functions below. To avoid conflicts, only
  * use in functions that do not call other functions in this file.
+ *
+ * The temporaries are per thread, so that models compiled with
+ * -c_thread_local can run one instance per thread.
+ */
+static _Thread_local mpz_t sail_lib_tmp1, sail_lib_tmp2, sail_lib_tmp3;
+
+/*
+ * Temporary rationals for the Sail reals, with the same restriction.
+ */
+static _Thread_local mpq_t sail_real_tmp1, sail_real_tmp2, sail_real_tmp3;
+
+/*
+ * The buffer fprint_bits formats into, grown as needed.
+ */
+static _Thread_local char *sail_print_buf = NULL;
+static _Thread_local size_t sail_print_buf_size = 0;
+
+/*
+ * Temporary mpzs used by the sail_bits functions when they need an
+ * inline bitvector (see sail.h) as a GMP integer.
+ */
+static _Thread_local mpz_t sail_bits_tmp1, sail_bits_tmp2, sail_bits_tmp3;
+
+/*
+ * 128-bit integers, used for sail_int with USE_INT128 and for the
+ * inline bitvectors below, and conversions to and from GMP integers.
+ */
+typedef unsigned __int128 uint128_t;
+typedef __int128 int128_t;
+
+static inline void mpz_set_u128(mpz_t rop, const uint128_t op)
+{
+  uint64_t words[2] = { (uint64_t) op, (uint64_t) (op >> 64) };
+  if (words[1] == 0) {
+    mpz_set_ui(rop, words[0]);
+  } else {
+    mpz_import(rop, 2, -1, sizeof(uint64_t), 0, 0, words);
+  }
+}
+
+static inline void mpz_set_s128(mpz_t rop, const int128_t op)
+{
+  if (op < 0) {
+    mpz_set_u128(rop, -(uint128_t) op);
+    mpz_neg(rop, rop);
+  } else {
+    mpz_set_u128(rop, (uint128_t) op);
+  }
+}
+
+/*
+ * The lowest 128 bits of op, in two's complement if op is negative.
+ */
+static inline uint128_t mpz_get_u128(const mpz_t op)
+{
+  uint128_t v = ((uint128_t) mpz_getlimbn(op, 1) << 64) | mpz_getlimbn(op, 0);
+  return mpz_sgn(op) < 0 ? -v : v;
+}
+
+#if GMP_NUMB_BITS != 64
+#error "Inline sail_bits require 64-bit GMP limbs"
+#endif
+
+/*
+ * int_mpz gives a GMP integer holding the value of op: op itself, or
+ * with USE_INT128, tmp set to the value of op. For results, rop_mpz
+ * gives a GMP integer to compute the value of rop in, which
+ * rop_finish then stores in rop. With GMP integers this is just rop.
  */
-static sail_int sail_lib_tmp1, sail_lib_tmp2, sail_lib_tmp3;
-static real sail_lib_tmp_real;
+#ifndef USE_INT128
+
+static inline mpz_srcptr int_mpz(const sail_int op, mpz_t tmp)
+{
+  return op;
+}
+
+static inline mpz_ptr rop_mpz(sail_int *rop, mpz_t tmp)
+{
+  return *rop;
+}
+
+static inline void rop_finish(sail_int *rop, mpz_t tmp) {}
+
+#else
+
+static inline mpz_srcptr int_mpz(const sail_int op, mpz_t tmp)
+{
+  mpz_set_s128(tmp, op);
+  return tmp;
+}
+
+static inline mpz_ptr rop_mpz(sail_int *rop, mpz_t tmp)
+{
+  return tmp;
+}
+
+static inline void rop_finish(sail_int *rop, mpz_t tmp)
+{
+  sail_int_set_mpz(rop, tmp);
+}
+
+#endif
 
 #define FLOAT_PRECISION 255
 
 void setup_library(void)
 {
   srand(0x0);
+  mpf_set_default_prec(FLOAT_PRECISION);
+  setup_library_thread();
+}
+
+void cleanup_library(void)
+{
+  cleanup_library_thread();
+}
+
+void setup_library_thread(void)
+{
   mpz_init(sail_lib_tmp1);
   mpz_init(sail_lib_tmp2);
   mpz_init(sail_lib_tmp3);
-  mpq_init(sail_lib_tmp_real);
-  mpf_set_default_prec(FLOAT_PRECISION);
+  mpz_init(sail_bits_tmp1);
+  mpz_init(sail_bits_tmp2);
+  mpz_init(sail_bits_tmp3);
+  mpq_init(sail_real_tmp1);
+  mpq_init(sail_real_tmp2);
+  mpq_init(sail_real_tmp3);
 }
 
-void cleanup_library(void)
+void cleanup_library_thread(void)
 {
   mpz_clear(sail_lib_tmp1);
   mpz_clear(sail_lib_tmp2);
   mpz_clear(sail_lib_tmp3);
-  mpq_clear(sail_lib_tmp_real);
+  mpz_clear(sail_bits_tmp1);
+  mpz_clear(sail_bits_tmp2);
+  mpz_clear(sail_bits_tmp3);
+  mpq_clear(sail_real_tmp1);
+  mpq_clear(sail_real_tmp2);
+  mpq_clear(sail_real_tmp3);
+  free(sail_print_buf);
+  sail_print_buf = NULL;
+  sail_print_buf_size = 0;
+}
+
+/* ***** Arena allocation ***** */
+
+/*
+ * When enabled, GMP limbs (and the mpz_t behind wide sail_bits) are
+ * bump-allocated from fixed size chunks carved out of one reserved
+ * region, instead of going through malloc and free.
+ *
+ * Each chunk counts its live allocations, and is reused as soon as the
+ * count drops to zero. The temporaries of a Sail function are all
+ * killed before it returns, so the chunks used while executing an
+ * instruction are reclaimed in bulk once its step function returns.
+ * Anything that outlives the step, like the limbs of a register that
+ * grew during it, merely keeps its own chunk alive.
+ *
+ * Pointers outside the region came from malloc, so the allocator can be
+ * installed after GMP objects have been created with the defaults.
+ */
+#define ARENA_CHUNK_BITS 16
+#define ARENA_CHUNK ((size_t) 1 << ARENA_CHUNK_BITS)
+#define ARENA_CHUNKS 16384
+#define ARENA_MAX_ALLOC (ARENA_CHUNK / 8)
+#define ARENA_ALIGN 16
+
+static bool arena_active = false;
+static char *arena_base = NULL;
+static uint32_t arena_live[ARENA_CHUNKS];
+static uint32_t arena_next_free[ARENA_CHUNKS];
+static uint32_t arena_free_list = ARENA_CHUNKS;
+static uint32_t arena_high = 0;
+static uint32_t arena_cur = ARENA_CHUNKS;
+static size_t arena_top = ARENA_CHUNK;
+
+static inline bool in_arena(const void *ptr)
+{
+  return arena_base != NULL
+    && (const char *) ptr >= arena_base
+    && (const char *) ptr < arena_base + ARENA_CHUNKS * ARENA_CHUNK;
+}
+
+static inline size_t arena_round(const size_t size)
+{
+  return (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+/*
+ * Make a fresh chunk current, returning false if the region is full.
+ */
+static bool arena_new_chunk(void)
+{
+  if (arena_cur < ARENA_CHUNKS && arena_live[arena_cur] == 0) {
+    arena_top = 0;
+    return true;
+  }
+  if (arena_free_list < ARENA_CHUNKS) {
+    arena_cur = arena_free_list;
+    arena_free_list = arena_next_free[arena_cur];
+  } else if (arena_high < ARENA_CHUNKS) {
+    arena_cur = arena_high++;
+  } else {
+    return false;
+  }
+  arena_top = 0;
+  return true;
+}
+
+static void *arena_alloc(size_t size)
+{
+  size_t rsize = arena_round(size);
+  if (!arena_active || rsize > ARENA_MAX_ALLOC
+      || (arena_top + rsize > ARENA_CHUNK && !arena_new_chunk())) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+      fprintf(stderr, "[Sail] Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    return ptr;
+  }
+  void *ptr = arena_base + arena_cur * ARENA_CHUNK + arena_top;
+  arena_top += rsize;
+  arena_live[arena_cur]++;
+  return ptr;
+}
+
+static void arena_free(void *ptr, size_t size)
+{
+  if (!in_arena(ptr)) {
+    free(ptr);
+    return;
+  }
+  uint32_t chunk = ((char *) ptr - arena_base) >> ARENA_CHUNK_BITS;
+  if (--arena_live[chunk] == 0) {
+    if (chunk == arena_cur) {
+      arena_top = 0;
+    } else {
+      arena_next_free[chunk] = arena_free_list;
+      arena_free_list = chunk;
+    }
+  }
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+  if (!in_arena(ptr)) {
+    void *new_ptr = realloc(ptr, new_size);
+    if (new_ptr == NULL) {
+      fprintf(stderr, "[Sail] Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    return new_ptr;
+  }
+
+  /* The most recent allocation in the current chunk can grow in place. */
+  size_t offset = ((char *) ptr - arena_base) & (ARENA_CHUNK - 1);
+  if (arena_active && ((char *) ptr - arena_base) >> ARENA_CHUNK_BITS == arena_cur
+      && offset + arena_round(old_size) == arena_top
+      && offset + arena_round(new_size) <= ARENA_CHUNK) {
+    arena_top = offset + arena_round(new_size);
+    return ptr;
+  }
+
+  void *new_ptr = arena_alloc(new_size);
+  memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+  arena_free(ptr, old_size);
+  return new_ptr;
+}
+
+void sail_arena_enable(void)
+{
+  if (arena_base == NULL) {
+    void *base = mmap(NULL, ARENA_CHUNKS * ARENA_CHUNK, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      fprintf(stderr, "[Sail] Could not reserve arena, using malloc\n");
+      return;
+    }
+    arena_base = base;
+    mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+  }
+  arena_active = true;
+}
+
+void sail_arena_disable(void)
+{
+  arena_active = false;
 }
 
 bool EQUAL(unit)(const unit a, const unit b)
@@ -74,43 +350,131 @@ bool UNDEFINED(bool)(const unit u) {
 
 /* ***** Sail strings ***** */
 
+/*
+ * Strings written by the library are preceded by a header holding
+ * their length and the size of their buffer, so appending to a string,
+ * as in s = s ^ t, only copies t, and writing a string reuses its
+ * buffer when it is large enough, doubling it when it is not. Strings
+ * passed in may be literals, so their length is only used from the
+ * header when they are also the string being written.
+ */
+struct string_header {
+  size_t len;
+  size_t cap;
+};
+
+#define STRING_HEADER(str) ((struct string_header *) (str) - 1)
+
+/* Enough room that most short strings are never resized. */
+#define STRING_INITIAL_CAP 15
+
+static sail_string string_alloc(const size_t cap)
+{
+  struct string_header *h = malloc(sizeof(struct string_header) + cap + 1);
+  if (h == NULL) {
+    fprintf(stderr, "[Sail] Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  h->len = 0;
+  h->cap = cap;
+  sail_string str = (sail_string) (h + 1);
+  str[0] = '\0';
+  return str;
+}
+
+/*
+ * Make room for a string of len characters in *str, keeping its
+ * contents.
+ */
+static void string_reserve(sail_string *str, const size_t len)
+{
+  struct string_header *h = STRING_HEADER(*str);
+  if (len <= h->cap) {
+    return;
+  }
+  size_t cap = 2 * h->cap > len ? 2 * h->cap : len;
+  h = realloc(h, sizeof(struct string_header) + cap + 1);
+  if (h == NULL) {
+    fprintf(stderr, "[Sail] Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  h->cap = cap;
+  *str = (sail_string) (h + 1);
+}
+
+static void string_set_len(sail_string str, const size_t len)
+{
+  STRING_HEADER(str)->len = len;
+  str[len] = '\0';
+}
+
+/*
+ * Set *str to len characters from src, which may be part of *str.
+ */
+static void string_set(sail_string *str, const char *src, const size_t len)
+{
+  if (src < *str || src > *str + STRING_HEADER(*str)->len) {
+    string_reserve(str, len);
+    memcpy(*str, src, len);
+  } else {
+    memmove(*str, src, len);
+  }
+  string_set_len(*str, len);
+}
+
+/*
+ * Format into *str, as gmp_printf, growing it if the result does not
+ * fit.
+ */
+static void string_printf(sail_string *str, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  int len = gmp_vsnprintf(*str, STRING_HEADER(*str)->cap + 1, fmt, args);
+  va_end(args);
+  if (len < 0) {
+    fprintf(stderr, "[Sail] Could not format string %s\n", fmt);
+    exit(EXIT_FAILURE);
+  }
+  if ((size_t) len > STRING_HEADER(*str)->cap) {
+    string_reserve(str, len);
+    va_start(args, fmt);
+    gmp_vsnprintf(*str, len + 1, fmt, args);
+    va_end(args);
+  }
+  STRING_HEADER(*str)->len = len;
+}
+
 void CREATE(sail_string)(sail_string *str)
 {
-  char *istr = (char *) malloc(1 * sizeof(char));
-  istr[0] = '\0';
-  *str = istr;
+  *str = string_alloc(STRING_INITIAL_CAP);
 }
 
 void RECREATE(sail_string)(sail_string *str)
 {
-  free(*str);
-  char *istr = (char *) malloc(1 * sizeof(char));
-  istr[0] = '\0';
-  *str = istr;
+  string_set_len(*str, 0);
 }
 
 void COPY(sail_string)(sail_string *str1, const sail_string str2)
 {
-  size_t len = strlen(str2);
-  *str1 = realloc(*str1, len + 1);
-  *str1 = strcpy(*str1, str2);
+  if (*str1 != str2) {
+    string_set(str1, str2, strlen(str2));
+  }
 }
 
 void KILL(sail_string)(sail_string *str)
 {
-  free(*str);
+  free(STRING_HEADER(*str));
 }
 
-void dec_str(sail_string *str, const mpz_t n)
+void dec_str(sail_string *str, const sail_int n)
 {
-  free(*str);
-  gmp_asprintf(str, "%Zd", n);
+  string_printf(str, "%Zd", int_mpz(n, sail_lib_tmp1));
 }
 
-void hex_str(sail_string *str, const mpz_t n)
+void hex_str(sail_string *str, const sail_int n)
 {
-  free(*str);
-  gmp_asprintf(str, "0x%Zx", n);
+  string_printf(str, "0x%Zx", int_mpz(n, sail_lib_tmp1));
 }
 
 bool eq_string(const sail_string str1, const sail_string str2)
@@ -127,39 +491,51 @@ void undefined_string(sail_string *str, const unit u) {}
 
 void concat_str(sail_string *stro, const sail_string str1, const sail_string str2)
 {
-  *stro = realloc(*stro, strlen(str1) + strlen(str2) + 1);
-  (*stro)[0] = '\0';
-  strcat(*stro, str1);
-  strcat(*stro, str2);
+  size_t len2 = strlen(str2);
+  if (str1 == *stro) {
+    size_t len1 = STRING_HEADER(*stro)->len;
+    string_reserve(stro, len1 + len2);
+    memmove(*stro + len1, str2 == str1 ? *stro : str2, len2);
+    string_set_len(*stro, len1 + len2);
+  } else if (str2 == *stro) {
+    size_t len1 = strlen(str1);
+    string_reserve(stro, len1 + len2);
+    memmove(*stro + len1, *stro, len2);
+    memcpy(*stro, str1, len1);
+    string_set_len(*stro, len1 + len2);
+  } else {
+    size_t len1 = strlen(str1);
+    string_reserve(stro, len1 + len2);
+    memcpy(*stro, str1, len1);
+    memcpy(*stro + len1, str2, len2);
+    string_set_len(*stro, len1 + len2);
+  }
 }
 
 bool string_startswith(sail_string s, sail_string prefix)
 {
-  return strstr(s, prefix) == s;
+  return strncmp(s, prefix, strlen(prefix)) == 0;
 }
 
 void string_length(sail_int *len, sail_string s)
 {
-  mpz_set_ui(*len, strlen(s));
+  sail_int_set_ui(len, strlen(s));
 }
 
 void string_drop(sail_string *dst, sail_string s, sail_int ns)
 {
-  size_t len = strlen(s);
+  size_t len = s == *dst ? STRING_HEADER(s)->len : strlen(s);
   mach_int n = CREATE_OF(mach_int, sail_int)(ns);
   if (len >= n) {
-    *dst = realloc(*dst, (len - n) + 1);
-    memcpy(*dst, s + n, len - n);
-    (*dst)[len - n] = '\0';
+    string_set(dst, s + n, len - n);
   } else {
-    *dst = realloc(*dst, 1);
-    **dst = '\0';
+    string_set_len(*dst, 0);
   }
 }
 
 void string_take(sail_string *dst, sail_string s, sail_int ns)
 {
-  size_t len = strlen(s);
+  size_t len = s == *dst ? STRING_HEADER(s)->len : strlen(s);
   mach_int n = CREATE_OF(mach_int, sail_int)(ns);
   mach_int to_copy;
   if (len <= n) {
@@ -167,9 +543,7 @@ void string_take(sail_string *dst, sail_string s, sail_int ns)
   } else {
     to_copy = n;
   }
-  *dst = realloc(*dst, to_copy + 1);
-  memcpy(*dst, s, to_copy);
-  *dst[to_copy] = '\0';
+  string_set(dst, s, to_copy);
 }
 
 /* ***** Sail integers ***** */
@@ -231,7 +605,7 @@ void CREATE_OF(sail_int, sail_string)(sail_int *rop, sail_string str)
 }
 
 inline
-void RECREATE_OF(sail_int, sail_string)(mpz_t *rop, sail_string str)
+void RECREATE_OF(sail_int, sail_string)(sail_int *rop, sail_string str)
 {
   mpz_set_str(*rop, str, 10);
 }
@@ -248,6 +622,16 @@ void CONVERT_OF(sail_int, mach_int)(sail_int *rop, const mach_int op)
   mpz_set_si(*rop, op);
 }
 
+void mpz_set_sail_int(mpz_t rop, const sail_int op)
+{
+  mpz_set(rop, op);
+}
+
+void sail_int_set_mpz(sail_int *rop, const mpz_t op)
+{
+  mpz_set(*rop, op);
+}
+
 inline
 bool eq_int(const sail_int op1, const sail_int op2)
 {
@@ -329,7 +713,7 @@ void sub_int(sail_int *rop, const sail_int op1, const sail_int op2)
 void sub_nat(sail_int *rop, const sail_int op1, const sail_int op2)
 {
   mpz_sub(*rop, op1, op2);
-  if (mpz_cmp_ui(*rop, 0) < 0ul) {
+  if (mpz_sgn(*rop) < 0) {
     mpz_set_ui(*rop, 0ul);
   }
 }
@@ -411,562 +795,1701 @@ void pow2(sail_int *rop, const sail_int exp)
   mpz_clear(base);
 }
 
-#endif
-
-/* ***** Sail bitvectors ***** */
+#else
 
-bool EQUAL(mach_bits)(const mach_bits op1, const mach_bits op2)
+/*
+ * Called when the result of an integer operation does not fit in 128
+ * bits. Continuing with a wrapped around result would make the model
+ * silently compute the wrong thing, so stop.
+ */
+static void sail_int_overflow(const char *op)
 {
-  return op1 == op2;
+  fprintf(stderr, "[Sail] Integer overflow in %s, compile without USE_INT128 to use GMP integers\n", op);
+  exit(EXIT_FAILURE);
 }
 
-void CREATE(sail_bits)(sail_bits *rop)
+static void sail_int_div_zero(const char *op)
 {
-  rop->bits = malloc(sizeof(mpz_t));
-  rop->len = 0;
-  mpz_init(*rop->bits);
+  fprintf(stderr, "[Sail] Division by zero in %s\n", op);
+  exit(EXIT_FAILURE);
 }
 
-void RECREATE(sail_bits)(sail_bits *rop)
+inline
+void COPY(sail_int)(sail_int *rop, const sail_int op)
 {
-  rop->len = 0;
-  mpz_set_ui(*rop->bits, 0);
+  *rop = op;
 }
 
-void COPY(sail_bits)(sail_bits *rop, const sail_bits op)
+inline
+void CREATE(sail_int)(sail_int *rop)
 {
-  rop->len = op.len;
-  mpz_set(*rop->bits, *op.bits);
+  *rop = 0;
 }
 
-void KILL(sail_bits)(sail_bits *rop)
+inline
+void RECREATE(sail_int)(sail_int *rop)
 {
-  mpz_clear(*rop->bits);
-  free(rop->bits);
+  *rop = 0;
 }
 
-void CREATE_OF(sail_bits, mach_bits)(sail_bits *rop, const uint64_t op, const uint64_t len, const bool direction)
+inline
+void KILL(sail_int)(sail_int *rop) {}
+
+inline
+void CREATE_OF(sail_int, mach_int)(sail_int *rop, mach_int op)
 {
-  rop->bits = malloc(sizeof(mpz_t));
-  rop->len = len;
-  mpz_init_set_ui(*rop->bits, op);
+  *rop = op;
 }
 
-mach_bits CREATE_OF(mach_bits, sail_bits)(const sail_bits op)
+inline
+mach_int CREATE_OF(mach_int, sail_int)(const sail_int op)
 {
-  return mpz_get_ui(*op.bits);
+  return (mach_int) op;
 }
 
-void RECREATE_OF(sail_bits, mach_bits)(sail_bits *rop, const uint64_t op, const uint64_t len, const bool direction)
+inline
+void RECREATE_OF(sail_int, mach_int)(sail_int *rop, mach_int op)
 {
-  rop->len = len;
-  mpz_set_ui(*rop->bits, op);
+  *rop = op;
 }
 
-mach_bits CONVERT_OF(mach_bits, sail_bits)(const sail_bits op, const bool direction)
+void CREATE_OF(sail_int, sail_string)(sail_int *rop, sail_string str)
 {
-  return mpz_get_ui(*op.bits);
+  mpz_t n;
+  mpz_init_set_str(n, str, 10);
+  sail_int_set_mpz(rop, n);
+  mpz_clear(n);
 }
 
-void CONVERT_OF(sail_bits, mach_bits)(sail_bits *rop, const mach_bits op, const uint64_t len, const bool direction)
+void RECREATE_OF(sail_int, sail_string)(sail_int *rop, sail_string str)
 {
-  rop->len = len;
-  // use safe_rshift to correctly handle the case when we have a 0-length vector.
-  mpz_set_ui(*rop->bits, op & safe_rshift(UINT64_MAX, 64 - len));
+  CREATE_OF(sail_int, sail_string)(rop, str);
 }
 
-void UNDEFINED(sail_bits)(sail_bits *rop, const sail_int len, const mach_bits bit)
+inline
+mach_int CONVERT_OF(mach_int, sail_int)(const sail_int op)
 {
-  zeros(rop, len);
+  return (mach_int) op;
 }
 
-mach_bits UNDEFINED(mach_bits)(const unit u) { return 0; }
-
-mach_bits safe_rshift(const mach_bits x, const mach_bits n)
+inline
+void CONVERT_OF(sail_int, mach_int)(sail_int *rop, const mach_int op)
 {
-  if (n >= 64) {
-    return 0ul;
-  } else {
-    return x >> n;
-  }
+  *rop = op;
 }
 
-void normalize_sail_bits(sail_bits *rop) {
-  /* TODO optimisation: keep a set of masks of various sizes handy */
-  mpz_set_ui(sail_lib_tmp1, 1);
-  mpz_mul_2exp(sail_lib_tmp1, sail_lib_tmp1, rop->len);
-  mpz_sub_ui(sail_lib_tmp1, sail_lib_tmp1, 1);
-  mpz_and(*rop->bits, *rop->bits, sail_lib_tmp1);
+void mpz_set_sail_int(mpz_t rop, const sail_int op)
+{
+  mpz_set_s128(rop, op);
 }
 
-void append_64(sail_bits *rop, const sail_bits op, const mach_bits chunk)
+void sail_int_set_mpz(sail_int *rop, const mpz_t op)
 {
-  rop->len = rop->len + 64ul;
-  mpz_mul_2exp(*rop->bits, *op.bits, 64ul);
-  mpz_add_ui(*rop->bits, *rop->bits, chunk);
+  /* Everything below 2^127 in magnitude fits, and so does -2^127. */
+  size_t bits = mpz_sizeinbase(op, 2);
+  if (bits > 128 || (bits == 128 && (mpz_sgn(op) > 0 || mpz_scan1(op, 0) != 127))) {
+    sail_int_overflow("conversion from GMP integer");
+  }
+  *rop = (int128_t) mpz_get_u128(op);
 }
 
-void add_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+inline
+bool eq_int(const sail_int op1, const sail_int op2)
 {
-  rop->len = op1.len;
-  mpz_add(*rop->bits, *op1.bits, *op2.bits);
-  normalize_sail_bits(rop);
+  return op1 == op2;
 }
 
-void sub_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+inline
+bool EQUAL(sail_int)(const sail_int op1, const sail_int op2)
 {
-  assert(op1.len == op2.len);
-  rop->len = op1.len;
-  mpz_sub(*rop->bits, *op1.bits, *op2.bits);
-  normalize_sail_bits(rop);
+  return op1 == op2;
 }
 
-void add_bits_int(sail_bits *rop, const sail_bits op1, const mpz_t op2)
+inline
+bool lt(const sail_int op1, const sail_int op2)
 {
-  rop->len = op1.len;
-  mpz_add(*rop->bits, *op1.bits, op2);
-  normalize_sail_bits(rop);
+  return op1 < op2;
 }
 
-void sub_bits_int(sail_bits *rop, const sail_bits op1, const mpz_t op2)
+inline
+bool gt(const sail_int op1, const sail_int op2)
 {
-  rop->len = op1.len;
-  mpz_sub(*rop->bits, *op1.bits, op2);
-  normalize_sail_bits(rop);
+  return op1 > op2;
 }
 
-void and_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+inline
+bool lteq(const sail_int op1, const sail_int op2)
 {
-  assert(op1.len == op2.len);
-  rop->len = op1.len;
-  mpz_and(*rop->bits, *op1.bits, *op2.bits);
+  return op1 <= op2;
 }
 
-void or_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+inline
+bool gteq(const sail_int op1, const sail_int op2)
 {
-  assert(op1.len == op2.len);
-  rop->len = op1.len;
-  mpz_ior(*rop->bits, *op1.bits, *op2.bits);
+  return op1 >= op2;
 }
 
-void xor_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+void shl_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  assert(op1.len == op2.len);
-  rop->len = op1.len;
-  mpz_xor(*rop->bits, *op1.bits, *op2.bits);
+  if (op1 == 0) {
+    *rop = 0;
+    return;
+  }
+  /* Shifting back has to give op1, otherwise bits were lost. */
+  uint64_t shift = (uint64_t) op2;
+  sail_int r = shift >= 128 ? 0 : (sail_int) ((uint128_t) op1 << shift);
+  if (shift >= 128 || (r >> shift) != op1) {
+    sail_int_overflow("shl_int");
+  }
+  *rop = r;
 }
 
-void not_bits(sail_bits *rop, const sail_bits op)
+inline
+mach_int shl_mach_int(const mach_int op1, const mach_int op2)
 {
-  rop->len = op.len;
-  mpz_set(*rop->bits, *op.bits);
-  for (mp_bitcnt_t i = 0; i < op.len; i++) {
-    mpz_combit(*rop->bits, i);
-  }
+  return op1 << op2;
 }
 
-void mults_vec(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+inline
+void shr_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  mpz_t op1_int, op2_int;
-  mpz_init(op1_int);
-  mpz_init(op2_int);
-  sail_signed(&op1_int, op1);
-  sail_signed(&op2_int, op2);
-  rop->len = op1.len * 2;
-  mpz_mul(*rop->bits, op1_int, op2_int);
-  normalize_sail_bits(rop);
-  mpz_clear(op1_int);
-  mpz_clear(op2_int);
+  /* Arithmetic shift, which rounds towards -infinity like mpz_fdiv_q_2exp. */
+  uint64_t shift = (uint64_t) op2;
+  *rop = op1 >> (shift >= 127 ? 127 : shift);
 }
 
-void mult_vec(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+inline
+void undefined_int(sail_int *rop, const int n)
 {
-  rop->len = op1.len * 2;
-  mpz_mul(*rop->bits, *op1.bits, *op2.bits);
-  normalize_sail_bits(rop); /* necessary? */
+  *rop = (uint64_t) n;
 }
 
+inline
+void undefined_range(sail_int *rop, const sail_int l, const sail_int u)
+{
+  *rop = l;
+}
 
-void zeros(sail_bits *rop, const sail_int op)
+inline
+void add_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  rop->len = mpz_get_ui(op);
-  mpz_set_ui(*rop->bits, 0);
+  if (__builtin_add_overflow(op1, op2, rop)) sail_int_overflow("add_int");
 }
 
-void zero_extend(sail_bits *rop, const sail_bits op, const sail_int len)
+inline
+void sub_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  assert(op.len <= mpz_get_ui(len));
-  rop->len = mpz_get_ui(len);
-  mpz_set(*rop->bits, *op.bits);
+  if (__builtin_sub_overflow(op1, op2, rop)) sail_int_overflow("sub_int");
 }
 
-void sign_extend(sail_bits *rop, const sail_bits op, const sail_int len)
+void sub_nat(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  assert(op.len <= mpz_get_ui(len));
-  rop->len = mpz_get_ui(len);
-  if(mpz_tstbit(*op.bits, op.len - 1)) {
-    mpz_set(*rop->bits, *op.bits);
-    for(mp_bitcnt_t i = rop->len - 1; i >= op.len; i--) {
-      mpz_setbit(*rop->bits, i);
-    }
-  } else {
-    mpz_set(*rop->bits, *op.bits);
+  sub_int(rop, op1, op2);
+  if (*rop < 0) {
+    *rop = 0;
   }
 }
 
-void length_sail_bits(sail_int *rop, const sail_bits op)
+inline
+void mult_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  mpz_set_ui(*rop, op.len);
+  if (__builtin_mul_overflow(op1, op2, rop)) sail_int_overflow("mult_int");
 }
 
-bool eq_bits(const sail_bits op1, const sail_bits op2)
+/*
+ * C division truncates towards zero, like mpz_tdiv_q. The only
+ * quotient that does not fit is INT128_MIN / -1.
+ */
+static inline void check_div(const char *op, const sail_int op1, const sail_int op2)
 {
-  assert(op1.len == op2.len);
-  for (mp_bitcnt_t i = 0; i < op1.len; i++) {
-    if (mpz_tstbit(*op1.bits, i) != mpz_tstbit(*op2.bits, i)) return false;
-  }
-  return true;
+  if (op2 == 0) sail_int_div_zero(op);
+  if (op2 == -1 && op1 == (sail_int) ((uint128_t) 1 << 127)) sail_int_overflow(op);
 }
 
-bool EQUAL(sail_bits)(const sail_bits op1, const sail_bits op2)
+inline
+void tdiv_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  return eq_bits(op1, op2);
+  check_div("tdiv_int", op1, op2);
+  *rop = op1 / op2;
 }
 
-bool neq_bits(const sail_bits op1, const sail_bits op2)
+inline
+void tmod_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  assert(op1.len == op2.len);
-  for (mp_bitcnt_t i = 0; i < op1.len; i++) {
-    if (mpz_tstbit(*op1.bits, i) != mpz_tstbit(*op2.bits, i)) return true;
-  }
-  return false;
+  if (op2 == 0) sail_int_div_zero("tmod_int");
+  *rop = op2 == -1 ? 0 : op1 % op2;
 }
 
-void vector_subrange_sail_bits(sail_bits *rop,
-			       const sail_bits op,
-			       const sail_int n_mpz,
-			       const sail_int m_mpz)
+inline
+void fdiv_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  uint64_t n = mpz_get_ui(n_mpz);
-  uint64_t m = mpz_get_ui(m_mpz);
+  check_div("fdiv_int", op1, op2);
+  sail_int q = op1 / op2;
+  if (q * op2 != op1 && ((op1 < 0) != (op2 < 0))) q--;
+  *rop = q;
+}
 
-  rop->len = n - (m - 1ul);
-  mpz_fdiv_q_2exp(*rop->bits, *op.bits, m);
-  normalize_sail_bits(rop);
+inline
+void fmod_int(sail_int *rop, const sail_int op1, const sail_int op2)
+{
+  if (op2 == 0) sail_int_div_zero("fmod_int");
+  /* The remainder takes the sign of the divisor, like mpz_fdiv_r. */
+  sail_int r = op2 == -1 ? 0 : op1 % op2;
+  if (r != 0 && ((r < 0) != (op2 < 0))) r += op2;
+  *rop = r;
 }
 
-void sail_truncate(sail_bits *rop, const sail_bits op, const sail_int len)
+void max_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  assert(op.len >= mpz_get_ui(len));
-  rop->len = mpz_get_ui(len);
-  mpz_set(*rop->bits, *op.bits);
-  normalize_sail_bits(rop);
+  *rop = op1 < op2 ? op2 : op1;
 }
 
-mach_bits bitvector_access(const sail_bits op, const sail_int n_mpz)
+void min_int(sail_int *rop, const sail_int op1, const sail_int op2)
 {
-  uint64_t n = mpz_get_ui(n_mpz);
-  return (mach_bits) mpz_tstbit(*op.bits, n);
+  *rop = op1 > op2 ? op2 : op1;
 }
 
-void sail_unsigned(sail_int *rop, const sail_bits op)
+inline
+void neg_int(sail_int *rop, const sail_int op)
 {
-  /* Normal form of bv_t is always positive so just return the bits. */
-  mpz_set(*rop, *op.bits);
+  if (__builtin_sub_overflow((sail_int) 0, op, rop)) sail_int_overflow("neg_int");
 }
 
-void sail_signed(sail_int *rop, const sail_bits op)
+inline
+void abs_int(sail_int *rop, const sail_int op)
 {
-  if (op.len == 0) {
-    mpz_set_ui(*rop, 0);
+  if (op < 0) {
+    neg_int(rop, op);
   } else {
-    mp_bitcnt_t sign_bit = op.len - 1;
-    mpz_set(*rop, *op.bits);
-    if (mpz_tstbit(*op.bits, sign_bit) != 0) {
-      /* If sign bit is unset then we are done,
-         otherwise clear sign_bit and subtract 2**sign_bit */
-      mpz_set_ui(sail_lib_tmp1, 1);
-      mpz_mul_2exp(sail_lib_tmp1, sail_lib_tmp1, sign_bit); /* 2**sign_bit */
-      mpz_combit(*rop, sign_bit); /* clear sign_bit */
-      mpz_sub(*rop, *rop, sail_lib_tmp1);
-    }
+    *rop = op;
   }
 }
 
-void append(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+void pow_int(sail_int *rop, const sail_int op1, const sail_int op2)
+{
+  /* Squaring b overflows only if the result would too, as long as
+     there are more bits of the exponent to go. */
+  uint64_t n = (uint64_t) op2;
+  sail_int r = 1;
+  sail_int b = op1;
+  while (n != 0) {
+    if ((n & 1) && __builtin_mul_overflow(r, b, &r)) sail_int_overflow("pow_int");
+    n >>= 1;
+    if (n != 0 && __builtin_mul_overflow(b, b, &b)) sail_int_overflow("pow_int");
+  }
+  *rop = r;
+}
+
+void pow2(sail_int *rop, const sail_int exp)
+{
+  if (exp < 0 || exp >= 127) sail_int_overflow("pow2");
+  *rop = (sail_int) 1 << (uint64_t) exp;
+}
+
+#endif
+
+/* ***** Sail bitvectors ***** */
+
+/*
+ * Bitvectors of at most SAIL_BITS_INLINE bits keep their value in
+ * the two words of small (least significant word first), which we
+ * operate on as a single unsigned __int128. Larger bitvectors keep
+ * their value in *bits, which is only allocated the first time a
+ * bitvector becomes too large to be stored inline, and is kept
+ * around for reuse until the bitvector is killed.
+ */
+static inline bool is_inline(const mp_bitcnt_t len)
+{
+  return len <= SAIL_BITS_INLINE;
+}
+
+static inline uint128_t mask128(const mp_bitcnt_t len)
+{
+  return len >= 128 ? ~((uint128_t) 0) : (((uint128_t) 1) << len) - 1;
+}
+
+static inline uint128_t get_small(const sail_bits op)
+{
+  return ((uint128_t) op.small[1] << 64) | op.small[0];
+}
+
+static inline void set_small(sail_bits *rop, const mp_bitcnt_t len, const uint128_t op)
+{
+  uint128_t v = op & mask128(len);
+  rop->len = len;
+  rop->small[0] = (uint64_t) v;
+  rop->small[1] = (uint64_t) (v >> 64);
+}
+
+/*
+ * Sign extend a len bit value to 128 bits.
+ */
+static inline int128_t signed_small(uint128_t v, const mp_bitcnt_t len)
 {
-  rop->len = op1.len + op2.len;
-  mpz_mul_2exp(*rop->bits, *op1.bits, op2.len);
-  mpz_ior(*rop->bits, *rop->bits, *op2.bits);
+  if (len == 0) return 0;
+  if (len < 128 && ((v >> (len - 1)) & 1)) v |= ~mask128(len);
+  return (int128_t) v;
 }
 
-void replicate_bits(sail_bits *rop, const sail_bits op1, const mpz_t op2)
+static inline mpz_t *big_bits(sail_bits *rop)
 {
-  uint64_t op2_ui = mpz_get_ui(op2);
-  rop->len = op1.len * op2_ui;
-  mpz_set_ui(*rop->bits, 0);
-  for (int i = 0; i < op2_ui; i++) {
-    mpz_mul_2exp(*rop->bits, *rop->bits, op1.len);
-    mpz_ior(*rop->bits, *rop->bits, *op1.bits);
+  if (rop->bits == NULL) {
+    rop->bits = arena_alloc(sizeof(mpz_t));
+    mpz_init(*rop->bits);
   }
+  return rop->bits;
 }
 
-uint64_t fast_replicate_bits(const uint64_t shift, const uint64_t v, const int64_t times)
+/*
+ * Return a GMP integer holding the value of op, which is either op's
+ * own, or tmp set to the value of op if op is stored inline.
+ */
+static inline mpz_t *bits_mpz(const sail_bits *op, mpz_t *tmp)
 {
-  uint64_t r = v;
-  for (int i = 1; i < times; ++i) {
-    r |= (r << shift);
+  if (is_inline(op->len)) {
+    mpz_set_u128(*tmp, get_small(*op));
+    return tmp;
+  } else {
+    return op->bits;
   }
-  return r;
 }
 
-// Takes a slice of the (two's complement) binary representation of
-// integer n, starting at bit start, and of length len. With the
-// argument in the following order:
-//
-// get_slice_int(len, n, start)
-//
-// For example:
-//
-// get_slice_int(8, 1680, 4) =
-//
-//                    11           0
-//                    V            V
-// get_slice_int(8, 0b0110_1001_0000, 4) = 0b0110_1001
-//                    <-------^
-//                    (8 bit) 4
-//
-void get_slice_int(sail_bits *rop, const sail_int len_mpz, const sail_int n, const sail_int start_mpz)
+static inline uint64_t bits_get_ui(const sail_bits op)
 {
-  uint64_t start = mpz_get_ui(start_mpz);
-  uint64_t len = mpz_get_ui(len_mpz);
+  return is_inline(op.len) ? op.small[0] : mpz_get_ui(*op.bits);
+}
 
-  mpz_set_ui(*rop->bits, 0ul);
-  rop->len = len;
+static inline void bits_set_ui(sail_bits *rop, const mp_bitcnt_t len, const uint64_t op)
+{
+  if (is_inline(len)) {
+    set_small(rop, len, op);
+  } else {
+    rop->len = len;
+    mpz_set_ui(*big_bits(rop), op);
+  }
+}
 
-  for (uint64_t i = 0; i < len; i++) {
-    if (mpz_tstbit(n, i + start)) mpz_setbit(*rop->bits, i);
+void normalize_sail_bits(sail_bits *rop) {
+  if (is_inline(rop->len)) {
+    set_small(rop, rop->len, get_small(*rop));
+    return;
   }
+  /* Floor division keeps the result non-negative, so this also wraps
+     the negative intermediates produced by sub_bits and not_bits. */
+  mpz_fdiv_r_2exp(*rop->bits, *rop->bits, rop->len);
 }
 
-// Set slice uses the same indexing scheme as get_slice_int, but it
-// puts a bitvector slice into an integer rather than returning it.
-void set_slice_int(sail_int *rop,
-		   const sail_int len_mpz,
-		   const sail_int n,
-		   const sail_int start_mpz,
-		   const sail_bits slice)
+/*
+ * Set rop to the lowest len bits of op, which is left with an
+ * unspecified value.
+ */
+static inline void bits_move_mpz(sail_bits *rop, const mp_bitcnt_t len, mpz_t op)
+{
+  if (is_inline(len)) {
+    set_small(rop, len, mpz_get_u128(op));
+  } else {
+    rop->len = len;
+    mpz_swap(*big_bits(rop), op);
+    normalize_sail_bits(rop);
+  }
+}
+
+void sail_bits_of_mpz(sail_bits *rop, const mp_bitcnt_t len, const mpz_t op)
 {
-  uint64_t start = mpz_get_ui(start_mpz);
+  mpz_set(sail_bits_tmp3, op);
+  bits_move_mpz(rop, len, sail_bits_tmp3);
+}
 
-  mpz_set(*rop, n);
+void mpz_of_sail_bits(mpz_t rop, const sail_bits op)
+{
+  mpz_set(rop, *bits_mpz(&op, &sail_bits_tmp1));
+}
 
-  for (uint64_t i = 0; i < slice.len; i++) {
-    if (mpz_tstbit(*slice.bits, i)) {
-      mpz_setbit(*rop, i + start);
-    } else {
-      mpz_clrbit(*rop, i + start);
-    }
+/*
+ * sail_signed for GMP integers, which is also used for the results
+ * of bitvector operations that are too wide for a sail_int.
+ */
+static void mpz_signed(mpz_t rop, const sail_bits op)
+{
+  if (is_inline(op.len)) {
+    mpz_set_s128(rop, signed_small(get_small(op), op.len));
+  } else if (mpz_tstbit(*op.bits, op.len - 1)) {
+    /* The value is -(2**len - op), and 2**len - op is the two's
+       complement negation of op's limbs, truncated to len bits. op
+       has all n limbs, as its top bit is set. */
+    mp_size_t n = (op.len + 63) / 64;
+    mp_limb_t *r = mpz_limbs_write(rop, n);
+    mpn_neg(r, mpz_limbs_read(*op.bits), n);
+    if (op.len % 64 != 0) r[n - 1] &= ((mp_limb_t) 1 << (op.len % 64)) - 1;
+    mpz_limbs_finish(rop, -n);
+  } else {
+    mpz_set(rop, *op.bits);
   }
 }
 
-void vector_update_subrange_sail_bits(sail_bits *rop,
-				 const sail_bits op,
-				 const sail_int n_mpz,
-				 const sail_int m_mpz,
-				 const sail_bits slice)
+bool EQUAL(mach_bits)(const mach_bits op1, const mach_bits op2)
+{
+  return op1 == op2;
+}
+
+void CREATE(sail_bits)(sail_bits *rop)
+{
+  rop->len = 0;
+  rop->small[0] = 0;
+  rop->small[1] = 0;
+  rop->bits = NULL;
+}
+
+void RECREATE(sail_bits)(sail_bits *rop)
 {
-  uint64_t n = mpz_get_ui(n_mpz);
-  uint64_t m = mpz_get_ui(m_mpz);
+  rop->len = 0;
+  rop->small[0] = 0;
+  rop->small[1] = 0;
+}
 
-  mpz_set(*rop->bits, *op.bits);
+void COPY(sail_bits)(sail_bits *rop, const sail_bits op)
+{
   rop->len = op.len;
+  if (is_inline(op.len)) {
+    rop->small[0] = op.small[0];
+    rop->small[1] = op.small[1];
+  } else {
+    mpz_set(*big_bits(rop), *op.bits);
+  }
+}
 
-  for (uint64_t i = 0; i < n - (m - 1ul); i++) {
-    if (mpz_tstbit(*slice.bits, i)) {
-      mpz_setbit(*rop->bits, i + m);
-    } else {
-      mpz_clrbit(*rop->bits, i + m);
-    }
+void KILL(sail_bits)(sail_bits *rop)
+{
+  if (rop->bits != NULL) {
+    mpz_clear(*rop->bits);
+    arena_free(rop->bits, sizeof(mpz_t));
   }
 }
 
-void slice(sail_bits *rop, const sail_bits op, const sail_int start_mpz, const sail_int len_mpz)
+void CREATE_OF(sail_bits, mach_bits)(sail_bits *rop, const uint64_t op, const uint64_t len, const bool direction)
 {
-  assert(mpz_get_ui(start_mpz) + mpz_get_ui(len_mpz) <= op.len);
-  uint64_t start = mpz_get_ui(start_mpz);
-  uint64_t len = mpz_get_ui(len_mpz);
+  rop->bits = NULL;
+  bits_set_ui(rop, len, op);
+}
 
-  mpz_set_ui(*rop->bits, 0);
-  rop->len = len;
+mach_bits CREATE_OF(mach_bits, sail_bits)(const sail_bits op)
+{
+  return bits_get_ui(op);
+}
+
+void RECREATE_OF(sail_bits, mach_bits)(sail_bits *rop, const uint64_t op, const uint64_t len, const bool direction)
+{
+  bits_set_ui(rop, len, op);
+}
+
+mach_bits CONVERT_OF(mach_bits, sail_bits)(const sail_bits op, const bool direction)
+{
+  return bits_get_ui(op);
+}
+
+void CONVERT_OF(sail_bits, mach_bits)(sail_bits *rop, const mach_bits op, const uint64_t len, const bool direction)
+{
+  // use safe_rshift to correctly handle the case when we have a 0-length vector.
+  bits_set_ui(rop, len, op & safe_rshift(UINT64_MAX, 64 - len));
+}
 
-  for (uint64_t i = 0; i < len; i++) {
-    if (mpz_tstbit(*op.bits, i + start)) mpz_setbit(*rop->bits, i);
+void UNDEFINED(sail_bits)(sail_bits *rop, const sail_int len, const mach_bits bit)
+{
+  zeros(rop, len);
+}
+
+mach_bits UNDEFINED(mach_bits)(const unit u) { return 0; }
+
+mach_bits safe_rshift(const mach_bits x, const mach_bits n)
+{
+  if (n >= 64) {
+    return 0ul;
+  } else {
+    return x >> n;
   }
 }
 
-void set_slice(sail_bits *rop,
-	       const sail_int len_mpz,
-	       const sail_int slen_mpz,
-	       const sail_bits op,
-	       const sail_int start_mpz,
-	       const sail_bits slice)
+void append_64(sail_bits *rop, const sail_bits op, const mach_bits chunk)
+{
+  mp_bitcnt_t len = rop->len + 64ul;
+  if (is_inline(len) && is_inline(op.len)) {
+    set_small(rop, len, (get_small(op) << 64) | chunk);
+  } else {
+    mpz_mul_2exp(sail_bits_tmp3, *bits_mpz(&op, &sail_bits_tmp1), 64ul);
+    mpz_add_ui(sail_bits_tmp3, sail_bits_tmp3, chunk);
+    bits_move_mpz(rop, len, sail_bits_tmp3);
+  }
+}
+
+void add_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) + get_small(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_add(*big_bits(rop), *op1.bits, *op2.bits);
+    normalize_sail_bits(rop);
+  }
+}
+
+void sub_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  assert(op1.len == op2.len);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) - get_small(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_sub(*big_bits(rop), *op1.bits, *op2.bits);
+    normalize_sail_bits(rop);
+  }
+}
+
+#ifndef USE_INT128
+#define int_get_u128(op) mpz_get_u128(op)
+#else
+#define int_get_u128(op) ((uint128_t) (op))
+#endif
+
+void add_bits_int(sail_bits *rop, const sail_bits op1, const sail_int op2)
+{
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) + int_get_u128(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_add(*big_bits(rop), *op1.bits, int_mpz(op2, sail_bits_tmp1));
+    normalize_sail_bits(rop);
+  }
+}
+
+void sub_bits_int(sail_bits *rop, const sail_bits op1, const sail_int op2)
+{
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) - int_get_u128(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_sub(*big_bits(rop), *op1.bits, int_mpz(op2, sail_bits_tmp1));
+    normalize_sail_bits(rop);
+  }
+}
+
+void and_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
 {
-  uint64_t start = mpz_get_ui(start_mpz);
+  assert(op1.len == op2.len);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) & get_small(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_and(*big_bits(rop), *op1.bits, *op2.bits);
+  }
+}
+
+void or_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  assert(op1.len == op2.len);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) | get_small(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_ior(*big_bits(rop), *op1.bits, *op2.bits);
+  }
+}
+
+void xor_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  assert(op1.len == op2.len);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, get_small(op1) ^ get_small(op2));
+  } else {
+    rop->len = op1.len;
+    mpz_xor(*big_bits(rop), *op1.bits, *op2.bits);
+  }
+}
+
+void not_bits(sail_bits *rop, const sail_bits op)
+{
+  if (is_inline(op.len)) {
+    set_small(rop, op.len, ~get_small(op));
+    return;
+  }
+  rop->len = op.len;
+  mpz_com(*big_bits(rop), *op.bits);
+  normalize_sail_bits(rop);
+}
+
+void mults_vec(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  if (is_inline(op1.len * 2)) {
+    uint128_t v1 = (uint128_t) signed_small(get_small(op1), op1.len);
+    uint128_t v2 = (uint128_t) signed_small(get_small(op2), op2.len);
+    set_small(rop, op1.len * 2, v1 * v2);
+    return;
+  }
+  mpz_t op1_int, op2_int;
+  mpz_init(op1_int);
+  mpz_init(op2_int);
+  mpz_signed(op1_int, op1);
+  mpz_signed(op2_int, op2);
+  rop->len = op1.len * 2;
+  mpz_mul(*big_bits(rop), op1_int, op2_int);
+  normalize_sail_bits(rop);
+  mpz_clear(op1_int);
+  mpz_clear(op2_int);
+}
+
+void mult_vec(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  if (is_inline(op1.len * 2)) {
+    set_small(rop, op1.len * 2, get_small(op1) * get_small(op2));
+    return;
+  }
+  mpz_mul(sail_bits_tmp3, *bits_mpz(&op1, &sail_bits_tmp1), *bits_mpz(&op2, &sail_bits_tmp2));
+  bits_move_mpz(rop, op1.len * 2, sail_bits_tmp3); /* normalization necessary? */
+}
+
+
+void zeros(sail_bits *rop, const sail_int op)
+{
+  bits_set_ui(rop, sail_int_get_ui(op), 0);
+}
+
+void zero_extend(sail_bits *rop, const sail_bits op, const sail_int len)
+{
+  assert(op.len <= sail_int_get_ui(len));
+  mp_bitcnt_t rlen = sail_int_get_ui(len);
+  if (is_inline(rlen)) {
+    set_small(rop, rlen, get_small(op));
+  } else {
+    mpz_set(sail_bits_tmp3, *bits_mpz(&op, &sail_bits_tmp1));
+    rop->len = rlen;
+    mpz_swap(*big_bits(rop), sail_bits_tmp3);
+  }
+}
+
+void sign_extend(sail_bits *rop, const sail_bits op, const sail_int len)
+{
+  assert(op.len <= sail_int_get_ui(len));
+  mp_bitcnt_t rlen = sail_int_get_ui(len);
+  if (is_inline(rlen)) {
+    set_small(rop, rlen, (uint128_t) signed_small(get_small(op), op.len));
+  } else {
+    mpz_signed(sail_bits_tmp3, op);
+    bits_move_mpz(rop, rlen, sail_bits_tmp3);
+  }
+}
+
+void length_sail_bits(sail_int *rop, const sail_bits op)
+{
+  sail_int_set_ui(rop, op.len);
+}
+
+bool eq_bits(const sail_bits op1, const sail_bits op2)
+{
+  assert(op1.len == op2.len);
+  if (is_inline(op1.len)) {
+    return op1.small[0] == op2.small[0] && op1.small[1] == op2.small[1];
+  }
+  /* Both are normalised, so equal bits means equal integers. */
+  return mpz_cmp(*op1.bits, *op2.bits) == 0;
+}
+
+bool EQUAL(sail_bits)(const sail_bits op1, const sail_bits op2)
+{
+  return eq_bits(op1, op2);
+}
+
+bool neq_bits(const sail_bits op1, const sail_bits op2)
+{
+  assert(op1.len == op2.len);
+  if (is_inline(op1.len)) {
+    return op1.small[0] != op2.small[0] || op1.small[1] != op2.small[1];
+  }
+  return mpz_cmp(*op1.bits, *op2.bits) != 0;
+}
+
+void vector_subrange_sail_bits(sail_bits *rop,
+			       const sail_bits op,
+			       const sail_int n_mpz,
+			       const sail_int m_mpz)
+{
+  uint64_t n = sail_int_get_ui(n_mpz);
+  uint64_t m = sail_int_get_ui(m_mpz);
+
+  if (is_inline(op.len)) {
+    set_small(rop, n - (m - 1ul), m >= 128 ? 0 : get_small(op) >> m);
+  } else {
+    mpz_fdiv_q_2exp(sail_bits_tmp3, *op.bits, m);
+    bits_move_mpz(rop, n - (m - 1ul), sail_bits_tmp3);
+  }
+}
+
+void sail_truncate(sail_bits *rop, const sail_bits op, const sail_int len)
+{
+  assert(op.len >= sail_int_get_ui(len));
+  mp_bitcnt_t rlen = sail_int_get_ui(len);
+  if (is_inline(rlen)) {
+    set_small(rop, rlen, is_inline(op.len) ? get_small(op) : mpz_get_u128(*op.bits));
+  } else {
+    rop->len = rlen;
+    mpz_set(*big_bits(rop), *op.bits);
+    normalize_sail_bits(rop);
+  }
+}
+
+mach_bits bitvector_access(const sail_bits op, const sail_int n_mpz)
+{
+  uint64_t n = sail_int_get_ui(n_mpz);
+  if (is_inline(op.len)) {
+    return n >= 128 ? 0 : (mach_bits) (get_small(op) >> n) & 1;
+  }
+  return (mach_bits) mpz_tstbit(*op.bits, n);
+}
+
+void sail_unsigned(sail_int *rop, const sail_bits op)
+{
+  /* Normal form of bv_t is always positive so just return the bits. */
+#ifndef USE_INT128
+  if (is_inline(op.len)) {
+    mpz_set_u128(*rop, get_small(op));
+  } else {
+    mpz_set(*rop, *op.bits);
+  }
+#else
+  if (is_inline(op.len)) {
+    uint128_t v = get_small(op);
+    if (v >> 127) sail_int_overflow("unsigned");
+    *rop = (sail_int) v;
+  } else {
+    sail_int_set_mpz(rop, *op.bits);
+  }
+#endif
+}
+
+void sail_signed(sail_int *rop, const sail_bits op)
+{
+#ifndef USE_INT128
+  mpz_signed(*rop, op);
+#else
+  if (is_inline(op.len)) {
+    *rop = signed_small(get_small(op), op.len);
+  } else {
+    mpz_signed(sail_lib_tmp2, op);
+    sail_int_set_mpz(rop, sail_lib_tmp2);
+  }
+#endif
+}
+
+void append(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  mp_bitcnt_t len = op1.len + op2.len;
+  if (is_inline(len)) {
+    uint128_t hi = op2.len >= 128 ? 0 : get_small(op1) << op2.len;
+    set_small(rop, len, hi | get_small(op2));
+  } else {
+    mpz_t *v2 = bits_mpz(&op2, &sail_bits_tmp2);
+    mpz_mul_2exp(sail_bits_tmp3, *bits_mpz(&op1, &sail_bits_tmp1), op2.len);
+    mpz_ior(sail_bits_tmp3, sail_bits_tmp3, *v2);
+    rop->len = len;
+    mpz_swap(*big_bits(rop), sail_bits_tmp3);
+  }
+}
+
+/*
+ * OR the lowest len bits of src, which has src_n limbs (any limbs
+ * above those are zero), into dst from bit offset on. dst has dst_n
+ * limbs and the len bits from offset must be zero. src may be dst, as
+ * long as len <= offset.
+ */
+static void limbs_ior_bits(mp_limb_t *dst, const mp_size_t dst_n, const mp_bitcnt_t offset,
+                           const mp_limb_t *src, const mp_size_t src_n, const mp_bitcnt_t len)
+{
+  mp_size_t d = offset / 64;
+  unsigned shift = offset % 64;
+  mp_size_t n = (len + 63) / 64;
+  for (mp_size_t i = 0; i < n; i++) {
+    mp_limb_t w = i < src_n ? src[i] : 0;
+    /* When src is dst, the top limb of the source may be the first one
+       written to, so mask it after reading. */
+    if (i == n - 1 && len % 64 != 0) w &= ((mp_limb_t) 1 << (len % 64)) - 1;
+    dst[d + i] |= w << shift;
+    if (shift != 0 && d + i + 1 < dst_n) dst[d + i + 1] |= w >> (64 - shift);
+  }
+}
+
+/*
+ * Clear the len bits of dst starting at bit offset.
+ */
+static void limbs_clear_bits(mp_limb_t *dst, const mp_bitcnt_t offset, const mp_bitcnt_t len)
+{
+  if (len == 0) return;
+  mp_size_t first = offset / 64;
+  mp_size_t last = (offset + len - 1) / 64;
+  mp_limb_t lo = ~(mp_limb_t) 0 << (offset % 64);
+  mp_limb_t hi = ~(mp_limb_t) 0 >> (63 - (offset + len - 1) % 64);
+  if (first == last) {
+    dst[first] &= ~(lo & hi);
+    return;
+  }
+  dst[first] &= ~lo;
+  for (mp_size_t i = first + 1; i < last; i++) dst[i] = 0;
+  dst[last] &= ~hi;
+}
+
+/*
+ * Replication doubles the number of copies at each step, so it takes
+ * log2(op2) shifts, and for results that are not stored inline each
+ * step copies the bits made so far a limb at a time.
+ */
+void replicate_bits(sail_bits *rop, const sail_bits op1, const sail_int op2)
+{
+  uint64_t op2_ui = sail_int_get_ui(op2);
+  mp_bitcnt_t len = op1.len * op2_ui;
+  if (is_inline(len)) {
+    uint128_t r = get_small(op1);
+    for (mp_bitcnt_t done = op1.len; done != 0 && done < len; done *= 2) {
+      r |= r << done;
+    }
+    set_small(rop, len, r);
+    return;
+  }
+  mp_size_t n = (len + 63) / 64;
+  mp_limb_t *r = mpz_limbs_write(sail_bits_tmp3, n);
+  memset(r, 0, n * sizeof(mp_limb_t));
+  if (is_inline(op1.len)) {
+    limbs_ior_bits(r, n, 0, op1.small, 2, op1.len);
+  } else {
+    limbs_ior_bits(r, n, 0, mpz_limbs_read(*op1.bits), mpz_size(*op1.bits), op1.len);
+  }
+  for (mp_bitcnt_t done = op1.len; done < len; done *= 2) {
+    limbs_ior_bits(r, n, done, r, n, done < len - done ? done : len - done);
+  }
+  mpz_limbs_finish(sail_bits_tmp3, n);
+  rop->len = len;
+  mpz_swap(*big_bits(rop), sail_bits_tmp3);
+}
+
+uint64_t fast_replicate_bits(const uint64_t shift, const uint64_t v, const int64_t times)
+{
+  if (times <= 1 || shift == 0) return v;
+  uint64_t len = shift * times;
+  uint64_t r = v;
+  for (uint64_t done = shift; done < len; done *= 2) {
+    r |= r << done;
+  }
+  return len >= 64 ? r : r & ((UINT64_C(1) << len) - 1);
+}
+
+// Takes a slice of the (two's complement) binary representation of
+// integer n, starting at bit start, and of length len. With the
+// argument in the following order:
+//
+// get_slice_int(len, n, start)
+//
+// For example:
+//
+// get_slice_int(8, 1680, 4) =
+//
+//                    11           0
+//                    V            V
+// get_slice_int(8, 0b0110_1001_0000, 4) = 0b0110_1001
+//                    <-------^
+//                    (8 bit) 4
+//
+void get_slice_int(sail_bits *rop, const sail_int len_mpz, const sail_int n, const sail_int start_mpz)
+{
+  uint64_t start = sail_int_get_ui(start_mpz);
+  uint64_t len = sail_int_get_ui(len_mpz);
+
+  if (is_inline(len)) {
+#ifndef USE_INT128
+    mpz_fdiv_q_2exp(sail_bits_tmp3, n, start);
+    set_small(rop, len, mpz_get_u128(sail_bits_tmp3));
+#else
+    set_small(rop, len, (uint128_t) (n >> (start >= 127 ? 127 : start)));
+#endif
+    return;
+  }
+
+  /* Floor division shifts in copies of the sign bit, so this is
+     right for negative n too. */
+  mpz_fdiv_q_2exp(sail_bits_tmp3, int_mpz(n, sail_bits_tmp1), start);
+  bits_move_mpz(rop, len, sail_bits_tmp3);
+}
+
+// Set slice uses the same indexing scheme as get_slice_int, but it
+// puts a bitvector slice into an integer rather than returning it.
+void set_slice_int(sail_int *rop,
+		   const sail_int len_mpz,
+		   const sail_int n,
+		   const sail_int start_mpz,
+		   const sail_bits slice)
+{
+  uint64_t start = sail_int_get_ui(start_mpz);
+  mpz_t *slice_bits = bits_mpz(&slice, &sail_bits_tmp1);
+  mpz_ptr r = rop_mpz(rop, sail_bits_tmp2);
+  mpz_srcptr n_int = int_mpz(n, sail_bits_tmp3);
+
+  /* Add (slice - field) * 2**start to n, where field is the slice.len
+     bits of n being replaced. */
+  mpz_fdiv_q_2exp(sail_lib_tmp1, n_int, start);
+  mpz_fdiv_r_2exp(sail_lib_tmp1, sail_lib_tmp1, slice.len);
+  mpz_sub(sail_lib_tmp1, *slice_bits, sail_lib_tmp1);
+  mpz_mul_2exp(sail_lib_tmp1, sail_lib_tmp1, start);
+  mpz_add(r, n_int, sail_lib_tmp1);
+  rop_finish(rop, r);
+}
+
+/*
+ * Replace the len bits of op starting at start with the bits of
+ * slice, for inline op.
+ */
+static inline void update_small(sail_bits *rop, const sail_bits op, const uint64_t start, const uint64_t len, const sail_bits slice)
+{
+  if (start >= 128) {
+    set_small(rop, op.len, get_small(op));
+  } else {
+    uint128_t mask = mask128(len) << start;
+    set_small(rop, op.len, (get_small(op) & ~mask) | ((get_small(slice) << start) & mask));
+  }
+}
+
+/*
+ * The same for op that is not stored inline, a limb at a time.
+ */
+static void update_big(sail_bits *rop, const sail_bits op, const uint64_t start, const uint64_t len, const sail_bits slice)
+{
+  const mp_limb_t *s = slice.small;
+  mp_size_t s_n = 2;
+  if (!is_inline(slice.len)) {
+    /* The slice's limbs are read after rop's are cleared. */
+    if (slice.bits == rop->bits) {
+      mpz_set(sail_bits_tmp1, *slice.bits);
+      s = mpz_limbs_read(sail_bits_tmp1);
+      s_n = mpz_size(sail_bits_tmp1);
+    } else {
+      s = mpz_limbs_read(*slice.bits);
+      s_n = mpz_size(*slice.bits);
+    }
+  }
+
+  mp_size_t n = (op.len + 63) / 64;
+  mpz_t *r = big_bits(rop);
+  mpz_set(*r, *op.bits);
+  mp_size_t r_n = mpz_size(*r);
+  mp_limb_t *rp = mpz_limbs_modify(*r, n);
+  memset(rp + r_n, 0, (n - r_n) * sizeof(mp_limb_t));
+  limbs_clear_bits(rp, start, len);
+  limbs_ior_bits(rp, n, start, s, s_n, len);
+  mpz_limbs_finish(*r, n);
+  rop->len = op.len;
+}
+
+void vector_update_subrange_sail_bits(sail_bits *rop,
+				 const sail_bits op,
+				 const sail_int n_mpz,
+				 const sail_int m_mpz,
+				 const sail_bits slice)
+{
+  uint64_t n = sail_int_get_ui(n_mpz);
+  uint64_t m = sail_int_get_ui(m_mpz);
+
+  if (is_inline(op.len)) {
+    update_small(rop, op, m, n - (m - 1ul), slice);
+  } else {
+    update_big(rop, op, m, n - (m - 1ul), slice);
+  }
+}
+
+void slice(sail_bits *rop, const sail_bits op, const sail_int start_mpz, const sail_int len_mpz)
+{
+  assert(sail_int_get_ui(start_mpz) + sail_int_get_ui(len_mpz) <= op.len);
+  uint64_t start = sail_int_get_ui(start_mpz);
+  uint64_t len = sail_int_get_ui(len_mpz);
+
+  if (is_inline(op.len)) {
+    set_small(rop, len, start >= 128 ? 0 : get_small(op) >> start);
+  } else {
+    mpz_fdiv_q_2exp(sail_bits_tmp3, *op.bits, start);
+    bits_move_mpz(rop, len, sail_bits_tmp3);
+  }
+}
+
+void set_slice(sail_bits *rop,
+	       const sail_int len_mpz,
+	       const sail_int slen_mpz,
+	       const sail_bits op,
+	       const sail_int start_mpz,
+	       const sail_bits slice)
+{
+  uint64_t start = sail_int_get_ui(start_mpz);
+
+  if (is_inline(op.len)) {
+    update_small(rop, op, start, slice.len, slice);
+  } else {
+    update_big(rop, op, start, slice.len, slice);
+  }
+}
+
+void shift_bits_left(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  uint64_t shift_amt = bits_get_ui(op2);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, shift_amt >= 128 ? 0 : get_small(op1) << shift_amt);
+    return;
+  }
+  rop->len = op1.len;
+  mpz_mul_2exp(*big_bits(rop), *op1.bits, shift_amt);
+  normalize_sail_bits(rop);
+}
+
+void shift_bits_right(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  uint64_t shift_amt = bits_get_ui(op2);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, shift_amt >= 128 ? 0 : get_small(op1) >> shift_amt);
+    return;
+  }
+  rop->len = op1.len;
+  mpz_tdiv_q_2exp(*big_bits(rop), *op1.bits, shift_amt);
+}
+
+/* FIXME */
+void shift_bits_right_arith(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+{
+  mp_bitcnt_t shift_amt = bits_get_ui(op2);
+  if (is_inline(op1.len)) {
+    int128_t v = signed_small(get_small(op1), op1.len);
+    set_small(rop, op1.len, (uint128_t) (v >> (shift_amt >= 127 ? 127 : shift_amt)));
+    return;
+  }
+  rop->len = op1.len;
+  mp_bitcnt_t sign_bit = op1.len - 1;
+  mpz_fdiv_q_2exp(*big_bits(rop), *op1.bits, shift_amt);
+  if(mpz_tstbit(*op1.bits, sign_bit) != 0) {
+    /* */
+    for(; shift_amt > 0; shift_amt--) {
+      mpz_setbit(*rop->bits, sign_bit - shift_amt + 1);
+    }
+  }
+}
+
+void shiftl(sail_bits *rop, const sail_bits op1, const sail_int op2)
+{
+  uint64_t shift_amt = sail_int_get_ui(op2);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, shift_amt >= 128 ? 0 : get_small(op1) << shift_amt);
+    return;
+  }
+  rop->len = op1.len;
+  mpz_mul_2exp(*big_bits(rop), *op1.bits, shift_amt);
+  normalize_sail_bits(rop);
+}
+
+void shiftr(sail_bits *rop, const sail_bits op1, const sail_int op2)
+{
+  uint64_t shift_amt = sail_int_get_ui(op2);
+  if (is_inline(op1.len)) {
+    set_small(rop, op1.len, shift_amt >= 128 ? 0 : get_small(op1) >> shift_amt);
+    return;
+  }
+  rop->len = op1.len;
+  mpz_tdiv_q_2exp(*big_bits(rop), *op1.bits, shift_amt);
+}
+
+/*
+ * Set dst[i] to the byte reversal of src[n - 1 - i], reversing all the
+ * bytes of an n limb number, 32 or 16 bytes at a time where we can.
+ */
+static void bswap_limbs(mp_limb_t *dst, const mp_limb_t *src, const mp_size_t n)
+{
+  mp_size_t i = 0;
+#if defined(__AVX2__)
+  /* Reverse the bytes of each 128-bit lane, then swap the lanes. */
+  const __m256i rev256 = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                         0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (src + n - i - 4));
+    x = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, rev256), 0x4e);
+    _mm256_storeu_si256((__m256i *) (dst + i), x);
+  }
+#endif
+#if defined(__SSSE3__)
+  const __m128i rev128 = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (src + n - i - 2));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(x, rev128));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 2 <= n; i += 2) {
+    /* Reverse the bytes of each limb, then swap the limbs. */
+    uint8x16_t x = vrev64q_u8(vld1q_u8((const uint8_t *) (src + n - i - 2)));
+    vst1q_u8((uint8_t *) (dst + i), vextq_u8(x, x, 8));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = __builtin_bswap64(src[n - 1 - i]);
+  }
+}
+
+void reverse_endianness(sail_bits *rop, const sail_bits op)
+{
+  if (is_inline(op.len)) {
+    /* Reverse all 16 bytes, then shift the bytes we care about back down. */
+    uint128_t v = get_small(op);
+    uint128_t r = ((uint128_t) __builtin_bswap64((uint64_t) v) << 64) | __builtin_bswap64((uint64_t) (v >> 64));
+    set_small(rop, op.len, op.len == 0 ? 0 : r >> (128 - op.len));
+    return;
+  }
+  /* Reverse the bytes of the whole limbs holding op, where the limbs
+     above mpz_size are zero, then shift the bytes we care about back
+     down as above. */
+  mp_size_t n = (op.len + 63) / 64;
+  mp_size_t size = mpz_size(*op.bits);
+  mp_limb_t *r = mpz_limbs_write(sail_bits_tmp3, n);
+  memset(r, 0, (n - size) * sizeof(mp_limb_t));
+  bswap_limbs(r + (n - size), mpz_limbs_read(*op.bits), size);
+  unsigned shift = n * 64 - op.len;
+  if (shift != 0) mpn_rshift(r, r, n, shift);
+  mpz_limbs_finish(sail_bits_tmp3, n);
+  rop->len = op.len;
+  mpz_swap(*big_bits(rop), sail_bits_tmp3);
+}
+
+/* ***** Sail Reals ***** */
+
+#ifndef USE_REAL128
+
+void CREATE(real)(real *rop)
+{
+  mpq_init(*rop);
+}
+
+void RECREATE(real)(real *rop)
+{
+  mpq_set_ui(*rop, 0, 1);
+}
+
+void KILL(real)(real *rop)
+{
+  mpq_clear(*rop);
+}
+
+void COPY(real)(real *rop, const real op)
+{
+  mpq_set(*rop, op);
+}
+
+void UNDEFINED(real)(real *rop, unit u)
+{
+  mpq_set_ui(*rop, 0, 1);
+}
+
+void neg_real(real *rop, const real op)
+{
+  mpq_neg(*rop, op);
+}
+
+void mult_real(real *rop, const real op1, const real op2) {
+  mpq_mul(*rop, op1, op2);
+}
+
+void sub_real(real *rop, const real op1, const real op2)
+{
+  mpq_sub(*rop, op1, op2);
+}
+
+void add_real(real *rop, const real op1, const real op2)
+{
+  mpq_add(*rop, op1, op2);
+}
+
+void div_real(real *rop, const real op1, const real op2)
+{
+  mpq_div(*rop, op1, op2);
+}
+
+#define SQRT_PRECISION 30
+
+/*
+ * sqrt_real first checks if op has the form n/1 - in which case, if n
+ * is a perfect square (i.e. it's square root is an integer), then it
+ * will return the exact square root using mpz_sqrt. If that's not the
+ * case we use the Babylonian method to calculate the square root to
+ * SQRT_PRECISION decimal places.
+ */
+void sqrt_real(real *rop, const real op)
+{
+  /* First check if op is a perfect square and use mpz_sqrt if so */
+  if (mpz_cmp_ui(mpq_denref(op), 1) == 0 && mpz_perfect_square_p(mpq_numref(op))) {
+    mpz_sqrt(mpq_numref(*rop), mpq_numref(op));
+    mpz_set_ui(mpq_denref(*rop), 1);
+    return;
+  }
+
+  mpq_t tmp;
+  mpz_t tmp_z;
+  mpq_t p; /* previous estimate, p */
+  mpq_t n; /* next estimate, n */
+  /* convergence is the precision (in decimal places) we want to reach as a fraction 1/(10^precision) */
+  mpq_t convergence;
+
+  mpq_init(tmp);
+  mpz_init(tmp_z);
+  mpq_init(p);
+  mpq_init(n);
+  mpq_init(convergence);
+
+  /* calculate an initial guess using mpz_sqrt */
+  mpz_cdiv_q(tmp_z, mpq_numref(op), mpq_denref(op));
+  mpz_sqrt(tmp_z, tmp_z);
+  mpq_set_z(p, tmp_z);
+
+  /* initialise convergence based on SQRT_PRECISION */
+  mpz_set_ui(tmp_z, 10);
+  mpz_pow_ui(tmp_z, tmp_z, SQRT_PRECISION);
+  mpz_set_ui(mpq_numref(convergence), 1);
+  mpq_set_den(convergence, tmp_z);
+
+  while (true) {
+    // n = (p + op / p) / 2
+    mpq_div(tmp, op, p);
+    mpq_add(tmp, tmp, p);
+    mpq_div_2exp(n, tmp, 1);
+
+    /* calculate the difference between n and p */
+    mpq_sub(tmp, p, n);
+    mpq_abs(tmp, tmp);
+
+    /* if the difference is small enough, return */
+    if (mpq_cmp(tmp, convergence) < 0) {
+      mpq_set(*rop, n);
+      break;
+    }
+
+    mpq_swap(n, p);
+  }
+
+  mpq_clear(tmp);
+  mpz_clear(tmp_z);
+  mpq_clear(p);
+  mpq_clear(n);
+  mpq_clear(convergence);
+}
+
+void abs_real(real *rop, const real op)
+{
+  mpq_abs(*rop, op);
+}
+
+void round_up(sail_int *rop, const real op)
+{
+  mpz_ptr r = rop_mpz(rop, sail_lib_tmp1);
+  mpz_cdiv_q(r, mpq_numref(op), mpq_denref(op));
+  rop_finish(rop, r);
+}
+
+void round_down(sail_int *rop, const real op)
+{
+  mpz_ptr r = rop_mpz(rop, sail_lib_tmp1);
+  mpz_fdiv_q(r, mpq_numref(op), mpq_denref(op));
+  rop_finish(rop, r);
+}
+
+void to_real(real *rop, const sail_int op)
+{
+  mpq_set_z(*rop, int_mpz(op, sail_lib_tmp1));
+  mpq_canonicalize(*rop);
+}
+
+bool EQUAL(real)(const real op1, const real op2)
+{
+  return mpq_cmp(op1, op2) == 0;
+}
+
+bool lt_real(const real op1, const real op2)
+{
+  return mpq_cmp(op1, op2) < 0;
+}
+
+bool gt_real(const real op1, const real op2)
+{
+  return mpq_cmp(op1, op2) > 0;
+}
+
+bool lteq_real(const real op1, const real op2)
+{
+  return mpq_cmp(op1, op2) <= 0;
+}
+
+bool gteq_real(const real op1, const real op2)
+{
+  return mpq_cmp(op1, op2) >= 0;
+}
+
+void real_power(real *rop, const real base, const sail_int exp)
+{
+  int64_t exp_si = CONVERT_OF(mach_int, sail_int)(exp);
+
+  // Copy base first, as rop may be base.
+  real b;
+  mpq_init(b);
+  mpq_set(b, base);
+
+  mpz_set_ui(mpq_numref(*rop), 1);
+  mpz_set_ui(mpq_denref(*rop), 1);
+
+  int64_t pexp = llabs(exp_si);
+  while (pexp != 0) {
+    // invariant: rop * b^pexp == base^abs(exp)
+    if (pexp & 1) { // b^(e+1) = b * b^e
+      mpq_mul(*rop, *rop, b);
+      pexp -= 1;
+    } else { // b^(2e) = (b*b)^e
+      mpq_mul(b, b, b);
+      pexp >>= 1;
+    }
+  }
+  if (exp_si < 0) {
+    mpq_inv(*rop, *rop);
+  }
+  mpq_clear(b);
+}
+
+void CREATE_OF(real, sail_string)(real *rop, const sail_string op)
+{
+  int decimal;
+  int total;
+
+  mpq_init(*rop);
+  gmp_sscanf(op, "%Zd.%n%Zd%n", sail_lib_tmp1, &decimal, sail_lib_tmp2, &total);
+
+  int len = total - decimal;
+  mpz_ui_pow_ui(sail_lib_tmp3, 10, len);
+  mpz_set(mpq_numref(*rop), sail_lib_tmp2);
+  mpz_set(mpq_denref(*rop), sail_lib_tmp3);
+  mpq_canonicalize(*rop);
+  mpz_set(mpq_numref(sail_real_tmp1), sail_lib_tmp1);
+  mpz_set_ui(mpq_denref(sail_real_tmp1), 1);
+  mpq_add(*rop, *rop, sail_real_tmp1);
+}
+
+unit print_real(const sail_string str, const real op)
+{
+  gmp_printf("%s%Qd\n", str, op);
+  return UNIT;
+}
+
+unit prerr_real(const sail_string str, const real op)
+{
+  gmp_fprintf(stderr, "%s%Qd\n", str, op);
+  return UNIT;
+}
+
+void random_real(real *rop, const unit u)
+{
+  if (rand() & 1) {
+    mpz_set_si(mpq_numref(*rop), rand());
+  } else {
+    mpz_set_si(mpq_numref(*rop), -rand());
+  }
+  mpz_set_si(mpq_denref(*rop), rand());
+  mpq_canonicalize(*rop);
+}
+
+#else
+
+/*
+ * With USE_REAL128 a real is inline (den != 0) when its numerator and
+ * denominator both fit in 127 bits, in which case it is kept in lowest
+ * terms with den > 0, as GMP keeps rationals. Otherwise den is zero
+ * and the value is in big, which once allocated is kept until the real
+ * is killed, so that a real moving between the two does not allocate
+ * each time.
+ *
+ * Each operation is first tried inline by a small_ function, which
+ * returns false if an operand is not inline or the result would not
+ * fit, in which case it is done with GMP as without USE_REAL128.
+ * FP pseudocode mostly works on dyadic rationals with 53 or 24 bit
+ * mantissas, which fit unless their exponents are large. Results are
+ * always exact, so are the same as with GMP rationals. CHECK_REAL128
+ * checks this by doing every inline operation again with GMP.
+ */
 
-  mpz_set(*rop->bits, *op.bits);
-  rop->len = op.len;
+#define REAL128_MAX ((int128_t) (~(uint128_t) 0 >> 1))
 
-  for (uint64_t i = 0; i < slice.len; i++) {
-    if (mpz_tstbit(*slice.bits, i)) {
-      mpz_setbit(*rop->bits, i + start);
-    } else {
-      mpz_clrbit(*rop->bits, i + start);
-    }
-  }
+static inline bool is_small_real(const real op)
+{
+  return op.den != 0;
 }
 
-void shift_bits_left(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+static inline int ctz_u128(const uint128_t op)
 {
-  rop->len = op1.len;
-  mpz_mul_2exp(*rop->bits, *op1.bits, mpz_get_ui(*op2.bits));
-  normalize_sail_bits(rop);
+  uint64_t lo = (uint64_t) op;
+  return lo != 0 ? __builtin_ctzll(lo) : 64 + __builtin_ctzll((uint64_t) (op >> 64));
 }
 
-void shift_bits_right(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+/* Binary GCD, as 128-bit division is slow */
+static uint128_t gcd_u128(uint128_t a, uint128_t b)
 {
-  rop->len = op1.len;
-  mpz_tdiv_q_2exp(*rop->bits, *op1.bits, mpz_get_ui(*op2.bits));
+  if (a == 0) return b;
+  if (b == 0) return a;
+  int shift = ctz_u128(a | b);
+  a >>= ctz_u128(a);
+  do {
+    b >>= ctz_u128(b);
+    if (a > b) {
+      uint128_t t = a;
+      a = b;
+      b = t;
+    }
+    b -= a;
+  } while (b != 0);
+  return a << shift;
 }
 
-/* FIXME */
-void shift_bits_right_arith(sail_bits *rop, const sail_bits op1, const sail_bits op2)
+static inline uint128_t abs_s128(const int128_t op)
 {
-  rop->len = op1.len;
-  mp_bitcnt_t shift_amt = mpz_get_ui(*op2.bits);
-  mp_bitcnt_t sign_bit = op1.len - 1;
-  mpz_fdiv_q_2exp(*rop->bits, *op1.bits, shift_amt);
-  if(mpz_tstbit(*op1.bits, sign_bit) != 0) {
-    /* */
-    for(; shift_amt > 0; shift_amt--) {
-      mpz_setbit(*rop->bits, sign_bit - shift_amt + 1);
-    }
-  }
+  return op < 0 ? -(uint128_t) op : (uint128_t) op;
 }
 
-void shiftl(sail_bits *rop, const sail_bits op1, const sail_int op2)
+/*
+ * Set rop to num/den, for den > 0 and num and den in range. Results
+ * with num == INT128_MIN are rejected by the callers, so that
+ * negating an inline numerator never overflows.
+ */
+static void small_real_set(real *rop, int128_t num, int128_t den)
 {
-  rop->len = op1.len;
-  mpz_mul_2exp(*rop->bits, *op1.bits, mpz_get_ui(op2));
-  normalize_sail_bits(rop);
+  uint128_t g = gcd_u128(abs_s128(num), (uint128_t) den);
+  if (g != 1) {
+    num /= (int128_t) g;
+    den /= (int128_t) g;
+  }
+  rop->num = num;
+  rop->den = den;
 }
 
-void shiftr(sail_bits *rop, const sail_bits op1, const sail_int op2)
+static inline bool in_range(const int128_t op)
 {
-  rop->len = op1.len;
-  mpz_tdiv_q_2exp(*rop->bits, *op1.bits, mpz_get_ui(op2));
+  return op >= -REAL128_MAX;
 }
 
-void reverse_endianness(sail_bits *rop, const sail_bits op)
+static void real_set_mpq(real *rop, mpq_srcptr op)
 {
-  rop->len = op.len;
-  if (rop->len == 64ul) {
-    uint64_t x = mpz_get_ui(*op.bits);
-    x = (x & 0xFFFFFFFF00000000) >> 32 | (x & 0x00000000FFFFFFFF) << 32;
-    x = (x & 0xFFFF0000FFFF0000) >> 16 | (x & 0x0000FFFF0000FFFF) << 16;
-    x = (x & 0xFF00FF00FF00FF00) >> 8  | (x & 0x00FF00FF00FF00FF) << 8;
-    mpz_set_ui(*rop->bits, x);
-  } else if (rop->len == 32ul) {
-    uint64_t x = mpz_get_ui(*op.bits);
-    x = (x & 0xFFFF0000FFFF0000) >> 16 | (x & 0x0000FFFF0000FFFF) << 16;
-    x = (x & 0xFF00FF00FF00FF00) >> 8  | (x & 0x00FF00FF00FF00FF) << 8;
-    mpz_set_ui(*rop->bits, x);
-  } else if (rop->len == 16ul) {
-    uint64_t x = mpz_get_ui(*op.bits);
-    x = (x & 0xFF00FF00FF00FF00) >> 8  | (x & 0x00FF00FF00FF00FF) << 8;
-    mpz_set_ui(*rop->bits, x);
-  } else if (rop->len == 8ul) {
-    mpz_set(*rop->bits, *op.bits);
+  if (mpz_sizeinbase(mpq_numref(op), 2) <= 127 && mpz_sizeinbase(mpq_denref(op), 2) <= 127) {
+    rop->num = (int128_t) mpz_get_u128(mpq_numref(op));
+    rop->den = (int128_t) mpz_get_u128(mpq_denref(op));
   } else {
-    /* For other numbers of bytes we reverse the bytes.
-     * XXX could use mpz_import/export for this. */
-    mpz_set_ui(sail_lib_tmp1, 0xff); // byte mask
-    mpz_set_ui(*rop->bits, 0); // reset accumulator for result
-    for(mp_bitcnt_t byte = 0; byte < op.len; byte+=8) {
-      mpz_tdiv_q_2exp(sail_lib_tmp2, *op.bits, byte); // shift byte to bottom
-      mpz_and(sail_lib_tmp2, sail_lib_tmp2, sail_lib_tmp1); // and with mask
-      mpz_mul_2exp(*rop->bits, *rop->bits, 8); // shift result left 8
-      mpz_ior(*rop->bits, *rop->bits, sail_lib_tmp2); // or byte into result
+    if (rop->big == NULL) {
+      rop->big = malloc(sizeof(mpq_t));
+      mpq_init(*rop->big);
     }
+    mpq_set(*rop->big, op);
+    rop->den = 0;
   }
 }
 
-/* ***** Sail Reals ***** */
+/*
+ * A GMP rational holding the value of op: tmp set to it if op is
+ * inline, otherwise op's own.
+ */
+static mpq_srcptr real_mpq(const real op, mpq_t tmp)
+{
+  if (!is_small_real(op)) return *op.big;
+  mpz_set_s128(mpq_numref(tmp), op.num);
+  mpz_set_s128(mpq_denref(tmp), op.den);
+  return tmp;
+}
+
+#ifdef CHECK_REAL128
+
+static void check_real(const char *op, const real result, mpq_srcptr expected)
+{
+  mpq_srcptr r = real_mpq(result, sail_real_tmp2);
+  if (!mpq_equal(r, expected)) {
+    gmp_fprintf(stderr, "[Sail] CHECK_REAL128: %s gave %Qd, but GMP gives %Qd\n", op, r, expected);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Do compute, which sets q, and check that it matches result.
+ */
+#define CHECK_REAL(op, result, compute) \
+  do { mpq_ptr q = sail_real_tmp1; compute; check_real(op, result, q); } while (0)
+
+#else
+
+#define CHECK_REAL(op, result, compute) do {} while (0)
+
+#endif
 
 void CREATE(real)(real *rop)
 {
-  mpq_init(*rop);
+  rop->num = 0;
+  rop->den = 1;
+  rop->big = NULL;
 }
 
 void RECREATE(real)(real *rop)
 {
-  mpq_set_ui(*rop, 0, 1);
+  rop->num = 0;
+  rop->den = 1;
 }
 
 void KILL(real)(real *rop)
 {
-  mpq_clear(*rop);
+  if (rop->big != NULL) {
+    mpq_clear(*rop->big);
+    free(rop->big);
+  }
 }
 
 void COPY(real)(real *rop, const real op)
 {
-  mpq_set(*rop, op);
+  if (is_small_real(op)) {
+    rop->num = op.num;
+    rop->den = op.den;
+  } else {
+    real_set_mpq(rop, *op.big);
+  }
 }
 
 void UNDEFINED(real)(real *rop, unit u)
 {
-  mpq_set_ui(*rop, 0, 1);
+  rop->num = 0;
+  rop->den = 1;
 }
 
 void neg_real(real *rop, const real op)
 {
-  mpq_neg(*rop, op);
+  if (is_small_real(op)) {
+    rop->num = -op.num;
+    rop->den = op.den;
+    return;
+  }
+  mpq_neg(sail_real_tmp1, *op.big);
+  real_set_mpq(rop, sail_real_tmp1);
+}
+
+/* a/b * c/d, with the common factors of a and d, and of c and b, taken out first */
+static bool small_mult_real(real *rop, const real op1, const real op2)
+{
+  if (!is_small_real(op1) || !is_small_real(op2)) return false;
+  int128_t g1 = (int128_t) gcd_u128(abs_s128(op1.num), (uint128_t) op2.den);
+  int128_t g2 = (int128_t) gcd_u128(abs_s128(op2.num), (uint128_t) op1.den);
+  int128_t num, den;
+  if (__builtin_mul_overflow(op1.num / g1, op2.num / g2, &num)
+      || __builtin_mul_overflow(op1.den / g2, op2.den / g1, &den)
+      || !in_range(num)) {
+    return false;
+  }
+  small_real_set(rop, num, den);
+  return true;
 }
 
 void mult_real(real *rop, const real op1, const real op2) {
-  mpq_mul(*rop, op1, op2);
+  if (small_mult_real(rop, op1, op2)) {
+    CHECK_REAL("mult_real", *rop, mpq_mul(q, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3)));
+    return;
+  }
+  mpq_mul(sail_real_tmp1, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3));
+  real_set_mpq(rop, sail_real_tmp1);
+}
+
+/* a/b + c/d (or - c/d), as (a*(d/g) + c*(b/g)) / (b*(d/g)) where g = gcd(b, d) */
+static bool small_add_real(real *rop, const real op1, const real op2, const bool sub)
+{
+  if (!is_small_real(op1) || !is_small_real(op2)) return false;
+  int128_t c = sub ? -op2.num : op2.num;
+  int128_t b = op1.den, d = op2.den;
+  if (b != d) {
+    int128_t g = (int128_t) gcd_u128((uint128_t) b, (uint128_t) d);
+    if (g != 1) {
+      b /= g;
+      d /= g;
+    }
+  } else {
+    b = d = 1;
+  }
+  int128_t x, y, num, den;
+  if (__builtin_mul_overflow(op1.num, d, &x)
+      || __builtin_mul_overflow(c, b, &y)
+      || __builtin_add_overflow(x, y, &num)
+      || __builtin_mul_overflow(op1.den, d, &den)
+      || !in_range(num)) {
+    return false;
+  }
+  small_real_set(rop, num, den);
+  return true;
 }
 
 void sub_real(real *rop, const real op1, const real op2)
 {
-  mpq_sub(*rop, op1, op2);
+  if (small_add_real(rop, op1, op2, true)) {
+    CHECK_REAL("sub_real", *rop, mpq_sub(q, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3)));
+    return;
+  }
+  mpq_sub(sail_real_tmp1, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3));
+  real_set_mpq(rop, sail_real_tmp1);
 }
 
 void add_real(real *rop, const real op1, const real op2)
 {
-  mpq_add(*rop, op1, op2);
+  if (small_add_real(rop, op1, op2, false)) {
+    CHECK_REAL("add_real", *rop, mpq_add(q, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3)));
+    return;
+  }
+  mpq_add(sail_real_tmp1, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3));
+  real_set_mpq(rop, sail_real_tmp1);
+}
+
+/* (a/b) / (c/d) = (a*d) / (b*c), with common factors taken out first as in mult_real */
+static bool small_div_real(real *rop, const real op1, const real op2)
+{
+  if (!is_small_real(op1) || !is_small_real(op2) || op2.num == 0) return false;
+  int128_t g1 = (int128_t) gcd_u128(abs_s128(op1.num), abs_s128(op2.num));
+  int128_t g2 = (int128_t) gcd_u128((uint128_t) op1.den, (uint128_t) op2.den);
+  int128_t c = op2.num / g1;
+  int128_t a = op1.num / g1;
+  if (c < 0) {
+    a = -a;
+    c = -c;
+  }
+  int128_t num, den;
+  if (__builtin_mul_overflow(a, op2.den / g2, &num)
+      || __builtin_mul_overflow(op1.den / g2, c, &den)
+      || !in_range(num)) {
+    return false;
+  }
+  small_real_set(rop, num, den);
+  return true;
 }
 
+/* Division by zero is left to GMP, which reports it. */
 void div_real(real *rop, const real op1, const real op2)
 {
-  mpq_div(*rop, op1, op2);
+  if (small_div_real(rop, op1, op2)) {
+    CHECK_REAL("div_real", *rop, mpq_div(q, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3)));
+    return;
+  }
+  mpq_div(sail_real_tmp1, real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3));
+  real_set_mpq(rop, sail_real_tmp1);
 }
 
 #define SQRT_PRECISION 30
 
 /*
- * sqrt_real first checks if op has the form n/1 - in which case, if n
- * is a perfect square (i.e. it's square root is an integer), then it
- * will return the exact square root using mpz_sqrt. If that's not the
- * case we use the Babylonian method to calculate the square root to
- * SQRT_PRECISION decimal places.
+ * As without USE_REAL128, so the result is the same. Only the
+ * conversions to and from GMP are added.
  */
-void sqrt_real(real *rop, const real op)
+void sqrt_real(real *rop, const real op_real)
 {
+  mpq_srcptr op = real_mpq(op_real, sail_real_tmp3);
+
   /* First check if op is a perfect square and use mpz_sqrt if so */
   if (mpz_cmp_ui(mpq_denref(op), 1) == 0 && mpz_perfect_square_p(mpq_numref(op))) {
-    mpz_sqrt(mpq_numref(*rop), mpq_numref(op));
-    mpz_set_ui(mpq_denref(*rop), 1);
+    mpz_sqrt(mpq_numref(sail_real_tmp1), mpq_numref(op));
+    mpz_set_ui(mpq_denref(sail_real_tmp1), 1);
+    real_set_mpq(rop, sail_real_tmp1);
     return;
   }
 
@@ -1006,7 +2529,7 @@ void sqrt_real(real *rop, const real op)
 
     /* if the difference is small enough, return */
     if (mpq_cmp(tmp, convergence) < 0) {
-      mpq_set(*rop, n);
+      real_set_mpq(rop, n);
       break;
     }
 
@@ -1022,65 +2545,178 @@ void sqrt_real(real *rop, const real op)
 
 void abs_real(real *rop, const real op)
 {
-  mpq_abs(*rop, op);
+  if (is_small_real(op)) {
+    rop->num = op.num < 0 ? -op.num : op.num;
+    rop->den = op.den;
+    return;
+  }
+  mpq_abs(sail_real_tmp1, *op.big);
+  real_set_mpq(rop, sail_real_tmp1);
+}
+
+/*
+ * Set rop to op rounded towards minus infinity if floor, and towards
+ * plus infinity otherwise.
+ */
+static void round_real(sail_int *rop, const real op, const bool floor)
+{
+  mpz_ptr r = rop_mpz(rop, sail_lib_tmp1);
+  if (is_small_real(op)) {
+    int128_t q = op.num / op.den;
+    int128_t m = op.num % op.den;
+    if (m != 0 && (m < 0) == floor) q += floor ? -1 : 1;
+    mpz_set_s128(r, q);
+#ifdef CHECK_REAL128
+    mpq_srcptr expected = real_mpq(op, sail_real_tmp2);
+    (floor ? mpz_fdiv_q : mpz_cdiv_q)(sail_lib_tmp2, mpq_numref(expected), mpq_denref(expected));
+    if (mpz_cmp(r, sail_lib_tmp2) != 0) {
+      gmp_fprintf(stderr, "[Sail] CHECK_REAL128: %s gave %Zd, but GMP gives %Zd\n",
+                  floor ? "round_down" : "round_up", r, sail_lib_tmp2);
+      exit(EXIT_FAILURE);
+    }
+#endif
+  } else if (floor) {
+    mpz_fdiv_q(r, mpq_numref(*op.big), mpq_denref(*op.big));
+  } else {
+    mpz_cdiv_q(r, mpq_numref(*op.big), mpq_denref(*op.big));
+  }
+  rop_finish(rop, r);
 }
 
 void round_up(sail_int *rop, const real op)
 {
-  mpz_cdiv_q(*rop, mpq_numref(op), mpq_denref(op));
+  round_real(rop, op, false);
 }
 
 void round_down(sail_int *rop, const real op)
 {
-  mpz_fdiv_q(*rop, mpq_numref(op), mpq_denref(op));
+  round_real(rop, op, true);
 }
 
 void to_real(real *rop, const sail_int op)
 {
-  mpq_set_z(*rop, op);
-  mpq_canonicalize(*rop);
+  mpz_srcptr z = int_mpz(op, sail_lib_tmp1);
+  if (mpz_sizeinbase(z, 2) <= 127) {
+    rop->num = (int128_t) mpz_get_u128(z);
+    rop->den = 1;
+  } else {
+    mpq_set_z(sail_real_tmp1, z);
+    real_set_mpq(rop, sail_real_tmp1);
+  }
+}
+
+/*
+ * The sign of a/b - c/d, if a*d and c*b do not overflow
+ */
+static bool small_cmp_real(int *result, const real op1, const real op2)
+{
+  if (!is_small_real(op1) || !is_small_real(op2)) return false;
+  int128_t x = op1.num, y = op2.num;
+  if (op1.den != op2.den
+      && (__builtin_mul_overflow(op1.num, op2.den, &x) || __builtin_mul_overflow(op2.num, op1.den, &y))) {
+    return false;
+  }
+  *result = (x > y) - (x < y);
+  return true;
+}
+
+static int cmp_real(const char *op, const real op1, const real op2)
+{
+  int result;
+  if (small_cmp_real(&result, op1, op2)) {
+#ifdef CHECK_REAL128
+    int expected = mpq_cmp(real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3));
+    if (result != (expected > 0) - (expected < 0)) {
+      fprintf(stderr, "[Sail] CHECK_REAL128: %s gave %d, but GMP gives %d\n", op, result, expected);
+      exit(EXIT_FAILURE);
+    }
+#endif
+    return result;
+  }
+  return mpq_cmp(real_mpq(op1, sail_real_tmp2), real_mpq(op2, sail_real_tmp3));
 }
 
 bool EQUAL(real)(const real op1, const real op2)
 {
-  return mpq_cmp(op1, op2) == 0;
+  return cmp_real("eq_real", op1, op2) == 0;
 }
 
 bool lt_real(const real op1, const real op2)
 {
-  return mpq_cmp(op1, op2) < 0;
+  return cmp_real("lt_real", op1, op2) < 0;
 }
 
 bool gt_real(const real op1, const real op2)
 {
-  return mpq_cmp(op1, op2) > 0;
+  return cmp_real("gt_real", op1, op2) > 0;
 }
 
 bool lteq_real(const real op1, const real op2)
 {
-  return mpq_cmp(op1, op2) <= 0;
+  return cmp_real("lteq_real", op1, op2) <= 0;
 }
 
 bool gteq_real(const real op1, const real op2)
 {
-  return mpq_cmp(op1, op2) >= 0;
+  return cmp_real("gteq_real", op1, op2) >= 0;
+}
+
+/*
+ * base^exp by repeated squaring. The powers of a rational in lowest
+ * terms are in lowest terms, so nothing needs reducing.
+ */
+static bool small_real_power(real *rop, const real base, const int64_t exp)
+{
+  if (!is_small_real(base) || (exp < 0 && base.num == 0)) return false;
+  int128_t bn = base.num, bd = base.den, rn = 1, rd = 1;
+  uint64_t pexp = exp < 0 ? -(uint64_t) exp : (uint64_t) exp;
+  while (pexp != 0) {
+    if (pexp & 1) {
+      if (__builtin_mul_overflow(rn, bn, &rn) || __builtin_mul_overflow(rd, bd, &rd)) return false;
+    }
+    pexp >>= 1;
+    if (pexp != 0 && (__builtin_mul_overflow(bn, bn, &bn) || __builtin_mul_overflow(bd, bd, &bd))) return false;
+  }
+  if (!in_range(rn)) return false;
+  if (exp < 0) {
+    int128_t t = rn;
+    rn = rd;
+    rd = t;
+    if (rd < 0) {
+      rn = -rn;
+      rd = -rd;
+    }
+  }
+  rop->num = rn;
+  rop->den = rd;
+  return true;
 }
 
 void real_power(real *rop, const real base, const sail_int exp)
 {
-  int64_t exp_si = mpz_get_si(exp);
+  int64_t exp_si = CONVERT_OF(mach_int, sail_int)(exp);
 
-  mpz_set_ui(mpq_numref(*rop), 1);
-  mpz_set_ui(mpq_denref(*rop), 1);
+  if (small_real_power(rop, base, exp_si)) {
+    CHECK_REAL("real_power", *rop, {
+        mpq_srcptr b = real_mpq(base, sail_real_tmp3);
+        mpz_pow_ui(mpq_numref(q), mpq_numref(b), llabs(exp_si));
+        mpz_pow_ui(mpq_denref(q), mpq_denref(b), llabs(exp_si));
+        if (exp_si < 0) mpq_inv(q, q);
+      });
+    return;
+  }
 
-  real b;
+  mpq_ptr r = sail_real_tmp1;
+  mpq_set_ui(r, 1, 1);
+
+  mpq_t b;
   mpq_init(b);
-  mpq_set(b, base);
+  mpq_set(b, real_mpq(base, sail_real_tmp2));
   int64_t pexp = llabs(exp_si);
   while (pexp != 0) {
-    // invariant: rop * b^pexp == base^abs(exp)
+    // invariant: r * b^pexp == base^abs(exp)
     if (pexp & 1) { // b^(e+1) = b * b^e
-      mpq_mul(*rop, *rop, b);
+      mpq_mul(r, r, b);
       pexp -= 1;
     } else { // b^(2e) = (b*b)^e
       mpq_mul(b, b, b);
@@ -1088,124 +2724,309 @@ void real_power(real *rop, const real base, const sail_int exp)
     }
   }
   if (exp_si < 0) {
-    mpq_inv(*rop, *rop);
+    mpq_inv(r, r);
   }
   mpq_clear(b);
+  real_set_mpq(rop, r);
+}
+
+/*
+ * Parse a real literal I.F, as I + F/10^len(F) (so as without
+ * USE_REAL128, the sign is only applied to I). Short literals, which
+ * are all of them in practice, are converted inline.
+ */
+static bool small_real_of_string(real *rop, const char *op)
+{
+  const char *p = op;
+  bool negative = *p == '-';
+  if (negative) p++;
+  int128_t integer = 0, fraction = 0, scale = 1;
+  /* At most 36 digits fit, as 10^36 < 2^127, so stop at the 37th. */
+  int digits = 0;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    if (++digits > 36) return false;
+    integer = integer * 10 + (*p - '0');
+  }
+  if (digits == 0 || *p != '.') return false;
+  p++;
+  for (; *p >= '0' && *p <= '9'; p++) {
+    if (++digits > 36) return false;
+    fraction = fraction * 10 + (*p - '0');
+    scale *= 10;
+  }
+  if (*p != '\0' || scale == 1) return false;
+  small_real_set(rop, (negative ? -integer : integer) * scale + fraction, scale);
+  return true;
 }
 
 void CREATE_OF(real, sail_string)(real *rop, const sail_string op)
 {
+  CREATE(real)(rop);
+  if (small_real_of_string(rop, op)) {
+    CHECK_REAL("real literal", *rop, {
+        int decimal;
+        int total;
+        gmp_sscanf(op, "%Zd.%n%Zd%n", sail_lib_tmp1, &decimal, sail_lib_tmp2, &total);
+        mpz_ui_pow_ui(sail_lib_tmp3, 10, total - decimal);
+        mpq_set_num(q, sail_lib_tmp2);
+        mpq_set_den(q, sail_lib_tmp3);
+        mpq_canonicalize(q);
+        mpq_set_z(sail_real_tmp3, sail_lib_tmp1);
+        mpq_add(q, q, sail_real_tmp3);
+      });
+    return;
+  }
+
   int decimal;
   int total;
 
-  mpq_init(*rop);
   gmp_sscanf(op, "%Zd.%n%Zd%n", sail_lib_tmp1, &decimal, sail_lib_tmp2, &total);
 
   int len = total - decimal;
   mpz_ui_pow_ui(sail_lib_tmp3, 10, len);
-  mpz_set(mpq_numref(*rop), sail_lib_tmp2);
-  mpz_set(mpq_denref(*rop), sail_lib_tmp3);
-  mpq_canonicalize(*rop);
-  mpz_set(mpq_numref(sail_lib_tmp_real), sail_lib_tmp1);
-  mpz_set_ui(mpq_denref(sail_lib_tmp_real), 1);
-  mpq_add(*rop, *rop, sail_lib_tmp_real);
+  mpz_set(mpq_numref(sail_real_tmp1), sail_lib_tmp2);
+  mpz_set(mpq_denref(sail_real_tmp1), sail_lib_tmp3);
+  mpq_canonicalize(sail_real_tmp1);
+  mpq_set_z(sail_real_tmp2, sail_lib_tmp1);
+  mpq_add(sail_real_tmp1, sail_real_tmp1, sail_real_tmp2);
+  real_set_mpq(rop, sail_real_tmp1);
 }
 
 unit print_real(const sail_string str, const real op)
 {
-  gmp_printf("%s%Qd\n", str, op);
+  gmp_printf("%s%Qd\n", str, real_mpq(op, sail_real_tmp1));
   return UNIT;
 }
 
 unit prerr_real(const sail_string str, const real op)
 {
-  gmp_fprintf(stderr, "%s%Qd\n", str, op);
+  gmp_fprintf(stderr, "%s%Qd\n", str, real_mpq(op, sail_real_tmp1));
   return UNIT;
 }
 
 void random_real(real *rop, const unit u)
 {
   if (rand() & 1) {
-    mpz_set_si(mpq_numref(*rop), rand());
+    mpz_set_si(mpq_numref(sail_real_tmp1), rand());
   } else {
-    mpz_set_si(mpq_numref(*rop), -rand());
+    mpz_set_si(mpq_numref(sail_real_tmp1), -rand());
   }
-  mpz_set_si(mpq_denref(*rop), rand());
-  mpq_canonicalize(*rop);
+  mpz_set_si(mpq_denref(sail_real_tmp1), rand());
+  mpq_canonicalize(sail_real_tmp1);
+  real_set_mpq(rop, sail_real_tmp1);
+}
+
+#endif
+
+/* ***** Checkpoints ***** */
+
+void save_bytes(FILE *f, const void *data, size_t len)
+{
+  if (fwrite(data, 1, len, f) != len) {
+    fprintf(stderr, "[Sail] Failed to write checkpoint\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void restore_bytes(FILE *f, void *data, size_t len)
+{
+  if (fread(data, 1, len, f) != len) {
+    fprintf(stderr, "[Sail] Checkpoint is truncated\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * GMP integers are stored as their signed limb count followed by the
+ * limbs, least significant first.
+ */
+static void save_mpz(FILE *f, mpz_srcptr op)
+{
+  int64_t size = mpz_sgn(op) * (int64_t) mpz_size(op);
+  save_bytes(f, &size, sizeof(size));
+  save_bytes(f, mpz_limbs_read(op), mpz_size(op) * sizeof(mp_limb_t));
+}
+
+static void restore_mpz(FILE *f, mpz_ptr rop)
+{
+  int64_t size;
+  restore_bytes(f, &size, sizeof(size));
+  mp_size_t n = size < 0 ? -size : size;
+  if (n == 0) {
+    mpz_set_ui(rop, 0);
+    return;
+  }
+  restore_bytes(f, mpz_limbs_write(rop, n), n * sizeof(mp_limb_t));
+  mpz_limbs_finish(rop, size);
+}
+
+void SAVE(sail_int)(FILE *f, const sail_int op)
+{
+  save_mpz(f, int_mpz(op, sail_lib_tmp1));
+}
+
+void RESTORE(sail_int)(FILE *f, sail_int *rop)
+{
+  mpz_ptr r = rop_mpz(rop, sail_lib_tmp1);
+  restore_mpz(f, r);
+  rop_finish(rop, r);
+}
+
+void SAVE(sail_bits)(FILE *f, const sail_bits op)
+{
+  uint64_t len = op.len;
+  save_bytes(f, &len, sizeof(len));
+  if (is_inline(op.len)) {
+    save_bytes(f, op.small, sizeof(op.small));
+  } else {
+    save_mpz(f, *op.bits);
+  }
+}
+
+void RESTORE(sail_bits)(FILE *f, sail_bits *rop)
+{
+  uint64_t len;
+  restore_bytes(f, &len, sizeof(len));
+  rop->len = len;
+  if (is_inline(rop->len)) {
+    restore_bytes(f, rop->small, sizeof(rop->small));
+  } else {
+    restore_mpz(f, *big_bits(rop));
+  }
+}
+
+void SAVE(sail_string)(FILE *f, const sail_string op)
+{
+  uint64_t len = strlen(op);
+  save_bytes(f, &len, sizeof(len));
+  save_bytes(f, op, len);
+}
+
+void RESTORE(sail_string)(FILE *f, sail_string *rop)
+{
+  uint64_t len;
+  restore_bytes(f, &len, sizeof(len));
+  string_reserve(rop, len);
+  restore_bytes(f, *rop, len);
+  string_set_len(*rop, len);
+}
+
+/* With USE_REAL128, reals are saved as GMP rationals as well. */
+#ifndef USE_REAL128
+
+void SAVE(real)(FILE *f, const real op)
+{
+  save_mpz(f, mpq_numref(op));
+  save_mpz(f, mpq_denref(op));
+}
+
+void RESTORE(real)(FILE *f, real *rop)
+{
+  restore_mpz(f, mpq_numref(*rop));
+  restore_mpz(f, mpq_denref(*rop));
+}
+
+#else
+
+void SAVE(real)(FILE *f, const real op)
+{
+  mpq_srcptr q = real_mpq(op, sail_real_tmp1);
+  save_mpz(f, mpq_numref(q));
+  save_mpz(f, mpq_denref(q));
+}
+
+void RESTORE(real)(FILE *f, real *rop)
+{
+  restore_mpz(f, mpq_numref(sail_real_tmp1));
+  restore_mpz(f, mpq_denref(sail_real_tmp1));
+  real_set_mpq(rop, sail_real_tmp1);
 }
 
+#endif
+
 /* ***** Printing functions ***** */
 
 void string_of_int(sail_string *str, const sail_int i)
 {
-  gmp_asprintf(str, "%Zd", i);
+  string_printf(str, "%Zd", int_mpz(i, sail_lib_tmp1));
 }
 
-/* asprinf is a GNU extension, but it should exist on BSD */
 void string_of_mach_bits(sail_string *str, const mach_bits op)
 {
-  int bytes = asprintf(str, "0x%" PRIx64, op);
-  if (bytes == -1) {
-    fprintf(stderr, "Could not print bits 0x%" PRIx64 "\n", op);
-  }
+  string_printf(str, "0x%" PRIx64, op);
 }
 
 void string_of_sail_bits(sail_string *str, const sail_bits op)
 {
+  mpz_t *bits = bits_mpz(&op, &sail_bits_tmp1);
   if ((op.len % 4) == 0) {
-    gmp_asprintf(str, "0x%*0Zx", op.len / 4, *op.bits);
+    string_printf(str, "0x%*0Zx", op.len / 4, *bits);
   } else {
-    gmp_asprintf(str, "0b%*0Zb", op.len, *op.bits);
+    string_reserve(str, op.len + 2);
+    string_set_len(*str, format_bits(*str, op));
   }
 }
 
 void decimal_string_of_mach_bits(sail_string *str, const mach_bits op)
 {
-  int bytes = asprintf(str, "%" PRId64, op);
-  if (bytes == -1) {
-    fprintf(stderr, "Could not print bits %" PRId64 "\n", op);
-  }
+  string_printf(str, "%" PRId64, op);
 }
 
 void decimal_string_of_sail_bits(sail_string *str, const sail_bits op)
 {
-  gmp_asprintf(str, "%Z", *op.bits);
+  string_printf(str, "%Zd", *bits_mpz(&op, &sail_bits_tmp1));
 }
 
-void fprint_bits(const sail_string pre,
-		 const sail_bits op,
-		 const sail_string post,
-		 FILE *stream)
+size_t format_bits(char *buf, const sail_bits op)
 {
-  fputs(pre, stream);
+  static const char digits[] = "0123456789ABCDEF";
+  const uint64_t *limbs;
+  mp_bitcnt_t size;
+  if (is_inline(op.len)) {
+    limbs = op.small;
+    size = 2;
+  } else {
+    limbs = (const uint64_t *) mpz_limbs_read(*op.bits);
+    size = mpz_size(*op.bits);
+  }
 
+  char *p = buf;
+  *p++ = '0';
   if (op.len % 4 == 0) {
-    fputs("0x", stream);
-    mpz_t buf;
-    mpz_init_set(buf, *op.bits);
-
-    char *hex = malloc((op.len / 4) * sizeof(char));
-
-    for (int i = 0; i < op.len / 4; ++i) {
-      char c = (char) ((0xF & mpz_get_ui(buf)) + 0x30);
-      hex[i] = (c < 0x3A) ? c : c + 0x7;
-      mpz_fdiv_q_2exp(buf, buf, 4);
-    }
-
-    for (int i = op.len / 4; i > 0; --i) {
-      fputc(hex[i - 1], stream);
+    *p++ = 'x';
+    for (mp_bitcnt_t i = op.len; i > 0; i -= 4) {
+      mp_bitcnt_t bit = i - 4;
+      uint64_t limb = bit / 64 < size ? limbs[bit / 64] : 0;
+      *p++ = digits[(limb >> (bit % 64)) & 0xF];
     }
-
-    free(hex);
-    mpz_clear(buf);
   } else {
-    fputs("0b", stream);
-    for (int i = op.len; i > 0; --i) {
-      fputc(mpz_tstbit(*op.bits, i - 1) + 0x30, stream);
+    *p++ = 'b';
+    for (mp_bitcnt_t i = op.len; i > 0; --i) {
+      mp_bitcnt_t bit = i - 1;
+      uint64_t limb = bit / 64 < size ? limbs[bit / 64] : 0;
+      *p++ = '0' + ((limb >> (bit % 64)) & 1);
     }
   }
+  return p - buf;
+}
+
+void fprint_bits(const sail_string pre,
+		 const sail_bits op,
+		 const sail_string post,
+		 FILE *stream)
+{
+  size_t pre_len = strlen(pre);
+  size_t post_len = strlen(post);
+  size_t size = pre_len + op.len + 2 + post_len;
+  if (size > sail_print_buf_size) {
+    sail_print_buf_size = size > 2 * sail_print_buf_size ? size : 2 * sail_print_buf_size;
+    sail_print_buf = realloc(sail_print_buf, sail_print_buf_size);
+  }
 
-  fputs(post, stream);
+  memcpy(sail_print_buf, pre, pre_len);
+  size_t len = pre_len + format_bits(sail_print_buf + pre_len, op);
+  memcpy(sail_print_buf + len, post, post_len);
+  fwrite(sail_print_buf, 1, len + post_len, stream);
 }
 
 unit print_bits(const sail_string str, const sail_bits op)
@@ -1247,7 +3068,7 @@ unit prerr_endline(const sail_string str)
 unit print_int(const sail_string str, const sail_int op)
 {
   fputs(str, stdout);
-  mpz_out_str(stdout, 10, op);
+  mpz_out_str(stdout, 10, int_mpz(op, sail_lib_tmp1));
   putchar('\n');
   return UNIT;
 }
@@ -1255,14 +3076,14 @@ unit print_int(const sail_string str, const sail_int op)
 unit prerr_int(const sail_string str, const sail_int op)
 {
   fputs(str, stderr);
-  mpz_out_str(stderr, 10, op);
+  mpz_out_str(stderr, 10, int_mpz(op, sail_lib_tmp1));
   fputs("\n", stderr);
   return UNIT;
 }
 
 unit sail_putchar(const sail_int op)
 {
-  char c = (char) mpz_get_ui(op);
+  char c = (char) sail_int_get_ui(op);
   putchar(c);
   fflush(stdout);
   return UNIT;
@@ -1272,7 +3093,9 @@ void get_time_ns(sail_int *rop, const unit u)
 {
   struct timespec t;
   clock_gettime(CLOCK_REALTIME, &t);
-  mpz_set_si(*rop, t.tv_sec);
-  mpz_mul_ui(*rop, *rop, 1000000000);
-  mpz_add_ui(*rop, *rop, t.tv_nsec);
+  mpz_ptr r = rop_mpz(rop, sail_lib_tmp1);
+  mpz_set_si(r, t.tv_sec);
+  mpz_mul_ui(r, r, 1000000000);
+  mpz_add_ui(r, r, t.tv_nsec);
+  rop_finish(rop, r);
 }
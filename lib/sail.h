@@ -5,9 +5,7 @@
 #include<stdio.h>
 #include<stdbool.h>
 
-#ifndef USE_INT128
 #include<gmp.h>
-#endif
 
 #include<time.h>
 
@@ -17,6 +15,24 @@
 void setup_library(void);
 void cleanup_library(void);
 
+/*
+ * Initialise and clear the library state that is private to each
+ * thread. setup_library and cleanup_library do this for the thread
+ * that calls them, any other thread running a model compiled with
+ * -c_thread_local has to do it for itself.
+ */
+void setup_library_thread(void);
+void cleanup_library_thread(void);
+
+/*
+ * Route GMP allocations through a chunked arena (see sail.c). Called
+ * by models compiled with -c_arena once their registers and letbindings
+ * are initialised. Disabling only stops new allocations coming from the
+ * arena; existing ones remain valid.
+ */
+void sail_arena_enable(void);
+void sail_arena_disable(void);
+
 /*
  * The Sail compiler expects functions to follow a specific naming
  * convention for allocation, deallocation, and (deep)-copying. These
@@ -62,15 +78,16 @@ bool UNDEFINED(bool)(const unit);
 /* ***** Sail strings ***** */
 
 /*
- * Sail strings are just C strings.
+ * Sail strings are C strings, so string literals can be passed to
+ * functions taking a sail_string. Strings written by the library must
+ * come from CREATE(sail_string) however, as they carry a hidden length
+ * and capacity (see sail.c), and so must only be freed by
+ * KILL(sail_string).
  */
 typedef char *sail_string;
 
 SAIL_BUILTIN_TYPE(sail_string);
 
-void dec_str(sail_string *str, const mpz_t n);
-void hex_str(sail_string *str, const mpz_t n);
-
 void undefined_string(sail_string *str, const unit u);
 
 bool eq_string(const sail_string, const sail_string);
@@ -86,15 +103,32 @@ typedef int64_t mach_int;
 bool EQUAL(mach_int)(const mach_int, const mach_int);
 
 /*
- * Integers can be either stack-allocated as 128-bit integers if
- * __int128 is available, or use GMP arbitrary precision
- * integers. This affects the function signatures, so use a macro to
- * paper over the differences.
+ * Integers are either GMP arbitrary precision integers, or if
+ * compiled with USE_INT128, stack-allocated 128-bit integers. Either
+ * way the functions below take a pointer to the result, as the C
+ * backend generates the same calls for both. With USE_INT128 an
+ * operation whose result does not fit in 128 bits exits the model
+ * with an error rather than wrapping around.
+ *
+ * sail_int_get_ui and sail_int_set_ui convert to and from uint64_t,
+ * for lengths and indices.
  */
 #ifndef USE_INT128
 
 typedef mpz_t sail_int;
 
+#define sail_int_get_ui(op) mpz_get_ui(op)
+#define sail_int_set_ui(rop, op) mpz_set_ui(*(rop), op)
+
+#else
+
+typedef __int128 sail_int;
+
+#define sail_int_get_ui(op) ((uint64_t) (op))
+#define sail_int_set_ui(rop, op) (*(rop) = (sail_int) (uint64_t) (op))
+
+#endif
+
 #define SAIL_INT_FUNCTION(fname, rtype, ...) void fname(rtype*, __VA_ARGS__)
 
 SAIL_BUILTIN_TYPE(sail_int);
@@ -105,17 +139,20 @@ void RECREATE_OF(sail_int, mach_int)(sail_int *, const mach_int);
 mach_int CREATE_OF(mach_int, sail_int)(const sail_int);
 
 void CREATE_OF(sail_int, sail_string)(sail_int *, const sail_string);
-void RECREATE_OF(sail_int, sail_string)(mpz_t *, const sail_string);
+void RECREATE_OF(sail_int, sail_string)(sail_int *, const sail_string);
 
 mach_int CONVERT_OF(mach_int, sail_int)(const sail_int);
 void CONVERT_OF(sail_int, mach_int)(sail_int *, const mach_int);
 
-#else
-
-typedef __int128 sail_int;
-#define SAIL_INT_FUNCTION(fname, rtype, ...) rtype fname(__VA_ARGS__)
+/*
+ * For C code that needs a GMP integer whichever representation is in
+ * use. sail_int_set_mpz exits if op does not fit.
+ */
+void mpz_set_sail_int(mpz_t rop, const sail_int op);
+void sail_int_set_mpz(sail_int *rop, const mpz_t op);
 
-#endif
+void dec_str(sail_string *str, const sail_int n);
+void hex_str(sail_string *str, const sail_int n);
 
 /*
  * Comparison operators for integers
@@ -176,13 +213,31 @@ bool eq_bit(const mach_bits a, const mach_bits b);
 
 bool EQUAL(mach_bits)(const mach_bits, const mach_bits);
 
+/*
+ * Bitvectors of up to SAIL_BITS_INLINE bits are stored inline in
+ * small, least significant word first, so they never allocate or call
+ * into GMP. Larger bitvectors are stored in bits, which is allocated
+ * on demand. Which one holds the value is determined by len alone,
+ * and in both cases any bits above len are zero.
+ */
+#define SAIL_BITS_INLINE 128
+
 typedef struct {
   mp_bitcnt_t len;
+  uint64_t small[2];
   mpz_t *bits;
 } sail_bits;
 
 SAIL_BUILTIN_TYPE(sail_bits);
 
+/*
+ * Set rop to the lowest len bits of op, and set a GMP integer to the
+ * unsigned value of a bitvector. Used by the RTS, not callable from
+ * Sail.
+ */
+void sail_bits_of_mpz(sail_bits *rop, const mp_bitcnt_t len, const mpz_t op);
+void mpz_of_sail_bits(mpz_t rop, const sail_bits op);
+
 void CREATE_OF(sail_bits, mach_bits)(sail_bits *,
 				     const mach_bits op,
 				     const mach_bits len,
@@ -215,8 +270,8 @@ void append_64(sail_bits *rop, const sail_bits op, const mach_bits chunk);
 void add_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2);
 void sub_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2);
 
-void add_bits_int(sail_bits *rop, const sail_bits op1, const mpz_t op2);
-void sub_bits_int(sail_bits *rop, const sail_bits op1, const mpz_t op2);
+void add_bits_int(sail_bits *rop, const sail_bits op1, const sail_int op2);
+void sub_bits_int(sail_bits *rop, const sail_bits op1, const sail_int op2);
 
 void and_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2);
 void or_bits(sail_bits *rop, const sail_bits op1, const sail_bits op2);
@@ -289,8 +344,29 @@ void reverse_endianness(sail_bits*, sail_bits);
 
 /* ***** Sail reals ***** */
 
+/*
+ * Reals are GMP rationals, or if compiled with USE_REAL128, rationals
+ * whose numerator and denominator fit in 128 bits are stored inline in
+ * num and den, so that the small values FP pseudocode works with do
+ * not allocate or call into GMP. Other values are stored in big,
+ * allocated on demand, and den is zero. Either way results are exact,
+ * and the same. Compiling with CHECK_REAL128 as well repeats every
+ * operation done inline with GMP, and exits the model if they differ.
+ */
+#ifndef USE_REAL128
+
 typedef mpq_t real;
 
+#else
+
+typedef struct {
+  __int128 num;
+  __int128 den;
+  mpq_t *big;
+} real;
+
+#endif
+
 SAIL_BUILTIN_TYPE(real);
 
 void CREATE_OF(real, sail_string)(real *rop, const sail_string op);
@@ -341,7 +417,17 @@ void decimal_string_of_sail_bits(sail_string *str, const sail_bits op);
 void decimal_string_of_mach_bits(sail_string *str, const mach_bits op);
 
 /*
- * Utility function not callable from Sail!
+ * Write op to buf as fprint_bits prints it, 0x and its digits in upper
+ * case hex if its length is a multiple of 4, else 0b and its bits.
+ * buf must have room for op.len + 2 characters, and is not
+ * terminated. Returns the number of characters written.
+ */
+size_t format_bits(char *buf, const sail_bits op);
+
+/*
+ * Utility function not callable from Sail! Writes its output to
+ * stream with a single fwrite, so lines from different threads do not
+ * interleave.
  */
 void fprint_bits(const sail_string pre,
 		 const sail_bits op,
@@ -362,6 +448,29 @@ unit prerr_int(const sail_string str, const sail_int op);
 
 unit sail_putchar(const sail_int op);
 
+/* ***** Checkpoints ***** */
+
+/*
+ * Used by the RTS and the register save and restore functions that the
+ * C backend generates to write checkpoints (see rts.h). SAVE(type)
+ * writes a value to the stream and RESTORE(type) reads one back into
+ * an existing value. Both exit on I/O errors or a truncated stream.
+ */
+#define SAVE(type) save_ ## type
+#define RESTORE(type) restore_ ## type
+
+void save_bytes(FILE *f, const void *data, size_t len);
+void restore_bytes(FILE *f, void *data, size_t len);
+
+void SAVE(sail_int)(FILE *f, const sail_int op);
+void RESTORE(sail_int)(FILE *f, sail_int *rop);
+void SAVE(sail_bits)(FILE *f, const sail_bits op);
+void RESTORE(sail_bits)(FILE *f, sail_bits *rop);
+void SAVE(sail_string)(FILE *f, const sail_string op);
+void RESTORE(sail_string)(FILE *f, sail_string *rop);
+void SAVE(real)(FILE *f, const real op);
+void RESTORE(real)(FILE *f, real *rop);
+
 /* ***** Misc ***** */
 
 void get_time_ns(sail_int*, const unit);
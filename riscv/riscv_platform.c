@@ -2,11 +2,43 @@
 #include "rts.h"
 #include "riscv_prelude.h"
 #include "riscv_platform_impl.h"
+#include "riscv_platform.h"
 
-/* This file contains the definitions of the C externs of Sail model. */
+/* This file contains the definitions of the C externs of Sail model.
+ *
+ * The model is compiled with -c_thread_local, so that each hart can
+ * run on its own thread (see riscv_sim.c), and the per-hart state
+ * kept here is thread local as well.
+ */
 
-static mach_bits reservation = 0;
-static bool reservation_valid = false;
+static _Thread_local mach_bits this_hart = 0;
+
+static _Thread_local mach_bits reservation = 0;
+static _Thread_local bool reservation_valid = false;
+/* The version of the memory lock for the reserved address at the time
+   of the LR, see lock_mem in rts.h. */
+static _Thread_local uint64_t reservation_version = 0;
+
+/* The software interrupt bit of every hart, see riscv_platform.sail. */
+static bool hart_msip[RV_MAX_HARTS];
+
+void plat_set_hart(mach_bits hart)
+{ this_hart = hart; }
+
+mach_bits plat_hart_id(unit u)
+{ return this_hart; }
+
+mach_bits plat_harts(unit u)
+{ return rv_harts; }
+
+bool plat_msip_read(mach_bits hart)
+{ return hart < rv_harts && __atomic_load_n(&hart_msip[hart], __ATOMIC_ACQUIRE); }
+
+unit plat_msip_write(mach_bits hart, bool v)
+{
+  if (hart < rv_harts) __atomic_store_n(&hart_msip[hart], v, __ATOMIC_RELEASE);
+  return UNIT;
+}
 
 bool plat_enable_dirty_update(unit u)
 { return rv_enable_dirty_update; }
@@ -39,6 +71,7 @@ unit load_reservation(mach_bits addr)
 {
   reservation = addr;
   reservation_valid = true;
+  reservation_version = locked_mem_version();
   return UNIT;
 }
 
@@ -51,6 +84,12 @@ unit cancel_reservation(unit u)
   return UNIT;
 }
 
+/* Called by SC with the lock for the address held. With a single hart
+   nothing can have written to it behind our back, and the version is
+   always 0. */
+bool check_reservation(unit u)
+{ return reservation_version == locked_mem_version(); }
+
 unit plat_term_write(mach_bits s)
 { char c = s & 0xff;
   plat_term_write_impl(c);
@@ -69,3 +108,178 @@ unit memea(mach_bits len, sail_int n)
 {
   return UNIT;
 }
+
+/* Decode cache.
+ *
+ * The Sail model keeps the decoded ast and the encoding of recently
+ * executed instructions in the decode_cache_ast and decode_cache_bits
+ * registers, indexed by bits 12..1 of the PC (see riscv_step.sail).
+ * The tags for those slots are kept here: an entry is valid for the PC
+ * it was fetched from, under the privilege level and satp that were
+ * current at the time, until the generation is bumped.
+ *
+ * Each hart has its own cache and generation, which is bumped by
+ * decode_cache_flush, called by the model for fence.i, sfence.vma and
+ * writes to misa. An entry also records the physical page it was
+ * fetched from, and the generation of that page (see watch_mem_page in
+ * rts.h), so a write to the page, by any hart, makes just the entries
+ * for that page stale.
+ */
+
+#define DECODE_CACHE_BITS 12
+#define DECODE_CACHE_SIZE (1 << DECODE_CACHE_BITS)
+
+extern _Thread_local uint32_t zcur_privilege;
+extern _Thread_local mach_bits zsatp;
+
+struct decode_cache_entry {
+  mach_bits pc;
+  mach_bits satp;
+  mach_bits paddr;
+  uint64_t generation;
+  uint64_t page_generation;
+  uint32_t privilege;
+};
+
+static _Thread_local struct decode_cache_entry decode_cache[DECODE_CACHE_SIZE];
+static _Thread_local uint64_t decode_cache_generation = 1;
+
+/* Set by fetch for the instruction that is about to be decoded, with
+   the generation of its page from before its bytes were read. */
+static _Thread_local mach_bits fetch_pc = 1;
+static _Thread_local mach_bits fetch_paddr = 0;
+static _Thread_local uint64_t fetch_page_generation = 0;
+
+static inline struct decode_cache_entry *decode_cache_entry(mach_bits pc)
+{ return &decode_cache[(pc >> 1) & (DECODE_CACHE_SIZE - 1)]; }
+
+bool decode_cache_hit(mach_bits pc)
+{
+  struct decode_cache_entry *e = decode_cache_entry(pc);
+  bool hit = e->generation == decode_cache_generation
+    && e->pc == pc
+    && e->privilege == zcur_privilege
+    && e->satp == zsatp
+    && e->page_generation == mem_page_generation(e->paddr);
+  sail_stat_add(hit ? STAT_DECODE_HITS : STAT_DECODE_MISSES, 1);
+  return hit;
+}
+
+static bool in_region(mach_bits addr, uint64_t len, uint64_t base, uint64_t size)
+{ return base <= addr && addr + len <= base + size; }
+
+/* Only instructions within a single page of RAM or ROM are cached, so
+   that watching that page is enough to catch changes to them. */
+static bool decode_cacheable(mach_bits paddr, uint64_t len)
+{
+  if ((paddr & 0xfff) + len > 0x1000) return false;
+  return in_region(paddr, len, rv_ram_base, rv_ram_size)
+    || in_region(paddr, len, rv_rom_base, rv_rom_size);
+}
+
+/* Called by fetch before it reads the instruction, so that a write by
+   another hart after the read sees the page marked and bumps its
+   generation, and a write before it is read back. */
+unit decode_cache_fetch(mach_bits pc, mach_bits paddr)
+{
+  fetch_pc = pc;
+  fetch_paddr = paddr;
+  if (rv_enable_decode_cache && decode_cacheable(paddr, 2)) {
+    fetch_page_generation = watch_mem_page(paddr);
+  }
+  return UNIT;
+}
+
+bool decode_cache_add(mach_bits pc, bool rvc)
+{
+  if (!rv_enable_decode_cache || pc != fetch_pc) return false;
+  if (!decode_cacheable(fetch_paddr, rvc ? 2 : 4)) return false;
+
+  struct decode_cache_entry *e = decode_cache_entry(pc);
+  e->pc = pc;
+  e->satp = zsatp;
+  e->generation = decode_cache_generation;
+  e->paddr = fetch_paddr;
+  e->page_generation = fetch_page_generation;
+  e->privilege = zcur_privilege;
+  return true;
+}
+
+unit decode_cache_flush(unit u)
+{
+  decode_cache_generation++;
+  return UNIT;
+}
+
+/* Lets run_block in riscv_step.sail chain instructions from the cache
+   without going back through step. Turning this off makes every block
+   a single step. */
+bool decode_cache_block_next(mach_bits pc)
+{ return rv_enable_blocks && decode_cache_hit(pc); }
+
+/* Translation cache.
+ *
+ * translate39 in riscv_vmem.sail looks up each Sv39 access here before
+ * walking the page table. An entry maps one virtual page to a physical
+ * page, for the accesses (a mask of 1 read, 2 write and 4 execute)
+ * that the leaf PTE allows without setting its accessed or dirty bits,
+ * as checked under the privilege, MXR and SUM it was added with.
+ * Accesses under a different privilege, MXR or SUM miss, which is the
+ * same as flushing on every change but keeps the entries for the other
+ * privilege across traps.
+ *
+ * Each hart has its own direct mapped table, flushed by bumping its
+ * generation on sfence.vma and writes to satp.
+ */
+
+#define TLB_BITS 10
+#define TLB_SIZE (1 << TLB_BITS)
+
+struct tlb_entry {
+  mach_bits vpage;
+  mach_bits ppage;
+  uint64_t generation;
+  uint32_t context;
+  uint32_t access;
+};
+
+static _Thread_local struct tlb_entry tlb[TLB_SIZE];
+static _Thread_local uint64_t tlb_generation = 1;
+static _Thread_local struct tlb_entry *tlb_found;
+
+static inline uint32_t tlb_context(mach_bits priv, bool mxr, bool sum)
+{ return (uint32_t) priv | (mxr << 2) | (sum << 3); }
+
+bool tlb_hit(mach_bits vaddr, mach_bits access, mach_bits priv, bool mxr, bool sum)
+{
+  struct tlb_entry *e = &tlb[(vaddr >> 12) & (TLB_SIZE - 1)];
+  if (e->generation != tlb_generation || e->vpage != vaddr >> 12
+      || e->context != tlb_context(priv, mxr, sum) || (e->access & access) != access) {
+    sail_stat_add(STAT_TLB_MISSES, 1);
+    return false;
+  }
+  sail_stat_add(STAT_TLB_HITS, 1);
+  tlb_found = e;
+  return true;
+}
+
+mach_bits tlb_translate(mach_bits vaddr)
+{ return (tlb_found->ppage << 12) | (vaddr & 0xfff); }
+
+unit tlb_add(mach_bits vaddr, mach_bits paddr, mach_bits access, mach_bits priv, bool mxr, bool sum)
+{
+  if (!rv_enable_tlb) return UNIT;
+  struct tlb_entry *e = &tlb[(vaddr >> 12) & (TLB_SIZE - 1)];
+  e->vpage = vaddr >> 12;
+  e->ppage = paddr >> 12;
+  e->generation = tlb_generation;
+  e->context = tlb_context(priv, mxr, sum);
+  e->access = access;
+  return UNIT;
+}
+
+unit tlb_flush(unit u)
+{
+  tlb_generation++;
+  return UNIT;
+}
@@ -18,6 +18,14 @@ mach_bits plat_clint_size(unit);
 unit load_reservation(mach_bits);
 bool match_reservation(mach_bits);
 unit cancel_reservation(unit);
+bool check_reservation(unit);
+
+/* Set the hart run by the calling thread. */
+void plat_set_hart(mach_bits hart);
+mach_bits plat_hart_id(unit);
+mach_bits plat_harts(unit);
+bool plat_msip_read(mach_bits hart);
+unit plat_msip_write(mach_bits hart, bool v);
 
 void plat_insns_per_tick(sail_int *rop, unit);
 
@@ -26,3 +34,14 @@ mach_bits plat_htif_tohost(unit);
 
 unit memea(mach_bits, sail_int);
 
+bool decode_cache_hit(mach_bits pc);
+unit decode_cache_fetch(mach_bits pc, mach_bits paddr);
+bool decode_cache_add(mach_bits pc, bool rvc);
+unit decode_cache_flush(unit);
+bool decode_cache_block_next(mach_bits pc);
+
+bool tlb_hit(mach_bits vaddr, mach_bits access, mach_bits priv, bool mxr, bool sum);
+mach_bits tlb_translate(mach_bits vaddr);
+unit tlb_add(mach_bits vaddr, mach_bits paddr, mach_bits access, mach_bits priv, bool mxr, bool sum);
+unit tlb_flush(unit);
+
@@ -1,4 +1,5 @@
 #include "riscv_platform_impl.h"
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -7,6 +8,9 @@
 bool rv_enable_dirty_update         = false;
 bool rv_enable_misaligned           = false;
 bool rv_mtval_has_illegal_inst_bits = false;
+bool rv_enable_decode_cache         = true;
+bool rv_enable_blocks               = true;
+bool rv_enable_tlb                  = true;
 
 uint64_t rv_ram_base = UINT64_C(0x80000000);
 uint64_t rv_ram_size = UINT64_C(0x80000000);
@@ -20,10 +24,42 @@ uint64_t rv_clint_size = UINT64_C(0xc0000);
 uint64_t rv_htif_tohost = UINT64_C(0x80001000);
 uint64_t rv_insns_per_tick = UINT64_C(100);
 
+uint64_t rv_harts = UINT64_C(1);
+
 int term_fd = 1; // set during startup
-void plat_term_write_impl(char c)
+
+/* Terminal output is buffered until plat_term_flush is called, which
+   the emulator does whenever it flushes its logs. All harts share the
+   buffer. */
+static char term_buf[4096];
+static size_t term_len = 0;
+static pthread_mutex_t term_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void term_flush(void)
 {
-  if (write(term_fd, &c, sizeof(c)) < 0) {
-    fprintf(stderr, "Unable to write to terminal!\n");
+  size_t done = 0;
+  while (done < term_len) {
+    ssize_t n = write(term_fd, term_buf + done, term_len - done);
+    if (n < 0) {
+      fprintf(stderr, "Unable to write to terminal!\n");
+      break;
+    }
+    done += n;
   }
+  term_len = 0;
+}
+
+void plat_term_flush(void)
+{
+  pthread_mutex_lock(&term_lock);
+  term_flush();
+  pthread_mutex_unlock(&term_lock);
+}
+
+void plat_term_write_impl(char c)
+{
+  pthread_mutex_lock(&term_lock);
+  term_buf[term_len++] = c;
+  if (term_len == sizeof(term_buf)) term_flush();
+  pthread_mutex_unlock(&term_lock);
 }
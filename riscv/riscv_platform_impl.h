@@ -7,10 +7,14 @@
 
 #define DEFAULT_RSTVEC     0x00001000
 #define SAIL_XLEN          64
+#define RV_MAX_HARTS       64
 
 extern bool rv_enable_dirty_update;
 extern bool rv_enable_misaligned;
 extern bool rv_mtval_has_illegal_inst_bits;
+extern bool rv_enable_decode_cache;
+extern bool rv_enable_blocks;
+extern bool rv_enable_tlb;
 
 extern uint64_t rv_ram_base;
 extern uint64_t rv_ram_size;
@@ -24,5 +28,8 @@ extern uint64_t rv_clint_size;
 extern uint64_t rv_htif_tohost;
 extern uint64_t rv_insns_per_tick;
 
+extern uint64_t rv_harts;
+
 extern int term_fd;
 void plat_term_write_impl(char c);
+void plat_term_flush(void);
@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "elf.h"
 #include "sail.h"
@@ -40,6 +42,15 @@ struct tv_spike_t;
 #define CSR_MIP 0x344
 
 static bool do_dump_dts = false;
+static bool deterministic = false;
+#ifdef SPIKE
+static bool lockstep = false;
+static mach_int check_interval = 1000;
+#endif
+static uint64_t quantum_ticks = 100;
+static bool show_stats = false;
+static bool map_ram = false;
+static bool huge_pages = false;
 struct tv_spike_t *s = NULL;
 char *term_log = NULL;
 char *dtb_file = NULL;
@@ -53,7 +64,22 @@ static struct option options[] = {
   {"enable-dirty",                no_argument,       0, 'd'},
   {"enable-misaligned",           no_argument,       0, 'm'},
   {"ram-size",                    required_argument, 0, 'z'},
+  {"map-ram",                     no_argument,       0, 'M'},
+  {"huge-pages",                  no_argument,       0, 'H'},
   {"mtval-has-illegal-inst-bits", no_argument,       0, 'i'},
+  {"disable-decode-cache",        no_argument,       0, 'c'},
+  {"disable-blocks",              no_argument,       0, 'n'},
+  {"disable-tlb",                 no_argument,       0, 'L'},
+  {"harts",                       required_argument, 0, 'p'},
+  {"quantum",                     required_argument, 0, 'q'},
+  {"deterministic",               no_argument,       0, 'r'},
+  {"stats",                       no_argument,       0, 'x'},
+  {"stats-file",                  required_argument, 0, 'F'},
+  {"stats-interval",              required_argument, 0, 'I'},
+#ifdef SPIKE
+  {"lockstep",                    no_argument,       0, 'l'},
+  {"check-interval",              required_argument, 0, 'k'},
+#endif
   {"dump-dts",                    no_argument,       0, 's'},
   {"device-tree-blob",            required_argument, 0, 'b'},
   {"terminal-log",                required_argument, 0, 't'},
@@ -125,7 +151,7 @@ char *process_args(int argc, char **argv)
   int c, idx = 1;
   uint64_t ram_size = 0;
   while(true) {
-    c = getopt_long(argc, argv, "dmsz:b:t:v:h", options, &idx);
+    c = getopt_long(argc, argv, "dmcnLp:q:rxF:I:lk:sz:MHb:t:v:h", options, &idx);
     if (c == -1) break;
     switch (c) {
     case 'd':
@@ -136,6 +162,55 @@ char *process_args(int argc, char **argv)
       fprintf(stderr, "enabling misaligned access.\n");
       rv_enable_misaligned = true;
       break;
+    case 'c':
+      fprintf(stderr, "disabling decode cache.\n");
+      rv_enable_decode_cache = false;
+      break;
+    case 'n':
+      fprintf(stderr, "disabling translation blocks.\n");
+      rv_enable_blocks = false;
+      break;
+    case 'L':
+      fprintf(stderr, "disabling translation cache.\n");
+      rv_enable_tlb = false;
+      break;
+    case 'p':
+      rv_harts = atol(optarg);
+      if (rv_harts < 1 || rv_harts > RV_MAX_HARTS) {
+        fprintf(stderr, "number of harts must be between 1 and %d\n", RV_MAX_HARTS);
+        exit(1);
+      }
+      fprintf(stderr, "running %ld harts\n", rv_harts);
+      break;
+    case 'q':
+      quantum_ticks = atol(optarg);
+      if (quantum_ticks < 1) quantum_ticks = 1;
+      break;
+    case 'r':
+      deterministic = true;
+      break;
+    case 'x':
+      show_stats = true;
+      break;
+    case 'F':
+      stats_to_file(optarg);
+      break;
+    case 'I':
+      if (atof(optarg) <= 0) {
+        fprintf(stderr, "statistics interval must be positive\n");
+        exit(1);
+      }
+      stats_every(atof(optarg));
+      break;
+#ifdef SPIKE
+    case 'l':
+      lockstep = true;
+      break;
+    case 'k':
+      check_interval = atol(optarg);
+      if (check_interval < 1) check_interval = 1;
+      break;
+#endif
     case 'i':
       rv_mtval_has_illegal_inst_bits = true;
     case 's':
@@ -148,6 +223,13 @@ char *process_args(int argc, char **argv)
         rv_ram_size = ram_size << 20;
       }
       break;
+    case 'M':
+      map_ram = true;
+      break;
+    case 'H':
+      map_ram = true;
+      huge_pages = true;
+      break;
     case 'b':
       dtb_file = strdup(optarg);
       break;
@@ -163,9 +245,16 @@ char *process_args(int argc, char **argv)
     }
   }
   if (do_dump_dts) dump_dts();
-  if (idx >= argc) print_usage(argv[0], 0);
+#ifdef SPIKE
+  if (rv_harts > 1) {
+    fprintf(stderr, "Comparing with Spike is only supported for a single hart.\n");
+    exit(1);
+  }
+#endif
+  if (optind >= argc) print_usage(argv[0], 0);
   if (term_log == NULL) term_log = strdup("term.log");
   if (dtb_file) read_dtb(dtb_file);
+  if (map_ram) map_mem(rv_ram_base, rv_ram_size, huge_pages);
 
   fprintf(stdout, "Running file %s.\n", argv[optind]);
   return argv[optind];
@@ -268,12 +357,12 @@ void init_sail_reset_vector(uint64_t entry)
 
   rv_rom_base = DEFAULT_RSTVEC;
   uint64_t addr = rv_rom_base;
-  for (int i = 0; i < sizeof(reset_vec); i++)
-    write_mem(addr++, (uint64_t)((char *)reset_vec)[i]);
+  write_mem_block(addr, reset_vec, sizeof(reset_vec));
+  addr += sizeof(reset_vec);
 
   if (dtb && dtb_len) {
-    for (size_t i = 0; i < dtb_len; i++)
-      write_mem(addr++, dtb[i]);
+    write_mem_block(addr, dtb, dtb_len);
+    addr += dtb_len;
   }
 
 #ifdef SPIKE
@@ -291,8 +380,8 @@ void init_sail_reset_vector(uint64_t entry)
   } else {
     if (spike_dtb_len > 0) {
       // Use the DTB from Spike.
-      for (size_t i = 0; i < spike_dtb_len; i++)
-        write_mem(addr++, spike_dtb[i]);
+      write_mem_block(addr, spike_dtb, spike_dtb_len);
+      addr += spike_dtb_len;
     } else {
       fprintf(stderr, "Running without rom device tree.\n");
     }
@@ -302,8 +391,8 @@ void init_sail_reset_vector(uint64_t entry)
   /* zero-fill to page boundary */
   const int align = 0x1000;
   uint64_t rom_end = (addr + align -1)/align * align;
-  for (int i = addr; i < rom_end; i++)
-    write_mem(addr++, 0);
+  zero_mem_block(addr, rom_end - addr);
+  addr = rom_end;
 
   /* set rom size */
   rv_rom_size = rom_end - rv_rom_base;
@@ -328,8 +417,35 @@ int init_check(struct tv_spike_t *s)
   return passed;
 }
 
+/*
+ * With --stats, report how long the model took to start, and how many
+ * instructions it then retired how quickly, on stderr. bench/ reads
+ * these lines.
+ */
+static struct timespec start_time;
+static struct timespec run_time;
+static uint64_t insns_retired = 0;
+
+static double seconds_between(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void print_stats(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (run_time.tv_sec == 0 && run_time.tv_nsec == 0) return;
+  double run = seconds_between(&run_time, &now);
+  fprintf(stderr, "[Sail] Started in %.6f s\n", seconds_between(&start_time, &run_time));
+  fprintf(stderr, "[Sail] Executed %" PRIu64 " instructions in %.6f s (%.2f MIPS)\n",
+          insns_retired, run, run > 0 ? insns_retired / run / 1e6 : 0.0);
+}
+
 void finish(int ec)
 {
+  plat_term_flush();
+  if (show_stats) print_stats();
   model_fini();
 #ifdef SPIKE
   tv_free(s);
@@ -337,75 +453,82 @@ void finish(int ec)
   exit(ec);
 }
 
+#ifdef SPIKE
+/* The registers compared with Spike, besides the PC and privilege. */
+#define CHECKED_GPRS 32
+#define CHECKED_CSRS 7
+
+static const uint16_t checked_csr[CHECKED_CSRS] = {
+  CSR_MCAUSE, CSR_MEPC, CSR_MTVAL, CSR_MSTATUS,
+  CSR_SCAUSE, CSR_SEPC, CSR_STVAL
+};
+
+/* Filled in by init_checked_regs, since the registers are thread
+   local and so their addresses are not constant. sail_gpr[i] is x(i),
+   as the GPRs are the elements of Xs. */
+static mach_bits *sail_gpr;
+static mach_bits *sail_csr[CHECKED_CSRS];
+
+static void init_checked_regs(void)
+{
+  mach_bits *csrs[CHECKED_CSRS] = {
+    &zmcause.zMcause_chunk_0, &zmepc, &zmtval, &zmstatus,
+    &zscause.zMcause_chunk_0, &zsepc, &zstval
+  };
+  sail_gpr = hart_state.zXs;
+  memcpy(sail_csr, csrs, sizeof(csrs));
+}
+
+// fix default C enum map for cur_privilege
+static inline uint8_t spike_priv(uint32_t priv)
+{ return (priv == 2) ? 3 : priv; }
+#endif
+
 int compare_states(struct tv_spike_t *s)
 {
   int passed = 1;
 
 #ifdef SPIKE
-  // fix default C enum map for cur_privilege
-  uint8_t priv = (zcur_privilege == 2) ? 3 : zcur_privilege;
-  passed &= tv_check_priv(s, priv);
-
+  passed &= tv_check_priv(s, spike_priv(zcur_privilege));
   passed &= tv_check_pc(s, zPC);
 
-  passed &= tv_check_gpr(s, 1, zx1);
-  passed &= tv_check_gpr(s, 2, zx2);
-  passed &= tv_check_gpr(s, 3, zx3);
-  passed &= tv_check_gpr(s, 4, zx4);
-  passed &= tv_check_gpr(s, 5, zx5);
-  passed &= tv_check_gpr(s, 6, zx6);
-  passed &= tv_check_gpr(s, 7, zx7);
-  passed &= tv_check_gpr(s, 8, zx8);
-  passed &= tv_check_gpr(s, 9, zx9);
-  passed &= tv_check_gpr(s, 10, zx10);
-  passed &= tv_check_gpr(s, 11, zx11);
-  passed &= tv_check_gpr(s, 12, zx12);
-  passed &= tv_check_gpr(s, 13, zx13);
-  passed &= tv_check_gpr(s, 14, zx14);
-  passed &= tv_check_gpr(s, 15, zx15);
-  passed &= tv_check_gpr(s, 15, zx15);
-  passed &= tv_check_gpr(s, 16, zx16);
-  passed &= tv_check_gpr(s, 17, zx17);
-  passed &= tv_check_gpr(s, 18, zx18);
-  passed &= tv_check_gpr(s, 19, zx19);
-  passed &= tv_check_gpr(s, 20, zx20);
-  passed &= tv_check_gpr(s, 21, zx21);
-  passed &= tv_check_gpr(s, 22, zx22);
-  passed &= tv_check_gpr(s, 23, zx23);
-  passed &= tv_check_gpr(s, 24, zx24);
-  passed &= tv_check_gpr(s, 25, zx25);
-  passed &= tv_check_gpr(s, 25, zx25);
-  passed &= tv_check_gpr(s, 26, zx26);
-  passed &= tv_check_gpr(s, 27, zx27);
-  passed &= tv_check_gpr(s, 28, zx28);
-  passed &= tv_check_gpr(s, 29, zx29);
-  passed &= tv_check_gpr(s, 30, zx30);
-  passed &= tv_check_gpr(s, 31, zx31);
+  for (int i = 1; i < CHECKED_GPRS; i++)
+    passed &= tv_check_gpr(s, i, sail_gpr[i]);
 
   /* some selected CSRs for now */
-
-  passed &= tv_check_csr(s, CSR_MCAUSE, zmcause.zMcause_chunk_0);
-  passed &= tv_check_csr(s, CSR_MEPC, zmepc);
-  passed &= tv_check_csr(s, CSR_MTVAL, zmtval);
-  passed &= tv_check_csr(s, CSR_MSTATUS, zmstatus);
-
-  passed &= tv_check_csr(s, CSR_SCAUSE, zscause.zMcause_chunk_0);
-  passed &= tv_check_csr(s, CSR_SEPC, zsepc);
-  passed &= tv_check_csr(s, CSR_STVAL, zstval);
+  for (int i = 0; i < CHECKED_CSRS; i++)
+    passed &= tv_check_csr(s, checked_csr[i], *sail_csr[i]);
 #endif
 
   return passed;
 }
 
+static void dump_sail_state(void)
+{
+  fprintf(stderr, "Sail state: priv %d pc 0x%016" PRIx64 "\n", zcur_privilege, zPC);
+#ifdef SPIKE
+  for (int i = 1; i < CHECKED_GPRS; i++)
+    fprintf(stderr, "  x%-2d 0x%016" PRIx64 "%s", i, sail_gpr[i], i % 4 == 3 ? "\n" : "");
+  fprintf(stderr, "\n");
+  for (int i = 0; i < CHECKED_CSRS; i++)
+    fprintf(stderr, "  csr 0x%03x 0x%016" PRIx64 "\n", checked_csr[i], *sail_csr[i]);
+#endif
+}
+
 void flush_logs(void)
 {
   fprintf(stderr, "\n");
   fflush(stderr);
   fprintf(stdout, "\n");
   fflush(stdout);
+  plat_term_flush();
 }
 
-void run_sail(void)
+/*
+ * Run Sail and Spike in lockstep on this thread, comparing their
+ * states after every step from step check_from on.
+ */
+void run_sail(mach_int check_from)
 {
   bool spike_done;
   bool stepped;
@@ -413,27 +536,32 @@ void run_sail(void)
 
   /* initialize the step number */
   mach_int step_no = 0;
+  mach_int steps = 0;
   int insn_cnt = 0;
 
   while (!zhtif_done) {
+    bool checking = steps >= check_from;
     { /* run a Sail step */
       sail_int sail_step;
       CREATE(sail_int)(&sail_step);
       CONVERT_OF(sail_int, mach_int)(&sail_step, step_no);
       stepped = zstep(sail_step);
+      KILL(sail_int)(&sail_step);
       if (have_exception) goto step_exception;
-      flush_logs();
+      if (checking) flush_logs();
     }
     if (stepped) {
       step_no++;
       insn_cnt++;
+      sail_stat_add(STAT_INSTRUCTIONS, 1);
     }
+    steps++;
 
 #ifdef SPIKE
     { /* run a Spike step */
       tv_step(s);
       spike_done = tv_is_done(s);
-      flush_logs();
+      if (checking) flush_logs();
     }
 
     if (zhtif_done) {
@@ -447,7 +575,7 @@ void run_sail(void)
         exit(1);
       }
     }
-    if (!compare_states(s)) {
+    if (checking && !compare_states(s)) {
       diverged = true;
       break;
     }
@@ -471,8 +599,10 @@ void run_sail(void)
 
  dump_state:
   if (diverged) {
-    /* TODO */
+    fprintf(stderr, "\nFirst divergence from Spike at step %ld\n", steps - 1);
+    dump_sail_state();
   }
+  insns_retired = step_no;
   finish(diverged);
 
  step_exception:
@@ -480,6 +610,397 @@ void run_sail(void)
   goto dump_state;
 }
 
+#ifdef SPIKE
+/*
+ * Threaded co-simulation: Sail runs on the main thread and sends a
+ * commit record for every step through a queue to a second thread,
+ * which steps Spike and compares. A record holds the PC, privilege
+ * and only those checked registers that the step changed, except
+ * that every check_interval steps it holds all of them, so that a
+ * register that Spike alone changed is caught within an interval.
+ *
+ * When the checker finds a difference, both models are reset and run
+ * again in lockstep (run_sail above) to find the first step at which
+ * they differ. Spike cannot restore a checkpoint through its
+ * interface, so the re-run starts from reset, but it only compares
+ * from the last step at which all registers were seen to match.
+ */
+#define COMMIT_QUEUE_BITS 14
+#define COMMIT_QUEUE_SIZE (1 << COMMIT_QUEUE_BITS)
+#define COMMIT_BATCH 256
+
+struct commit {
+  mach_int step;
+  mach_bits pc;
+  uint32_t gprs;          /* bit i set if x(i) is included */
+  uint8_t csrs;           /* bit i set if checked_csr[i] is included */
+  uint8_t priv;
+  bool full;              /* all registers are included */
+  bool tick;              /* the clock ticks after this step */
+  bool done;              /* Sail is done after this step */
+  mach_bits vals[CHECKED_GPRS + CHECKED_CSRS];
+};
+
+static struct commit commit_queue[COMMIT_QUEUE_SIZE];
+/* Written by the Sail thread, which publishes it every COMMIT_BATCH
+   records, and by the checker, respectively. */
+static uint64_t commit_head = 0;
+static uint64_t commit_tail = 0;
+static bool commit_finished = false;
+static bool cosim_diverged = false;
+/* The last step after which all registers matched, and the step at
+   which the checker found a difference. */
+static mach_int cosim_verified = -1;
+static mach_int cosim_bad_step = -1;
+
+static void *run_checker(void *arg)
+{
+  uint64_t tail = 0;
+  while (true) {
+    uint64_t head = __atomic_load_n(&commit_head, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+      if (__atomic_load_n(&commit_finished, __ATOMIC_ACQUIRE)
+          && tail == __atomic_load_n(&commit_head, __ATOMIC_ACQUIRE)) break;
+      sched_yield();
+      continue;
+    }
+    for (; tail != head; tail++) {
+      struct commit *c = &commit_queue[tail & (COMMIT_QUEUE_SIZE - 1)];
+      tv_step(s);
+
+      int passed = tv_check_priv(s, c->priv) & tv_check_pc(s, c->pc);
+      int n = 0;
+      for (int i = 1; i < CHECKED_GPRS; i++)
+        if (c->gprs & (UINT32_C(1) << i)) passed &= tv_check_gpr(s, i, c->vals[n++]);
+      for (int i = 0; i < CHECKED_CSRS; i++)
+        if (c->csrs & (1 << i)) passed &= tv_check_csr(s, checked_csr[i], c->vals[n++]);
+      if (tv_is_done(s) != c->done) {
+        fprintf(stdout, c->done ? "Sail done, but not Spike!\n" : "Spike done, but not Sail!\n");
+        passed = 0;
+      }
+
+      if (!passed) {
+        cosim_bad_step = c->step;
+        __atomic_store_n(&cosim_diverged, true, __ATOMIC_RELEASE);
+        return NULL;
+      }
+      if (c->full) cosim_verified = c->step;
+      if (c->tick) tick_spike();
+    }
+    __atomic_store_n(&commit_tail, tail, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* Wait for a free slot in the queue. */
+static struct commit *commit_slot(uint64_t head)
+{
+  while (head - __atomic_load_n(&commit_tail, __ATOMIC_ACQUIRE) >= COMMIT_QUEUE_SIZE) {
+    if (__atomic_load_n(&cosim_diverged, __ATOMIC_ACQUIRE)) return NULL;
+    sched_yield();
+  }
+  return &commit_queue[head & (COMMIT_QUEUE_SIZE - 1)];
+}
+
+static void make_commit(struct commit *c, mach_int step, mach_bits *shadow)
+{
+  c->step = step;
+  c->pc = zPC;
+  c->priv = spike_priv(zcur_privilege);
+  c->full = step % check_interval == 0 || zhtif_done;
+  c->gprs = 0;
+  c->csrs = 0;
+  int n = 0;
+  /* Most steps write at most one GPR, and often none. */
+  if (c->full || memcmp(shadow + 1, sail_gpr + 1, (CHECKED_GPRS - 1) * sizeof(mach_bits)) != 0) {
+    for (int i = 1; i < CHECKED_GPRS; i++) {
+      mach_bits v = sail_gpr[i];
+      if (c->full || v != shadow[i]) {
+        c->gprs |= UINT32_C(1) << i;
+        c->vals[n++] = v;
+        shadow[i] = v;
+      }
+    }
+  }
+  for (int i = 0; i < CHECKED_CSRS; i++) {
+    mach_bits v = *sail_csr[i];
+    if (c->full || v != shadow[CHECKED_GPRS + i]) {
+      c->csrs |= 1 << i;
+      c->vals[n++] = v;
+      shadow[CHECKED_GPRS + i] = v;
+    }
+  }
+}
+
+void run_sail_cosim(char *file, uint64_t entry)
+{
+  mach_bits shadow[CHECKED_GPRS + CHECKED_CSRS];
+  memcpy(shadow, sail_gpr, CHECKED_GPRS * sizeof(mach_bits));
+  for (int i = 0; i < CHECKED_CSRS; i++) shadow[CHECKED_GPRS + i] = *sail_csr[i];
+
+  pthread_t checker;
+  if (pthread_create(&checker, NULL, run_checker, NULL) != 0) {
+    fprintf(stderr, "Unable to start the Spike checker thread\n");
+    exit(1);
+  }
+
+  mach_int step_no = 0;
+  mach_int insn_cnt = 0;
+  uint64_t head = 0;
+  bool exception = false;
+
+  sail_int sail_step;
+  CREATE(sail_int)(&sail_step);
+
+  while (!zhtif_done) {
+    CONVERT_OF(sail_int, mach_int)(&sail_step, step_no);
+    bool stepped = zstep(sail_step);
+    if (have_exception) {
+      exception = true;
+      break;
+    }
+    if (stepped) {
+      step_no++;
+      insn_cnt++;
+      sail_stat_add(STAT_INSTRUCTIONS, 1);
+    }
+
+    struct commit *c = commit_slot(head);
+    if (c == NULL) break;
+    make_commit(c, head, shadow);
+    c->done = zhtif_done;
+    c->tick = insn_cnt == rv_insns_per_tick;
+    head++;
+    if (head % COMMIT_BATCH == 0) {
+      __atomic_store_n(&commit_head, head, __ATOMIC_RELEASE);
+      fflush(stderr);
+      fflush(stdout);
+      plat_term_flush();
+    }
+
+    if (zhtif_done) {
+      /* check exit code */
+      if (zhtif_exit_code == 0)
+        fprintf(stdout, "SUCCESS\n");
+      else
+        fprintf(stdout, "FAILURE: %ld\n", zhtif_exit_code);
+    }
+
+    if (c->tick) {
+      insn_cnt = 0;
+      ztick_clock(UNIT);
+      ztick_platform(UNIT);
+    }
+  }
+  KILL(sail_int)(&sail_step);
+
+  __atomic_store_n(&commit_head, head, __ATOMIC_RELEASE);
+  __atomic_store_n(&commit_finished, true, __ATOMIC_RELEASE);
+  pthread_join(checker, NULL);
+  flush_logs();
+
+  insns_retired = step_no;
+  if (exception) {
+    fprintf(stderr, "Sail exception!");
+    finish(1);
+  }
+  if (!cosim_diverged) finish(0);
+
+  fprintf(stderr, "\nSpike differs from Sail at step %ld, all registers last matched at step %ld.\n"
+          "Re-running in lockstep to find the first difference.\n",
+          cosim_bad_step, cosim_verified);
+  model_fini();
+  tv_free(s);
+  entry = load_sail(file);
+  init_spike(file, entry, rv_ram_size);
+  init_sail(entry);
+  init_checked_regs();
+  run_sail(cosim_verified < 0 ? 0 : cosim_verified);
+}
+#endif
+
+/*
+ * Without Spike to compare against after every step, let the model run
+ * a clock tick's worth of instructions at a time (see run_batch in
+ * riscv_step.sail), and only flush the logs and terminal at the end of
+ * each batch.
+ */
+void run_sail_batched(void)
+{
+  mach_int step_no = 0;
+  mach_int insn_cnt = 0;
+
+  bool exception = false;
+  while (!zhtif_done) {
+    mach_int stepped = zrun_batch(step_no, rv_insns_per_tick - insn_cnt);
+    if (have_exception) {
+      exception = true;
+      break;
+    }
+    step_no += stepped;
+    insn_cnt += stepped;
+    sail_stat_add(STAT_INSTRUCTIONS, stepped);
+    fflush(stderr);
+    fflush(stdout);
+    plat_term_flush();
+
+    if (zhtif_done) {
+      /* check exit code */
+      if (zhtif_exit_code == 0)
+        fprintf(stdout, "SUCCESS\n");
+      else
+        fprintf(stdout, "FAILURE: %ld\n", zhtif_exit_code);
+    }
+
+    if (insn_cnt == rv_insns_per_tick) {
+      insn_cnt = 0;
+      ztick_clock(UNIT);
+      ztick_platform(UNIT);
+    }
+  }
+
+  insns_retired = step_no;
+  if (exception) fprintf(stderr, "Sail exception!");
+  finish(0);
+}
+
+/*
+ * With --harts N, each hart runs on its own thread, with its own
+ * instance of the model (see riscv_sail.h), and memory shared through
+ * the thread-safe memory of the runtime. The harts advance in quanta
+ * of --quantum clock ticks: mtime is per hart, so this keeps their
+ * clocks within one quantum of each other.
+ *
+ * By default the harts run their quanta at the same time, and wait
+ * for each other at the end of each one. With --deterministic they
+ * take turns instead, so that a run can be reproduced exactly, at the
+ * cost of running on a single host core.
+ */
+struct hart {
+  pthread_t thread;
+  mach_bits id;
+};
+
+static pthread_barrier_t quantum_barrier;
+static pthread_mutex_t turn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+static mach_bits turn = 0;
+static bool harts_done = false;
+static bool harts_exception = false;
+
+static void hart_wait_turn(mach_bits id)
+{
+  pthread_mutex_lock(&turn_lock);
+  while (turn != id && !harts_done) pthread_cond_wait(&turn_cond, &turn_lock);
+  pthread_mutex_unlock(&turn_lock);
+}
+
+static void hart_end_turn(void)
+{
+  pthread_mutex_lock(&turn_lock);
+  turn = (turn + 1) % rv_harts;
+  pthread_cond_broadcast(&turn_cond);
+  pthread_mutex_unlock(&turn_lock);
+}
+
+static void *run_hart(void *arg)
+{
+  struct hart *hart = (struct hart *)arg;
+
+  /* Hart 0 is the instance set up by init_sail on the main thread. */
+  if (hart->id != 0) {
+    setup_library_thread();
+    model_init_thread();
+    plat_set_hart(hart->id);
+    zinit_platform(UNIT);
+    zinit_sys(UNIT);
+    zPC = rv_rom_base;
+  }
+
+  mach_int step_no = 0;
+
+  while (true) {
+    if (deterministic) hart_wait_turn(hart->id);
+    if (__atomic_load_n(&harts_done, __ATOMIC_ACQUIRE)) break;
+
+    for (uint64_t tick = 0; tick < quantum_ticks && !zhtif_done; tick++) {
+      mach_int insn_cnt = 0;
+      while (insn_cnt < rv_insns_per_tick && !zhtif_done) {
+        mach_int stepped = zrun_batch(step_no, rv_insns_per_tick - insn_cnt);
+        if (have_exception) break;
+        step_no += stepped;
+        insn_cnt += stepped;
+        sail_stat_add(STAT_INSTRUCTIONS, stepped);
+      }
+      if (have_exception) {
+        fprintf(stderr, "Sail exception on hart %ld!\n", hart->id);
+        __atomic_store_n(&harts_exception, true, __ATOMIC_RELEASE);
+        break;
+      }
+      if (insn_cnt == rv_insns_per_tick) {
+        ztick_clock(UNIT);
+        ztick_platform(UNIT);
+      }
+    }
+
+    if (zhtif_done || have_exception) {
+      if (zhtif_done) {
+        /* check exit code */
+        if (zhtif_exit_code == 0)
+          fprintf(stdout, "SUCCESS (hart %ld)\n", hart->id);
+        else
+          fprintf(stdout, "FAILURE (hart %ld): %ld\n", hart->id, zhtif_exit_code);
+      }
+      __atomic_store_n(&harts_done, true, __ATOMIC_RELEASE);
+    }
+
+    if (deterministic) {
+      hart_end_turn();
+    } else {
+      /* Everybody sees the same harts_done after the barrier, so the
+         harts stop after the same quantum. */
+      if (pthread_barrier_wait(&quantum_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        fflush(stderr);
+        fflush(stdout);
+        plat_term_flush();
+      }
+      bool done = __atomic_load_n(&harts_done, __ATOMIC_ACQUIRE);
+      pthread_barrier_wait(&quantum_barrier);
+      if (done) break;
+    }
+  }
+
+  __atomic_fetch_add(&insns_retired, step_no, __ATOMIC_RELAXED);
+
+  if (hart->id != 0) {
+    model_fini_thread();
+    cleanup_library_thread();
+  }
+  return NULL;
+}
+
+void run_sail_harts(void)
+{
+  struct hart harts[RV_MAX_HARTS];
+
+  share_mem();
+  pthread_barrier_init(&quantum_barrier, NULL, rv_harts);
+  for (mach_bits i = 0; i < rv_harts; i++) {
+    harts[i].id = i;
+    if (i == 0) continue;
+    if (pthread_create(&harts[i].thread, NULL, run_hart, &harts[i]) != 0) {
+      fprintf(stderr, "Unable to start thread for hart %ld\n", i);
+      exit(1);
+    }
+  }
+  run_hart(&harts[0]);
+  for (mach_bits i = 1; i < rv_harts; i++) pthread_join(harts[i].thread, NULL);
+  pthread_barrier_destroy(&quantum_barrier);
+
+  if (harts_exception) fprintf(stderr, "Sail exception!");
+  finish(0);
+}
+
 void init_logs()
 {
 #ifdef SPIKE
@@ -499,6 +1020,7 @@ void init_logs()
 
 int main(int argc, char **argv)
 {
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
   char *file = process_args(argc, argv);
   init_logs();
 
@@ -511,7 +1033,19 @@ int main(int argc, char **argv)
   init_sail(entry);
 
   if (!init_check(s)) finish(1);
+  clock_gettime(CLOCK_MONOTONIC, &run_time);
 
-  run_sail();
+#ifdef SPIKE
+  init_checked_regs();
+  if (lockstep)
+    run_sail(0);
+  else
+    run_sail_cosim(file, entry);
+#else
+  if (rv_harts > 1)
+    run_sail_harts();
+  else
+    run_sail_batched();
+#endif
   flush_logs();
 }
@@ -66,6 +66,13 @@ let opt_debug_function = ref ""
 let opt_trace = ref false
 let opt_static = ref false
 let opt_no_main = ref false
+let opt_arena = ref false
+let opt_profile = ref false
+let opt_thread_local = ref false
+let opt_split = ref 0
+let opt_pgo = ref None
+let opt_hart_state = ref ([] : string list)
+let opt_hart_state_header = ref None
 
 (* Optimization flags *)
 let optimize_primops = ref false
@@ -412,6 +419,22 @@ let analyze_primop' ctx id args typ =
   | "gteq", [AV_C_fragment (v1, _); AV_C_fragment (v2, _)] ->
      AE_val (AV_C_fragment (F_op (v1, ">=", v2), typ))
 
+  | "lteq", [AV_C_fragment (v1, _); AV_C_fragment (v2, _)] ->
+     AE_val (AV_C_fragment (F_op (v1, "<=", v2), typ))
+
+  | "gt", [AV_C_fragment (v1, _); AV_C_fragment (v2, _)] ->
+     AE_val (AV_C_fragment (F_op (v1, ">", v2), typ))
+
+  | "lt", [AV_C_fragment (v1, _); AV_C_fragment (v2, _)] ->
+     AE_val (AV_C_fragment (F_op (v1, "<", v2), typ))
+
+  (* The type of the result says it fits in an int64, so these can't overflow. *)
+  | "add_int", [AV_C_fragment (v1, _); AV_C_fragment (v2, _)] when is_stack_typ ctx typ ->
+     AE_val (AV_C_fragment (F_op (v1, "+", v2), typ))
+
+  | "sub_int", [AV_C_fragment (v1, _); AV_C_fragment (v2, _)] when is_stack_typ ctx typ ->
+     AE_val (AV_C_fragment (F_op (v1, "-", v2), typ))
+
   | "xor_bits", [AV_C_fragment (v1, typ1); AV_C_fragment (v2, typ2)] ->
      AE_val (AV_C_fragment (F_op (v1, "^", v2), typ))
 
@@ -472,6 +495,9 @@ let analyze_primop' ctx id args typ =
   | "undefined_bool", _ ->
      AE_val (AV_C_fragment (F_lit (V_bool false), typ))
 
+  | "read_ram", [_; AV_C_fragment (size, _); _; AV_C_fragment (addr, _)] when is_stack_typ ctx typ ->
+     AE_val (AV_C_fragment (F_call ("fast_read_ram", [size; addr]), typ))
+
   | _, _ ->
      c_debug (lazy ("No optimization routine found"));
      no_change
@@ -817,14 +843,34 @@ let compile_funcall l ctx id args typ =
   let arg_ctyps, ret_ctyp = List.map (ctyp_of_typ ctx') arg_typs, ctyp_of_typ ctx' ret_typ in
   let final_ctyp = ctyp_of_typ ctx typ in
 
-  let setup_arg ctyp aval =
+  (* Reading or writing an element of a vector of unboxed values with a
+     machine word index, as when accessing a register file, calls the
+     internal_ version of vector_access or vector_update, which takes
+     the index as it is rather than as a sail_int. *)
+  let internal_vector_op =
+    if Env.is_extern id ctx.tc_env "c" then
+      match Env.get_extern id ctx.tc_env "c" with
+      | ("vector_access" | "vector_update") as op -> Some op
+      | _ -> None
+    else
+      None
+  in
+  let unboxed_vector = ref None in
+  let machine_index = ref false in
+
+  let setup_arg n ctyp aval =
     let arg_setup, cval, arg_cleanup = compile_aval l ctx aval in
     setup := List.rev arg_setup @ !setup;
     cleanup := arg_cleanup @ !cleanup;
     let have_ctyp = cval_ctyp cval in
+    begin match internal_vector_op, n, have_ctyp with
+    | Some _, 0, CT_vector (_, elem_ctyp) when is_stack_ctyp elem_ctyp -> unboxed_vector := Some have_ctyp
+    | Some _, 1, CT_int64 when !unboxed_vector <> None -> machine_index := true
+    | _ -> ()
+    end;
     if is_polymorphic ctyp then
       (F_poly (fst cval), have_ctyp)
-    else if ctyp_equal ctyp have_ctyp then
+    else if ctyp_equal ctyp have_ctyp || (n = 1 && !machine_index) then
       cval
     else
       let gs = gensym () in
@@ -835,10 +881,23 @@ let compile_funcall l ctx id args typ =
 
   assert (List.length arg_ctyps = List.length args);
 
-  let setup_args = List.map2 setup_arg arg_ctyps args in
+  let setup_args = List.mapi (fun n (ctyp, aval) -> setup_arg n ctyp aval) (List.combine arg_ctyps args) in
 
   List.rev !setup,
   begin fun clexp ->
+  match internal_vector_op, !unboxed_vector with
+  | Some op, Some (CT_vector (_, elem_ctyp) as vector_ctyp) when !machine_index ->
+     let op_ctyp = if op = "vector_access" then elem_ctyp else vector_ctyp in
+     if ctyp_equal (clexp_ctyp clexp) op_ctyp then
+       iextern clexp (mk_id ("internal_" ^ op)) setup_args
+     else
+       let gs = gensym () in
+       iblock [icomment "copy call";
+               idecl op_ctyp gs;
+               iextern (CL_id (gs, op_ctyp)) (mk_id ("internal_" ^ op)) setup_args;
+               icopy l clexp (F_id gs, op_ctyp);
+               iclear op_ctyp gs]
+  | _ ->
   if ctyp_equal (clexp_ctyp clexp) ret_ctyp then
     ifuncall clexp id setup_args
   else
@@ -1525,10 +1584,24 @@ let fix_destructure fail_label = function
 
 let letdef_count = ref 0
 
+(* The registers given with -c_hart_state, and their lengths. Each must
+   be a vector of a constant length with unboxed elements, such as a
+   register file. Their elements are kept together in the hart_state
+   struct rather than on the heap, see compile_ast. *)
+let hart_registers = ref Bindings.empty
+
 (** Compile a Sail toplevel definition into an IR definition **)
 let rec compile_def ctx = function
-  | DEF_reg_dec (DEC_aux (DEC_reg (typ, id), _)) ->
-     [CDEF_reg_dec (id, ctyp_of_typ ctx typ, [])], ctx
+  | DEF_reg_dec (DEC_aux (DEC_reg (typ, id), l)) ->
+     let ctyp = ctyp_of_typ ctx typ in
+     if List.mem (string_of_id id) !opt_hart_state then
+       begin match ctyp, destruct_vector ctx.tc_env typ with
+       | CT_vector (_, elem_ctyp), Some (Nexp_aux (Nexp_constant len, _), _, _) when is_stack_ctyp elem_ctyp ->
+          hart_registers := Bindings.add id (Big_int.to_int len) !hart_registers
+       | _ ->
+          c_error ~loc:l ("-c_hart_state: register " ^ string_of_id id ^ " is not a vector of a constant length with unboxed elements")
+       end;
+     [CDEF_reg_dec (id, ctyp, [])], ctx
   | DEF_reg_dec (DEC_aux (DEC_config (id, typ, exp), _)) ->
      let aexp = analyze_functions ctx analyze_primop (c_literals ctx (no_shadow IdSet.empty (anf exp))) in
      let setup, call, cleanup = compile_aexp ctx aexp in
@@ -2022,6 +2095,232 @@ let fix_struct_updates ctx =
   | cdef -> [cdef]
                *)
 
+(** Profile guided optimisation, with -c_pgo FILE. The profile is the
+   collapsed stacks file written by a model compiled with -c_profile
+   (see profile_report in lib/rts.c), which has a line for each call
+   stack with the time spent in its innermost function:
+
+     step;execute;wX 12345
+
+   The functions that account for most of the time are marked hot,
+   and the functions that never ran are marked cold. gcc optimises the
+   former harder and the latter for size, places each group together
+   in .text.hot and .text.unlikely, and predicts branches that lead to
+   a call of a cold function as not taken. Hot functions are also
+   specialised on the constant arguments their hot callers pass. *)
+
+(* The hot functions are the fewest that account for pgo_hot_fraction
+   of the time. A copy of a hot function is made for a set of constant
+   arguments when the callers passing them account for at least
+   pgo_specialize_fraction of its time, for at most
+   pgo_max_specializations sets per function. *)
+let pgo_hot_fraction = 0.9
+let pgo_specialize_fraction = 0.1
+let pgo_max_specializations = 4
+
+(* The GCC attribute (hot or cold) given to each function *)
+let pgo_attributes = ref Bindings.empty
+
+let pgo_attribute id =
+  try Printf.sprintf "__attribute__((%s)) " (Bindings.find id !pgo_attributes) with
+  | Not_found -> ""
+
+type pgo_profile = {
+    pgo_total : int;
+    pgo_self : (string, int) Hashtbl.t;
+    pgo_inclusive : (string, int) Hashtbl.t;
+    pgo_edges : (string * string, int) Hashtbl.t
+  }
+
+let pgo_count table key = try Hashtbl.find table key with Not_found -> 0
+
+let pgo_add table key n = Hashtbl.replace table key (pgo_count table key + n)
+
+(* Inclusive times and calls from one function to another are only
+   counted once per stack, so recursion is not counted twice. Only the
+   calls made from Sail are profiled, so the functions called from C,
+   such as main, are not in the profile. The calls they make are
+   recorded as calls from "". *)
+let read_pgo_profile file =
+  let chan = try open_in file with Sys_error msg -> c_error ("Could not read profile " ^ msg) in
+  let lines = ref [] in
+  (try while true do lines := input_line chan :: !lines done with End_of_file -> ());
+  close_in chan;
+  let profile = { pgo_total = 0;
+                  pgo_self = Hashtbl.create 1024;
+                  pgo_inclusive = Hashtbl.create 1024;
+                  pgo_edges = Hashtbl.create 1024 }
+  in
+  let rec edges = function
+    | caller :: (callee :: _ as stack) -> (caller, callee) :: edges stack
+    | _ -> []
+  in
+  let read total line =
+    if line = "" then total else
+      let stack, n =
+        try
+          let i = String.rindex line ' ' in
+          String.split_on_char ';' (String.sub line 0 i),
+          int_of_string (String.sub line (i + 1) (String.length line - i - 1))
+        with
+        | Not_found | Failure _ -> c_error (Printf.sprintf "Malformed line in profile %s: %s" file line)
+      in
+      pgo_add profile.pgo_self (List.nth stack (List.length stack - 1)) n;
+      List.iter (fun fn -> pgo_add profile.pgo_inclusive fn n) (List.sort_uniq String.compare stack);
+      List.iter (fun edge -> pgo_add profile.pgo_edges edge n) (List.sort_uniq compare (edges ("" :: stack)));
+      total + n
+  in
+  { profile with pgo_total = List.fold_left read 0 (List.rev !lines) }
+
+(* The constant arguments of a call to a function with argument types
+   arg_ctyps, and their position. Only unboxed constants are used, as
+   they can be assigned to the argument at the start of the copy. *)
+let pgo_constants arg_ctyps cvals =
+  if List.length arg_ctyps <> List.length cvals then [] else
+    List.concat (List.mapi (fun n (arg_ctyp, cval) ->
+                     match cval with
+                     | ((F_lit (V_int _ | V_bits _ | V_bit _ | V_bool _) as frag), ctyp)
+                          when is_stack_ctyp ctyp && ctyp_equal arg_ctyp ctyp -> [(n, frag)]
+                     | _ -> [])
+                   (List.combine arg_ctyps cvals))
+
+let pgo_key f constants =
+  string_of_id f ^ "(" ^ Util.string_of_list ", " (fun (n, frag) -> string_of_int n ^ " = " ^ string_of_fragment frag) constants ^ ")"
+
+let pgo_optimize' ctx profile fundefs cdefs =
+  let self id = pgo_count profile.pgo_self (string_of_id id) in
+  let inclusive id = pgo_count profile.pgo_inclusive (string_of_id id) in
+
+  let by_time = List.sort (fun id1 id2 -> compare (self id2) (self id1)) (List.filter (fun id -> self id > 0) fundefs) in
+  let rec take_hot time = function
+    | id :: ids when float_of_int time < pgo_hot_fraction *. float_of_int profile.pgo_total ->
+       IdSet.add id (take_hot (time + self id) ids)
+    | _ -> IdSet.empty
+  in
+  let hot = take_hot 0 by_time in
+  let profiled id = Hashtbl.mem profile.pgo_inclusive (string_of_id id) in
+
+  (* A function that never ran is only cold if it is called from Sail,
+     as otherwise it would not be in the profile anyway. *)
+  let called = ref IdSet.empty in
+  let find_calls (I_aux (instr, _) as i) =
+    begin match instr with
+    | I_funcall (_, false, f, _) -> called := IdSet.add f !called
+    | _ -> ()
+    end;
+    i
+  in
+  List.iter (function CDEF_fundef (_, _, _, instrs) -> ignore (List.map (map_instr find_calls) instrs) | _ -> ()) cdefs;
+  List.iter (fun id ->
+      if IdSet.mem id hot then
+        pgo_attributes := Bindings.add id "hot" !pgo_attributes
+      else if not (profiled id) && IdSet.mem id !called then
+        pgo_attributes := Bindings.add id "cold" !pgo_attributes
+      else ())
+    fundefs;
+
+  (* Find the sets of constant arguments passed to each hot function,
+     and the functions that pass them. *)
+  let specs = List.fold_left (fun specs cdef ->
+                  match cdef with
+                  | CDEF_spec (id, arg_ctyps, _) -> Bindings.add id arg_ctyps specs
+                  | _ -> specs)
+                Bindings.empty cdefs
+  in
+  let candidates = Hashtbl.create 64 in
+  let scan caller (I_aux (instr, _) as i) =
+    begin match instr with
+    | I_funcall (_, false, f, cvals) when IdSet.mem f hot && Bindings.mem f specs ->
+       let constants = pgo_constants (Bindings.find f specs) cvals in
+       if constants <> [] then
+         begin
+           let key = pgo_key f constants in
+           let callers = try (fun (_, _, callers) -> callers) (Hashtbl.find candidates key) with Not_found -> IdSet.empty in
+           Hashtbl.replace candidates key (f, constants, IdSet.add caller callers)
+         end
+    | _ -> ()
+    end;
+    i
+  in
+  List.iter (function CDEF_fundef (id, _, _, instrs) -> ignore (List.map (map_instr (scan id)) instrs) | _ -> ()) cdefs;
+
+  let chosen =
+    Hashtbl.fold (fun key (f, constants, callers) chosen ->
+        let caller_name caller = if profiled caller then string_of_id caller else "" in
+        let time =
+          List.map caller_name (IdSet.elements callers)
+          |> List.sort_uniq String.compare
+          |> List.fold_left (fun time caller -> time + pgo_count profile.pgo_edges (caller, string_of_id f)) 0
+        in
+        if time > 0 && float_of_int time >= pgo_specialize_fraction *. float_of_int (inclusive f) then
+          (time, key, f, constants) :: chosen
+        else
+          chosen)
+      candidates []
+    |> List.sort (fun (time1, key1, _, _) (time2, key2, _, _) ->
+           if time1 = time2 then String.compare key1 key2 else compare time2 time1)
+  in
+  (* The copies of f are called f#pgo0, f#pgo1, and so on. *)
+  let copies =
+    List.fold_left (fun copies (_, key, f, constants) ->
+        let previous = try Bindings.find f copies with Not_found -> [] in
+        if List.length previous >= pgo_max_specializations then copies else
+          let copy = mk_id (string_of_id f ^ "#pgo" ^ string_of_int (List.length previous)) in
+          c_debug (lazy (Printf.sprintf "specialising %s as %s" key (string_of_id copy)));
+          pgo_attributes := Bindings.add copy "hot" !pgo_attributes;
+          Bindings.add f (previous @ [(key, copy, constants)]) copies)
+      Bindings.empty chosen
+  in
+  let copies_of f = try Bindings.find f copies with Not_found -> [] in
+
+  let copy_cdef = function
+    | CDEF_spec (f, arg_ctyps, ret_ctyp) as cdef ->
+       cdef :: List.map (fun (_, copy, _) -> CDEF_spec (copy, arg_ctyps, ret_ctyp)) (copies_of f)
+    | CDEF_fundef (f, heap_return, args, body) as cdef ->
+       let arg_ctyps = try Bindings.find f specs with Not_found -> [] in
+       let set_constant (n, frag) =
+         let ctyp = List.nth arg_ctyps n in
+         icopy (id_loc f) (CL_id (List.nth args n, ctyp)) (frag, ctyp)
+       in
+       cdef :: List.map (fun (_, copy, constants) ->
+                   CDEF_fundef (copy, heap_return, args, List.map set_constant constants @ body))
+                 (copies_of f)
+    | cdef -> [cdef]
+  in
+  let specialize (I_aux (instr, aux) as i) =
+    match instr with
+    | I_funcall (clexp, false, f, cvals) when Bindings.mem f copies ->
+       let key = pgo_key f (pgo_constants (Bindings.find f specs) cvals) in
+       begin match List.filter (fun (key', _, _) -> key = key') (Bindings.find f copies) with
+       | (_, copy, _) :: _ -> I_aux (I_funcall (clexp, false, copy, cvals), aux)
+       | [] -> i
+       end
+    | _ -> i
+  in
+  let cdefs = List.map (cdef_map_instr specialize) (List.concat (List.map copy_cdef cdefs)) in
+
+  (* The copies have the same type as the original function. *)
+  let add_copy f ctx (_, copy, _) =
+    { ctx with tc_env = Env.update_val_spec copy (Env.get_val_spec_orig f ctx.tc_env) ctx.tc_env;
+               recursive_functions =
+                 if IdSet.mem f ctx.recursive_functions then IdSet.add copy ctx.recursive_functions
+                 else ctx.recursive_functions }
+  in
+  cdefs, Bindings.fold (fun f copies ctx -> List.fold_left (add_copy f) ctx copies) copies ctx
+
+let pgo_optimize ctx file cdefs =
+  let profile = read_pgo_profile file in
+  let fundefs = Util.map_filter (function CDEF_fundef (id, _, _, _) -> Some id | _ -> None) cdefs in
+  (* Functions called from outside Sail, such as main, do not appear
+     in the profile, so a model with no other functions has none. *)
+  if List.exists (fun id -> Hashtbl.mem profile.pgo_inclusive (string_of_id id)) fundefs then
+    pgo_optimize' ctx profile fundefs cdefs
+  else
+    begin
+      Util.warn (Printf.sprintf "The profile %s does not contain any functions from this model, ignoring it" file);
+      cdefs, ctx
+    end
+
 let concatMap f xs = List.concat (List.map f xs)
 
 let optimize ctx cdefs =
@@ -2037,6 +2336,11 @@ let optimize ctx cdefs =
 let sgen_id id = Util.zencode_string (string_of_id id)
 let codegen_id id = string (sgen_id id)
 
+(* Storage class for the global state of a model instance: registers,
+   hoisted temporaries and the current exception. With -c_thread_local
+   each thread gets its own copy, see model_init_thread below. *)
+let sgen_thread_local () = if !opt_thread_local then "_Thread_local " else ""
+
 let rec sgen_ctyp = function
   | CT_unit -> "unit"
   | CT_bit -> "mach_bits"
@@ -2223,6 +2527,11 @@ let rec codegen_instr fid ctx (I_aux (instr, (_, l))) =
           | CT_bits _ -> "decimal_string_of_sail_bits"
           | _ -> assert false
           end
+       | "internal_vector_access", _ ->
+          begin match args with
+          | cval :: _ -> Printf.sprintf "internal_vector_access_%s" (sgen_ctyp_name (cval_ctyp cval))
+          | _ -> c_error "internal vector access function with bad arity."
+          end
        | "internal_vector_update", _ -> Printf.sprintf "internal_vector_update_%s" (sgen_ctyp_name ctyp)
        | "internal_vector_init", _ -> Printf.sprintf "internal_vector_init_%s" (sgen_ctyp_name ctyp)
        | "undefined_vector", CT_bits64 _ -> "UNDEFINED(mach_bits)"
@@ -2331,6 +2640,16 @@ let rec codegen_instr fid ctx (I_aux (instr, (_, l))) =
   | I_match_failure ->
      string ("  sail_match_failure(\"" ^ String.escaped (string_of_id fid) ^ "\");")
 
+(* The global variables used to deal with exceptions. With -c_split
+   they are defined in the first file, and declared in the header. *)
+let exception_globals definition =
+  if definition then
+    [ sgen_thread_local () ^ "struct zexception *current_exception = NULL;";
+      sgen_thread_local () ^ "bool have_exception = false;" ]
+  else
+    [ "extern " ^ sgen_thread_local () ^ "struct zexception *current_exception;";
+      "extern " ^ sgen_thread_local () ^ "bool have_exception;" ]
+
 let codegen_type_def ctx = function
   | CTD_enum (id, ((first_id :: _) as ids)) ->
      let codegen_eq =
@@ -2547,9 +2866,7 @@ let codegen_type_def ctx = function
      (* If this is the exception type, then we setup up some global variables to deal with exceptions. *)
      ^^ if string_of_id id = "exception" then
           twice hardline
-          ^^ string "struct zexception *current_exception = NULL;"
-          ^^ hardline
-          ^^ string "bool have_exception = false;"
+          ^^ separate_map hardline string (exception_globals (!opt_split = 0))
         else
           empty
 
@@ -2663,16 +2980,25 @@ let codegen_vector ctx (direction, ctyp) =
     let vector_init =
       string (Printf.sprintf "static void CREATE(%s)(%s *rop) {\n  rop->len = 0;\n  rop->data = NULL;\n}" (sgen_id id) (sgen_id id))
     in
+    (* A vector of the same length is copied into in place, which
+       keeps registers in the hart_state struct where they are. *)
     let vector_set =
       string (Printf.sprintf "static void COPY(%s)(%s *rop, %s op) {\n" (sgen_id id) (sgen_id id) (sgen_id id))
-      ^^ string (Printf.sprintf "  KILL(%s)(rop);\n" (sgen_id id))
-      ^^ string "  rop->len = op.len;\n"
-      ^^ string (Printf.sprintf "  rop->data = malloc((rop->len) * sizeof(%s));\n" (sgen_ctyp ctyp))
+      ^^ string "  if (rop->data == NULL || rop->len != op.len) {\n"
+      ^^ string (Printf.sprintf "    KILL(%s)(rop);\n" (sgen_id id))
+      ^^ string "    rop->len = op.len;\n"
+      ^^ string (Printf.sprintf "    rop->data = malloc((rop->len) * sizeof(%s));\n" (sgen_ctyp ctyp))
+      ^^ (if is_stack_ctyp ctyp then empty
+          else
+            string "    for (int i = 0; i < op.len; i++) {\n"
+            ^^ string (Printf.sprintf "      CREATE(%s)((rop->data) + i);\n" (sgen_ctyp_name ctyp))
+            ^^ string "    }\n")
+      ^^ string "  }\n"
       ^^ string "  for (int i = 0; i < op.len; i++) {\n"
       ^^ string (if is_stack_ctyp ctyp then
                    "    (rop->data)[i] = op.data[i];\n"
                  else
-                   Printf.sprintf "    CREATE(%s)((rop->data) + i);\n    COPY(%s)((rop->data) + i, op.data[i]);\n" (sgen_ctyp_name ctyp) (sgen_ctyp_name ctyp))
+                   Printf.sprintf "    COPY(%s)((rop->data) + i, op.data[i]);\n" (sgen_ctyp_name ctyp))
       ^^ string "  }\n"
       ^^ string "}"
     in
@@ -2687,8 +3013,8 @@ let codegen_vector ctx (direction, ctyp) =
       ^^ string "}"
     in
     let vector_update =
-      string (Printf.sprintf "static void vector_update_%s(%s *rop, %s op, mpz_t n, %s elem) {\n" (sgen_id id) (sgen_id id) (sgen_id id) (sgen_ctyp ctyp))
-      ^^ string "  int m = mpz_get_ui(n);\n"
+      string (Printf.sprintf "static void vector_update_%s(%s *rop, %s op, sail_int n, %s elem) {\n" (sgen_id id) (sgen_id id) (sgen_id id) (sgen_ctyp ctyp))
+      ^^ string "  int m = sail_int_get_ui(n);\n"
       ^^ string "  if (rop->data == op.data) {\n"
       ^^ string (if is_stack_ctyp ctyp then
                    "    rop->data[m] = elem;\n"
@@ -2705,6 +3031,7 @@ let codegen_vector ctx (direction, ctyp) =
     in
     let internal_vector_update =
       string (Printf.sprintf "static void internal_vector_update_%s(%s *rop, %s op, const int64_t n, %s elem) {\n" (sgen_id id) (sgen_id id) (sgen_id id) (sgen_ctyp ctyp))
+      ^^ string (Printf.sprintf "  if (rop->data != op.data) COPY(%s)(rop, op);\n" (sgen_id id))
       ^^ string (if is_stack_ctyp ctyp then
                    "  rop->data[n] = elem;\n"
                  else
@@ -2713,16 +3040,21 @@ let codegen_vector ctx (direction, ctyp) =
     in
     let vector_access =
       if is_stack_ctyp ctyp then
-        string (Printf.sprintf "static %s vector_access_%s(%s op, mpz_t n) {\n" (sgen_ctyp ctyp) (sgen_id id) (sgen_id id))
-        ^^ string "  int m = mpz_get_ui(n);\n"
+        string (Printf.sprintf "static %s vector_access_%s(%s op, sail_int n) {\n" (sgen_ctyp ctyp) (sgen_id id) (sgen_id id))
+        ^^ string "  int m = sail_int_get_ui(n);\n"
         ^^ string "  return op.data[m];\n"
         ^^ string "}"
       else
-        string (Printf.sprintf "static void vector_access_%s(%s *rop, %s op, mpz_t n) {\n" (sgen_id id) (sgen_ctyp ctyp) (sgen_id id))
-        ^^ string "  int m = mpz_get_ui(n);\n"
+        string (Printf.sprintf "static void vector_access_%s(%s *rop, %s op, sail_int n) {\n" (sgen_id id) (sgen_ctyp ctyp) (sgen_id id))
+        ^^ string "  int m = sail_int_get_ui(n);\n"
         ^^ string (Printf.sprintf "  COPY(%s)(rop, op.data[m]);\n" (sgen_ctyp_name ctyp))
         ^^ string "}"
     in
+    let internal_vector_access =
+      string (Printf.sprintf "static %s internal_vector_access_%s(%s op, const int64_t n) {\n" (sgen_ctyp ctyp) (sgen_id id) (sgen_id id))
+      ^^ string "  return op.data[n];\n"
+      ^^ string "}"
+    in
     let internal_vector_init =
       string (Printf.sprintf "static void internal_vector_init_%s(%s *rop, const int64_t len) {\n" (sgen_id id) (sgen_id id))
       ^^ string "  rop->len = len;\n"
@@ -2735,9 +3067,15 @@ let codegen_vector ctx (direction, ctyp) =
       ^^ string "}"
     in
     let vector_undefined =
-      string (Printf.sprintf "static void undefined_vector_%s(%s *rop, mpz_t len, %s elem) {\n" (sgen_id id) (sgen_id id) (sgen_ctyp ctyp))
-      ^^ string (Printf.sprintf "  rop->len = mpz_get_ui(len);\n")
-      ^^ string (Printf.sprintf "  rop->data = malloc((rop->len) * sizeof(%s));\n" (sgen_ctyp ctyp))
+      string (Printf.sprintf "static void undefined_vector_%s(%s *rop, sail_int len, %s elem) {\n" (sgen_id id) (sgen_id id) (sgen_ctyp ctyp))
+      ^^ (if is_stack_ctyp ctyp then
+            string "  if (rop->data == NULL || rop->len != sail_int_get_ui(len)) {\n"
+            ^^ string "    rop->len = sail_int_get_ui(len);\n"
+            ^^ string (Printf.sprintf "    rop->data = malloc((rop->len) * sizeof(%s));\n" (sgen_ctyp ctyp))
+            ^^ string "  }\n"
+          else
+            string "  rop->len = sail_int_get_ui(len);\n"
+            ^^ string (Printf.sprintf "  rop->data = malloc((rop->len) * sizeof(%s));\n" (sgen_ctyp ctyp)))
       ^^ string "  for (int i = 0; i < (rop->len); i++) {\n"
       ^^ string (if is_stack_ctyp ctyp then
                    "    (rop->data)[i] = elem;\n"
@@ -2753,6 +3091,7 @@ let codegen_vector ctx (direction, ctyp) =
       ^^ vector_clear ^^ twice hardline
       ^^ vector_undefined ^^ twice hardline
       ^^ vector_access ^^ twice hardline
+      ^^ (if is_stack_ctyp ctyp then internal_vector_access ^^ twice hardline else empty)
       ^^ vector_set ^^ twice hardline
       ^^ vector_update ^^ twice hardline
       ^^ internal_vector_update ^^ twice hardline
@@ -2765,7 +3104,7 @@ let is_decl = function
 
 let codegen_decl = function
   | I_aux (I_decl (ctyp, id), _) ->
-     string (Printf.sprintf "%s %s;" (sgen_ctyp ctyp) (sgen_id id))
+     string (Printf.sprintf "%s%s %s;" (sgen_thread_local ()) (sgen_ctyp ctyp) (sgen_id id))
   | _ -> assert false
 
 let codegen_alloc = function
@@ -2777,16 +3116,16 @@ let codegen_alloc = function
 let codegen_def' ctx = function
   | CDEF_reg_dec (id, ctyp, _) ->
      string (Printf.sprintf "// register %s" (string_of_id id)) ^^ hardline
-     ^^ string (Printf.sprintf "%s %s;" (sgen_ctyp ctyp) (sgen_id id))
+     ^^ string (Printf.sprintf "%s%s %s;" (sgen_thread_local ()) (sgen_ctyp ctyp) (sgen_id id))
 
   | CDEF_spec (id, arg_ctyps, ret_ctyp) ->
      let static = if !opt_static then "static " else "" in
      if Env.is_extern id ctx.tc_env "c" then
        empty
      else if is_stack_ctyp ret_ctyp then
-       string (Printf.sprintf "%s%s %s(%s);" static (sgen_ctyp ret_ctyp) (sgen_id id) (Util.string_of_list ", " sgen_ctyp arg_ctyps))
+       string (Printf.sprintf "%s%s%s %s(%s);" static (pgo_attribute id) (sgen_ctyp ret_ctyp) (sgen_id id) (Util.string_of_list ", " sgen_ctyp arg_ctyps))
      else
-       string (Printf.sprintf "%svoid %s(%s *rop, %s);" static (sgen_id id) (sgen_ctyp ret_ctyp) (Util.string_of_list ", " sgen_ctyp arg_ctyps))
+       string (Printf.sprintf "%s%svoid %s(%s *rop, %s);" static (pgo_attribute id) (sgen_id id) (sgen_ctyp ret_ctyp) (Util.string_of_list ", " sgen_ctyp arg_ctyps))
 
   | CDEF_fundef (id, ret_arg, args, instrs) as def ->
      if !opt_debug_flow_graphs then make_dot id (instrs_graph instrs) else ();
@@ -2827,10 +3166,12 @@ let codegen_def' ctx = function
        | None ->
           assert (is_stack_ctyp ret_ctyp);
           (if !opt_static then string "static " else empty)
+          ^^ string (pgo_attribute id)
           ^^ string (sgen_ctyp ret_ctyp) ^^ space ^^ codegen_id id ^^ parens (string args) ^^ hardline
        | Some gs ->
           assert (not (is_stack_ctyp ret_ctyp));
           (if !opt_static then string "static " else empty)
+          ^^ string (pgo_attribute id)
           ^^ string "void" ^^ space ^^ codegen_id id
           ^^ parens (string (sgen_ctyp ret_ctyp ^ " *" ^ sgen_id gs ^ ", ") ^^ string args)
           ^^ hardline
@@ -2909,8 +3250,10 @@ let codegen_ctg ctx = function
   | CTG_list ctyp -> codegen_list ctx ctyp
 
 (** When we generate code for a definition, we need to first generate
-   any auxillary type definitions that are required. *)
-let codegen_def ctx def =
+   any auxillary type definitions that are required. codegen_def_parts
+   returns them separately from the definition itself, as with
+   -c_split they go in the header. *)
+let codegen_def_parts ctx def =
   let ctyps = cdef_ctyps ctx def in
   (* We should have erased any polymorphism introduced by variants at this point! *)
   if List.exists is_polymorphic ctyps then
@@ -2920,8 +3263,8 @@ let codegen_def ctx def =
                             (Util.string_of_list "\n" string_of_ctyp polymorphic_ctyps))
   else
     let deps = List.concat (List.map ctyp_dependencies ctyps) in
-    separate_map hardline (codegen_ctg ctx) deps
-    ^^ codegen_def' ctx def
+    let deps = separate_map hardline (codegen_ctg ctx) deps in
+    deps, codegen_def' ctx def
 
 let is_cdef_startup = function
   | CDEF_startup _ -> true
@@ -2944,6 +3287,34 @@ let sgen_finish = function
      Printf.sprintf "  finish_%s();" (sgen_id id)
   | _ -> assert false
 
+(* Generate the C statements that write the value of lval, of type
+   ctyp, to the checkpoint stream f (see lib/rts.h), or read it back
+   when save is false. depth is used to name loop indices. *)
+let rec sgen_checkpoint save depth lval ctyp =
+  match ctyp with
+  | CT_unit | CT_bit | CT_bool | CT_bits64 _ | CT_int64 | CT_enum _ ->
+     [ Printf.sprintf "%s_bytes(f, &%s, sizeof(%s));" (if save then "save" else "restore") lval lval ]
+  | CT_int | CT_bits _ | CT_string | CT_real ->
+     if save then
+       [ Printf.sprintf "SAVE(%s)(f, %s);" (sgen_ctyp_name ctyp) lval ]
+     else
+       [ Printf.sprintf "RESTORE(%s)(f, &%s);" (sgen_ctyp_name ctyp) lval ]
+  | CT_struct (_, fields) ->
+     List.concat (List.map (fun (id, ctyp) -> sgen_checkpoint save depth (lval ^ "." ^ sgen_id id) ctyp) fields)
+  | CT_tup ctyps ->
+     List.concat (List.mapi (fun n ctyp -> sgen_checkpoint save depth (Printf.sprintf "%s.ztup%d" lval n) ctyp) ctyps)
+  | CT_vector (_, ctyp) ->
+     let i = "i" ^ string_of_int depth in
+     (if save then
+        Printf.sprintf "save_bytes(f, &%s.len, sizeof(%s.len));" lval lval
+      else
+        Printf.sprintf "restore_length(f, %s.len);" lval)
+     :: Printf.sprintf "for (size_t %s = 0; %s < %s.len; %s++) {" i i lval i
+     :: List.map (fun line -> "  " ^ line) (sgen_checkpoint save (depth + 1) (Printf.sprintf "%s.data[%s]" lval i) ctyp)
+     @ [ "}" ]
+  | CT_list _ | CT_variant _ | CT_ref _ | CT_poly ->
+     [ Printf.sprintf "checkpoint_unsupported(\"%s\");" (String.escaped lval) ]
+
 let instrument_tracing ctx =
   let module StringSet = Set.Make(String) in
   let traceable = StringSet.of_list ["mach_bits"; "sail_string"; "sail_bits"; "sail_int"; "unit"; "bool"] in
@@ -2997,6 +3368,46 @@ let instrument_tracing ctx =
      CDEF_fundef (function_id, heap_return, args, instrument body)
   | cdef -> cdef
 
+(** Wrap every call to a Sail function in profile_start(N) and
+   profile_end(), where N is the position of the function in the list
+   of names returned alongside the instrumented cdefs. Calls to
+   builtins are not wrapped, so their cost is counted as part of the
+   calling function. *)
+let instrument_profiling cdefs =
+  let fn_ids, _ =
+    List.fold_left (fun (ids, n) cdef ->
+        match cdef with
+        | CDEF_fundef (id, _, _, _) when not (Bindings.mem id ids) -> Bindings.add id n ids, n + 1
+        | _ -> ids, n)
+      (Bindings.empty, 0) cdefs
+  in
+  let rec instrument = function
+    | (I_aux (I_funcall (_, _, id, _), _) as instr) :: instrs when Bindings.mem id fn_ids ->
+       iraw (Printf.sprintf "profile_start(%d);" (Bindings.find id fn_ids))
+       :: instr
+       :: iraw "profile_end();"
+       :: instrument instrs
+
+    | I_aux (I_block block, aux) :: instrs -> I_aux (I_block (instrument block), aux) :: instrument instrs
+    | I_aux (I_try_block block, aux) :: instrs -> I_aux (I_try_block (instrument block), aux) :: instrument instrs
+    | I_aux (I_if (cval, then_instrs, else_instrs, ctyp), aux) :: instrs ->
+       I_aux (I_if (cval, instrument then_instrs, instrument else_instrs, ctyp), aux) :: instrument instrs
+
+    | instr :: instrs -> instr :: instrument instrs
+    | [] -> []
+  in
+  let instrument_cdef = function
+    | CDEF_fundef (function_id, heap_return, args, body) ->
+       CDEF_fundef (function_id, heap_return, args, instrument body)
+    | cdef -> cdef
+  in
+  let names =
+    Bindings.bindings fn_ids
+    |> List.sort (fun (_, n) (_, m) -> compare n m)
+    |> List.map (fun (id, _) -> string_of_id id)
+  in
+  List.map instrument_cdef cdefs, names
+
 let bytecode_ast ctx rewrites (Defs defs) =
   let assert_vs = Initial_check.extern_of_string dec_ord (mk_id "sail_assert") "(bool, string) -> unit effect {escape}" in
   let exit_vs = Initial_check.extern_of_string dec_ord (mk_id "sail_exit") "unit -> unit effect {escape}" in
@@ -3033,7 +3444,75 @@ let rec get_recursive_functions (Defs defs) =
   | _ :: defs -> get_recursive_functions (Defs defs)
   | [] -> IdSet.empty
 
-let compile_ast ctx c_includes (Defs defs) =
+(* With -c_split N, functions are put in the N files by cutting a
+   depth first walk of the call graph (callees first) into pieces of
+   about the same number of instructions, so that most calls are to a
+   function in the same file, where gcc can still inline them. Returns
+   the file for each function. *)
+let split_functions n cdefs =
+  let sizes = ref Bindings.empty in
+  let calls = ref Bindings.empty in
+  let scan = function
+    | CDEF_fundef (id, _, _, instrs) ->
+       let size = ref 0 in
+       let callees = ref [] in
+       let count (I_aux (instr, _) as i) =
+         incr size;
+         begin match instr with
+         | I_funcall (_, false, f, _) -> callees := f :: !callees
+         | _ -> ()
+         end;
+         i
+       in
+       ignore (List.map (map_instr count) instrs);
+       sizes := Bindings.add id !size !sizes;
+       calls := Bindings.add id (List.rev !callees) !calls
+    | _ -> ()
+  in
+  List.iter scan cdefs;
+
+  let visited = ref IdSet.empty in
+  let order = ref [] in
+  let rec visit id =
+    if Bindings.mem id !sizes && not (IdSet.mem id !visited) then
+      begin
+        visited := IdSet.add id !visited;
+        List.iter visit (Bindings.find id !calls);
+        order := id :: !order
+      end
+  in
+  (* The definitions are sorted so that callers come after callees, so
+     the walk starts from the last. *)
+  List.iter (function CDEF_fundef (id, _, _, _) -> visit id | _ -> ()) (List.rev cdefs);
+
+  let total = max 1 (Bindings.fold (fun _ size total -> total + size) !sizes 0) in
+  let _, files =
+    List.fold_left (fun (seen, files) id ->
+        seen + Bindings.find id !sizes, Bindings.add id (min (n - 1) (seen * n / total)) files)
+      (0, Bindings.empty) (List.rev !order)
+  in
+  files
+
+(* Files are only written when their contents change, so that after an
+   edit make only recompiles the files that are affected. *)
+let write_if_changed file contents =
+  let unchanged =
+    try
+      let chan = open_in_bin file in
+      let old = really_input_string chan (in_channel_length chan) in
+      close_in chan;
+      old = contents
+    with
+    | Sys_error _ | End_of_file -> false
+  in
+  if not unchanged then
+    begin
+      let chan = open_out_bin file in
+      output_string chan contents;
+      close_out chan
+    end
+
+let compile_ast ctx output c_includes (Defs defs) =
   try
     c_debug (lazy (Util.log_line __MODULE__ __LINE__ "Identifying recursive functions"));
     let recursive_functions = Spec_analysis.top_sort_defs (Defs defs) |> get_recursive_functions in
@@ -3047,9 +3526,26 @@ let compile_ast ctx c_includes (Defs defs) =
     let cdefs = List.concat (List.rev chunks) in
     let cdefs, ctx = specialize_variants ctx [] cdefs in
     let cdefs = sort_ctype_defs cdefs in
+    let cdefs, ctx = match !opt_pgo with
+      | Some file -> pgo_optimize ctx file cdefs
+      | None -> cdefs, ctx
+    in
     let cdefs = optimize ctx cdefs in
     let cdefs = if !opt_trace then List.map (instrument_tracing ctx) cdefs else cdefs in
-    let docs = List.map (codegen_def ctx) cdefs in
+    let cdefs, profile_names = if !opt_profile then instrument_profiling cdefs else (cdefs, []) in
+    if !opt_arena && !opt_thread_local then
+      c_error "-c_arena cannot be used with -c_thread_local, as the arena is shared by all threads";
+    if !opt_profile && !opt_thread_local then
+      c_error "-c_profile cannot be used with -c_thread_local, as the calling context tree is shared by all threads";
+    if !opt_trace && !opt_thread_local then
+      c_error "-c_trace cannot be used with -c_thread_local, as the trace buffer is shared by all threads";
+    if !opt_split > 0 && !opt_static then
+      c_error "-c_split cannot be used with -static, as functions are called from other files";
+    List.iter (fun reg ->
+        if not (Bindings.mem (mk_id reg) !hart_registers) then
+          c_error ("-c_hart_state: there is no register " ^ reg))
+      !opt_hart_state;
+    let parts = List.map (fun cdef -> let deps, doc = codegen_def_parts ctx cdef in (cdef, deps, doc)) cdefs in
 
     let preamble = separate hardline
                      ([ string "#include \"sail.h\"";
@@ -3082,35 +3578,106 @@ let compile_ast ctx c_includes (Defs defs) =
 
     let regs = c_ast_registers cdefs in
 
+    (* The elements of the vector registers in hart_registers are kept
+       in one cache line aligned struct, in the order the registers are
+       declared, so that a register file is a contiguous array that can
+       be compared or checkpointed as a whole. *)
+    let hart_regs, other_regs = List.partition (fun (id, _, _) -> Bindings.mem id !hart_registers) regs in
+
+    let hart_state_type =
+      if hart_regs = [] then empty else
+        separate hardline (List.map string
+           ( [ "struct hart_state {" ]
+           @ List.map (fun (id, ctyp, _) ->
+                 match ctyp with
+                 | CT_vector (_, elem_ctyp) ->
+                    Printf.sprintf "  %s %s[%d];" (sgen_ctyp elem_ctyp) (sgen_id id) (Bindings.find id !hart_registers)
+                 | _ -> assert false) hart_regs
+           @ [ "} __attribute__((aligned(64)));" ] ))
+        ^^ hardline ^^ hardline
+    in
+    let hart_state definition =
+      if hart_regs = [] then empty else
+        string (Printf.sprintf "%s%sstruct hart_state hart_state;" (if definition then "" else "extern ") (sgen_thread_local ()))
+        ^^ hardline ^^ hardline
+    in
+
     let register_init_clear (id, ctyp, instrs) =
       if is_stack_ctyp ctyp then
         List.map (sgen_instr (mk_id "reg") ctx) instrs, []
+      else if Bindings.mem id !hart_registers then
+        [ Printf.sprintf "  %s.len = %d;" (sgen_id id) (Bindings.find id !hart_registers);
+          Printf.sprintf "  %s.data = hart_state.%s;" (sgen_id id) (sgen_id id) ]
+        @ List.map (sgen_instr (mk_id "reg") ctx) instrs,
+        [ Printf.sprintf "  %s.data = NULL;" (sgen_id id) ]
       else
         [ Printf.sprintf "  CREATE(%s)(&%s);" (sgen_ctyp_name ctyp) (sgen_id id) ]
         @ List.map (sgen_instr (mk_id "reg") ctx) instrs,
         [ Printf.sprintf "  KILL(%s)(&%s);" (sgen_ctyp_name ctyp) (sgen_id id) ]
     in
 
-    let model_init = separate hardline (List.map string
-       ( [ "void model_init(void)";
-           "{";
-           "  setup_rts();" ]
+    let model_checkpoint save =
+      separate hardline (List.map string
+         ( [ Printf.sprintf "static void model_%s_registers(FILE *f)" (if save then "save" else "restore");
+             "{" ]
+         @ (if hart_regs = [] then []
+            else [ Printf.sprintf "  %s_bytes(f, &hart_state, sizeof(hart_state));" (if save then "save" else "restore") ])
+         @ List.concat (List.map (fun (id, ctyp, _) -> List.map (fun line -> "  " ^ line) (sgen_checkpoint save 0 (sgen_id id) ctyp)) other_regs)
+         @ [ "}" ] ))
+    in
+
+    let model_profile_names =
+      if profile_names = [] then empty else
+        separate hardline (List.map string
+           ( [ "static const char *const model_profile_names[] = {" ]
+           @ List.map (fun name -> Printf.sprintf "  \"%s\"," (String.escaped name)) profile_names
+           @ [ "};" ] ))
+        ^^ hardline ^^ hardline
+    in
+
+    (* Everything that a thread needs to run its own instance of the
+       model (with -c_thread_local) is set up by model_init_thread, and
+       cleared by model_fini_thread. The letbinds are never written, so
+       they are shared by all threads. *)
+    let model_init_thread = separate hardline (List.map string
+       ( [ "void model_init_thread(void)";
+           "{" ]
        @ fst exn_boilerplate
        @ startup cdefs
        @ List.concat (List.map (fun r -> fst (register_init_clear r)) regs)
        @ (if regs = [] then [] else [ "  zinitializze_registers(UNIT);" ])
+       @ [ "}" ] ))
+    in
+
+    let model_fini_thread = separate hardline (List.map string
+       ( [ "void model_fini_thread(void)";
+           "{" ]
+       @ List.concat (List.map (fun r -> snd (register_init_clear r)) regs)
+       @ finish cdefs
+       @ snd exn_boilerplate
+       @ [ "}" ] ))
+    in
+
+    let model_init = separate hardline (List.map string
+       ( [ "void model_init(void)";
+           "{";
+           "  setup_rts();";
+           "  checkpoint_registers(model_save_registers, model_restore_registers);" ]
+       @ (if profile_names = [] then []
+          else [ Printf.sprintf "  profile_functions(%d, model_profile_names);" (List.length profile_names) ])
+       @ [ "  model_init_thread();" ]
        @ letbind_initializers
+       @ (if !opt_arena then [ "  sail_arena_enable();" ] else [])
        @ [ "}" ] ))
     in
 
     let model_fini = separate hardline (List.map string
        ( [ "void model_fini(void)";
            "{" ]
+       @ (if !opt_arena then [ "  sail_arena_disable();" ] else [])
        @ letbind_finalizers
-       @ List.concat (List.map (fun r -> snd (register_init_clear r)) regs)
-       @ finish cdefs
-       @ snd exn_boilerplate
-       @ [ "  cleanup_rts();";
+       @ [ "  model_fini_thread();";
+           "  cleanup_rts();";
            "}" ] ))
     in
 
@@ -3134,11 +3701,81 @@ let compile_ast ctx c_includes (Defs defs) =
 
     let hlhl = hardline ^^ hardline in
 
-    Pretty_print_sail.to_string (preamble ^^ hlhl ^^ separate hlhl docs ^^ hlhl
-                                 ^^ model_init ^^ hlhl
-                                 ^^ model_fini ^^ hlhl
-                                 ^^ model_default_main ^^ hlhl
-                                 ^^ model_main)
-    |> print_endline
+    let model = model_checkpoint true ^^ hlhl
+                ^^ model_checkpoint false ^^ hlhl
+                ^^ model_profile_names
+                ^^ model_init_thread ^^ hlhl
+                ^^ model_fini_thread ^^ hlhl
+                ^^ model_init ^^ hlhl
+                ^^ model_fini ^^ hlhl
+                ^^ model_default_main ^^ hlhl
+                ^^ model_main
+    in
+
+    (* With -c_hart_state_header, hart_state is also declared in a
+       header of its own, for C code that runs alongside the model. *)
+    begin match !opt_hart_state_header with
+    | Some file ->
+       write_if_changed file
+         (Pretty_print_sail.to_string (string "#pragma once" ^^ hlhl
+                                       ^^ string "#include \"sail.h\"" ^^ hlhl
+                                       ^^ hart_state_type ^^ hart_state false)
+          ^ "\n")
+    | None -> ()
+    end;
+
+    if !opt_split = 0 then
+      begin
+        let docs = List.map (fun (_, deps, doc) -> deps ^^ doc) parts in
+        Pretty_print_sail.to_string (preamble ^^ hlhl ^^ separate hlhl docs ^^ hlhl
+                                     ^^ hart_state_type ^^ hart_state true
+                                     ^^ model)
+        |> print_endline
+      end
+    else
+      (* The header output.h has the types, and declares the functions
+         and global variables. The functions are defined in output_0.c
+         to output_(N-1).c, by split_functions, and the registers, let
+         bindings and everything else in output_0.c. *)
+      let files = split_functions !opt_split cdefs in
+      let header (cdef, deps, doc) =
+        let decl = match cdef with
+          | CDEF_type _ | CDEF_spec _ -> doc
+          | CDEF_reg_dec (id, ctyp, _) ->
+             string (Printf.sprintf "extern %s%s %s;" (sgen_thread_local ()) (sgen_ctyp ctyp) (sgen_id id))
+          | CDEF_let (_, bindings, _) ->
+             separate_map hardline (fun (id, ctyp) -> string (Printf.sprintf "extern %s %s;" (sgen_ctyp ctyp) (sgen_id id))) bindings
+          | CDEF_startup (id, _) -> string (Printf.sprintf "void startup_%s(void);" (sgen_id id))
+          | CDEF_finish (id, _) -> string (Printf.sprintf "void finish_%s(void);" (sgen_id id))
+          | CDEF_fundef _ -> empty
+        in
+        deps ^^ decl
+      in
+      let file_of = function
+        | CDEF_fundef (id, _, _, _) | CDEF_startup (id, _) | CDEF_finish (id, _) ->
+           (try Some (Bindings.find id files) with Not_found -> Some 0)
+        | CDEF_reg_dec _ | CDEF_let _ -> Some 0
+        | CDEF_type _ | CDEF_spec _ -> None
+      in
+      write_if_changed (output ^ ".h")
+        (Pretty_print_sail.to_string (string "#pragma once" ^^ hardline
+                                      ^^ string "#pragma GCC diagnostic ignored \"-Wunused-function\"" ^^ hlhl
+                                      ^^ preamble ^^ hlhl
+                                      ^^ separate hlhl (List.map header parts) ^^ hlhl
+                                      ^^ hart_state_type ^^ hart_state false)
+         ^ "\n");
+      for n = 0 to !opt_split - 1 do
+        let docs = List.map (fun (_, _, doc) -> doc) (List.filter (fun (cdef, _, _) -> file_of cdef = Some n) parts) in
+        write_if_changed (Printf.sprintf "%s_%d.c" output n)
+          (Pretty_print_sail.to_string (string (Printf.sprintf "#include \"%s.h\"" (Filename.basename output)) ^^ hlhl
+                                        ^^ separate hlhl docs ^^ hlhl
+                                        ^^ (if n > 0 then empty
+                                            else (if Bindings.mem (mk_id "exception") ctx.variants
+                                                  then separate_map hardline string (exception_globals true) ^^ hlhl
+                                                  else empty)
+                                                 ^^ hart_state true
+                                                 ^^ model))
+           ^ "\n")
+      done
   with
     Type_error (l, err) -> c_error ("Unexpected type error when compiling to C:\n" ^ Type_error.string_of_type_error err)
@@ -58,6 +58,13 @@ val opt_debug_function : string ref
 val opt_trace : bool ref
 val opt_static : bool ref
 val opt_no_main : bool ref
+val opt_arena : bool ref
+val opt_profile : bool ref
+val opt_thread_local : bool ref
+val opt_split : int ref
+val opt_pgo : string option ref
+val opt_hart_state : string list ref
+val opt_hart_state_header : string option ref
 
 (** Optimization flags *)
 
@@ -72,7 +79,9 @@ type ctx
    should be the environment returned by typechecking the full AST. *)
 val initial_ctx : Env.t -> ctx
 
-val compile_ast : ctx -> string list -> tannot Ast.defs -> unit
+(** Compile an AST to C, printed to stdout. With -c_split the C is
+   instead written to the files output.h and output_0.c onwards. *)
+val compile_ast : ctx -> string -> string list -> tannot Ast.defs -> unit
 
 val bytecode_ast : ctx -> (cdef list -> cdef list) -> tannot Ast.defs -> cdef list
 
@@ -120,6 +120,27 @@ let options = Arg.align ([
   ( "-c_no_main",
     Arg.Set C_backend.opt_no_main,
     " do not generate the main() function" );
+  ( "-c_arena",
+    Arg.Set C_backend.opt_arena,
+    " allocate GMP temporaries from an arena in generated C");
+  ( "-c_profile",
+    Arg.Set C_backend.opt_profile,
+    " count calls and time spent in each function in generated C");
+  ( "-c_thread_local",
+    Arg.Set C_backend.opt_thread_local,
+    " make the model state thread local in generated C, so each thread can run its own instance");
+  ( "-c_split",
+    Arg.Int (fun n -> C_backend.opt_split := n),
+    " <n> write generated C as a header and n files that can be compiled separately, named after -o");
+  ( "-c_hart_state",
+    Arg.String (fun regs -> C_backend.opt_hart_state := !C_backend.opt_hart_state @ Util.split_on_char ',' regs),
+    " <reg,...> keep the elements of these vector registers together in the hart_state struct in generated C");
+  ( "-c_hart_state_header",
+    Arg.String (fun file -> C_backend.opt_hart_state_header := Some file),
+    " <file> also declare the hart_state struct in the header file");
+  ( "-c_pgo",
+    Arg.String (fun file -> C_backend.opt_pgo := Some file),
+    " <file> optimize generated C using a profile written by a model compiled with -c_profile");
   ( "-elf",
     Arg.String (fun elf -> opt_process_elf := Some elf),
     " process an elf file so that it can be executed by compiled C code");
@@ -348,7 +369,8 @@ let main() =
          let ast_c, type_envs = Specialize.specialize ast_c type_envs in
          let ast_c = Spec_analysis.top_sort_defs ast_c in
          Util.opt_warnings := true;
-         C_backend.compile_ast (C_backend.initial_ctx type_envs) (!opt_includes_c) ast_c
+         let out = match !opt_file_out with None -> "out" | Some s -> s in
+         C_backend.compile_ast (C_backend.initial_ctx type_envs) out (!opt_includes_c) ast_c
        else ());
       (if !(opt_print_lem)
        then
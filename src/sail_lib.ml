@@ -508,6 +508,11 @@ let read_tag_bool addr =
   let addri = uint addr in
   try Mem.find addri !tag_ram with Not_found -> false
 
+let clear_tags (addr, len) =
+  let lo = uint addr in
+  let hi = Big_int.add lo (uint len) in
+  tag_ram := Mem.filter (fun a _ -> Big_int.less a lo || Big_int.greater_equal a hi) !tag_ram
+
 let rec reverse_endianness bits =
   if List.length bits <= 8 then bits else
   reverse_endianness (drop 8 bits) @ (take 8 bits)
@@ -13,14 +13,15 @@ from sailtest import *
 
 def test_c_builtins(name, sail_opts):
     banner('Testing builtins: {} Sail options: {}'.format(name, sail_opts))
+    runtime_objects(sail_dir, '')
     tests = {}
     for filename in os.listdir('.'):
         if re.match('.+\.sail', filename):
             basename = os.path.splitext(os.path.basename(filename))[0]
-            tests[filename] = os.fork()
+            tests[filename] = fork_test()
             if tests[filename] == 0:
-                step('sail -no_warn -c {} {} 1> {}.c'.format(sail_opts, filename, basename))
-                step('gcc {}.c {}/lib/*.c -lgmp -lz -I {}/lib -o {}'.format(basename, sail_dir, sail_dir, basename))
+                sail_to_c(sail_dir, sail_opts, filename, basename)
+                compile_c(sail_dir, '', basename)
                 step('./{}'.format(basename))
                 step('rm {}.c'.format(basename))
                 step('rm {}'.format(basename))
@@ -34,7 +35,7 @@ def test_ocaml_builtins(name, sail_opts):
     for filename in os.listdir('.'):
         if re.match('.+\.sail', filename):
             basename = os.path.splitext(os.path.basename(filename))[0]
-            tests[filename] = os.fork()
+            tests[filename] = fork_test()
             if tests[filename] == 0:
                 step('sail -no_warn -ocaml -ocaml_build_dir _sbuild_{} -o {} {}'.format(basename, basename, filename))
                 step('./{}'.format(basename))
@@ -50,7 +51,7 @@ def test_lem_builtins(name):
     for filename in os.listdir('.'):
         if re.match('.+\.sail', filename):
             basename = os.path.splitext(os.path.basename(filename))[0]
-            tests[filename] = os.fork()
+            tests[filename] = fork_test()
             if tests[filename] == 0:
                 # Generate Lem from Sail
                 step('sail -no_warn -lem {}'.format(filename))
@@ -11,16 +11,36 @@ sys.path.insert(0, os.path.join(sail_dir, 'test'))
 
 from sailtest import *
 
-def test_c(name, c_opts, sail_opts, valgrind):
+# Tests whose integers do not fit in 128 bits, which USE_INT128
+# reports as an overflow.
+wide_int_tests = ['large_bitvector.sail', 'wide_bits_kernels.sail']
+
+# With split, each test is compiled with -c_split into that many
+# files, which are compiled separately and linked. With pgo, each test
+# is first compiled with -c_profile and run, and then compiled again
+# with -c_pgo using the profile.
+def test_c(name, c_opts, sail_opts, valgrind, exclude=[], split=0, pgo=False):
     banner('Testing {} with C options: {} Sail options: {} valgrind: {}'.format(name, c_opts, sail_opts, valgrind))
+    runtime_objects(sail_dir, c_opts)
     tests = {}
     for filename in os.listdir('.'):
-        if re.match('.+\.sail', filename):
+        if re.match('.+\.sail', filename) and filename not in exclude:
             basename = os.path.splitext(os.path.basename(filename))[0]
-            tests[filename] = os.fork()
+            tests[filename] = fork_test()
             if tests[filename] == 0:
-                step('sail -no_warn -c {} {} 1> {}.c'.format(sail_opts, filename, basename))
-                step('gcc {} {}.c {}/lib/*.c -lgmp -lz -I {}/lib -o {}'.format(c_opts, basename, sail_dir, sail_dir, basename))
+                if pgo:
+                    sail_to_c(sail_dir, sail_opts + ' -c_profile', filename, basename + '_profile')
+                    compile_c(sail_dir, c_opts, basename + '_profile')
+                    step('./{}_profile --profile-file {}.folded 1> /dev/null 2> /dev/null'.format(basename, basename))
+                    sail_to_c(sail_dir, '{} -c_pgo {}.folded'.format(sail_opts, basename), filename, basename,
+                              ['{}.folded'.format(basename)])
+                    compile_c(sail_dir, c_opts, basename)
+                elif split:
+                    sail_to_split_c(sail_dir, sail_opts, split, filename, basename + '_split')
+                    compile_split_c(sail_dir, c_opts, split, basename + '_split', basename)
+                else:
+                    sail_to_c(sail_dir, sail_opts, filename, basename)
+                    compile_c(sail_dir, c_opts, basename)
                 step('./{} 1> {}.result'.format(basename, basename))
                 step('diff {}.result {}.expect'.format(basename, basename))
                 if valgrind:
@@ -35,7 +55,7 @@ def test_interpreter(name):
     for filename in os.listdir('.'):
         if re.match('.+\.sail', filename):
             basename = os.path.splitext(os.path.basename(filename))[0]
-            tests[filename] = os.fork()
+            tests[filename] = fork_test()
             if tests[filename] == 0:
                 step('sail -is execute.isail -iout {}.iresult {}'.format(basename, filename))
                 step('diff {}.iresult {}.expect'.format(basename, basename))
@@ -49,7 +69,7 @@ def test_ocaml(name):
     for filename in os.listdir('.'):
         if re.match('.+\.sail', filename):
             basename = os.path.splitext(os.path.basename(filename))[0]
-            tests[filename] = os.fork()
+            tests[filename] = fork_test()
             if tests[filename] == 0:
                 step('sail -ocaml -ocaml_build_dir _sbuild_{} -o {} {}'.format(basename, basename, filename))
                 step('./{} 1> {}.oresult'.format(basename, basename))
@@ -63,7 +83,13 @@ xml = '<testsuites>\n'
 xml += test_c('unoptimized C', '', '', True)
 xml += test_c('optimized C', '-O2', '-O', True)
 xml += test_c('constant folding', '', '-Oconstant_fold', True)
+xml += test_c('arena allocation', '-O2', '-O -c_arena', True)
+xml += test_c('thread local state', '-O2', '-O -c_thread_local', True)
+xml += test_c('128-bit integers', '-O2 -DUSE_INT128', '-O', True, wide_int_tests)
+xml += test_c('128-bit reals', '-O2 -DUSE_REAL128 -DCHECK_REAL128', '-O', True)
 xml += test_c('address sanitised', '-O2 -fsanitize=undefined', '-O', False)
+xml += test_c('split into files', '-O2', '-O -c_thread_local', False, split=3)
+xml += test_c('profile guided', '-O2', '-O', False, pgo=True)
 
 xml += test_interpreter('interpreter')
 
@@ -54,7 +54,7 @@ function run_c_tests {
 	if $SAILDIR/sail -no_warn -c $SAIL_OPTS $file 1> ${file%.sail}.c 2> /dev/null;
 	then
 	    green "compiling $(basename $file) ($SAIL_OPTS)" "ok";
-	    if gcc $CC_OPTS ${file%.sail}.c $SAILDIR/lib/*.c -lgmp -lz -I $SAILDIR/lib;
+	    if gcc $CC_OPTS ${file%.sail}.c $SAILDIR/lib/*.c -lgmp -lz -lpthread -I $SAILDIR/lib;
 	    then
 		green "compiling $(basename ${file%.sail}.c) ($CC_OPTS)" "ok";
 		$DIR/a.out 1> ${file%.sail}.result 2> /dev/null;
@@ -93,6 +93,10 @@ SAIL_OPTS="-O"
 CC_OPTS="-O2 -fsanitize=undefined"
 run_c_tests
 
+SAIL_OPTS="-O -c_arena"
+CC_OPTS="-O2"
+run_c_tests
+
 finish_suite "C testing"
 
 printf "</testsuites>\n" >> $DIR/tests.xml
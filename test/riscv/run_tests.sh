@@ -16,22 +16,67 @@ pass=0
 fail=0
 XML=""
 
+# Number of tests to run at once: -j N, or SAIL_TEST_JOBS, or the
+# number of CPUs.
+JOBS=${SAIL_TEST_JOBS:-$(nproc)}
+while getopts "j:" opt; do
+    case $opt in
+        j) JOBS=$OPTARG ;;
+    esac
+done
+
+# The optional third argument is the time taken by the test in seconds.
 function green {
     (( pass += 1 ))
     printf "$1: ${GREEN}$2${NC}\n"
-    XML+="    <testcase name=\"$1\"/>\n"
+    XML+="    <testcase name=\"$1\" time=\"${3:-0}\"/>\n"
 }
 
 function yellow {
     (( fail += 1 ))
     printf "$1: ${YELLOW}$2${NC}\n"
-    XML+="    <testcase name=\"$1\">\n      <error message=\"$2\">$2</error>\n    </testcase>\n"
+    XML+="    <testcase name=\"$1\" time=\"${3:-0}\">\n      <error message=\"$2\">$2</error>\n    </testcase>\n"
 }
 
 function red {
     (( fail += 1 ))
     printf "$1: ${RED}$2${NC}\n"
-    XML+="    <testcase name=\"$1\">\n      <error message=\"$2\">$2</error>\n    </testcase>\n"
+    XML+="    <testcase name=\"$1\" time=\"${3:-0}\">\n      <error message=\"$2\">$2</error>\n    </testcase>\n"
+}
+
+# Run every ELF test with the emulator given as arguments, JOBS at a
+# time, writing the output of foo.elf to foo.$1 and then reporting
+# the results in order.
+function run_elf_tests {
+    local ext=$1
+    shift
+    for test in $DIR/tests/*.elf; do
+        while (( $(jobs -rp | wc -l) >= JOBS )); do
+            wait -n || true
+        done
+        (
+            start=$(date +%s.%N)
+            if "$@" "$test" > "${test%.elf}.$ext" 2>&1 && grep -q SUCCESS "${test%.elf}.$ext"
+            then
+                result=ok
+            else
+                result=fail
+            fi
+            end=$(date +%s.%N)
+            echo "$result $(awk "BEGIN { printf \"%.3f\", $end - $start }")" > "${test%.elf}.$ext.result"
+        ) &
+    done
+    wait || true
+    for test in $DIR/tests/*.elf; do
+        read result time < "${test%.elf}.$ext.result"
+        rm -f "${test%.elf}.$ext.result"
+        if [ "$result" = ok ]
+        then
+            green "$(basename $test)" "ok" "$time"
+        else
+            red "$(basename $test)" "fail" "$time"
+        fi
+    done
 }
 
 function finish_suite {
@@ -58,14 +103,7 @@ else
     red "Building RISCV specification" "fail"
 fi
 
-for test in $DIR/tests/*.elf; do
-    if $SAILDIR/riscv/platform "$test" >"${test/.elf/.out}" 2>&1 && grep -q SUCCESS "${test/.elf/.out}"
-    then
-       green "$(basename $test)" "ok"
-    else
-       red "$(basename $test)" "fail"
-    fi
-done
+run_elf_tests out $SAILDIR/riscv/platform
 
 if make -C $SAILDIR/riscv riscv_sim;
 then
@@ -74,15 +112,51 @@ else
     red "Building RISCV specification to C" "fail"
 fi
 
-for test in $DIR/tests/*.elf; do
-    if timeout 5 $SAILDIR/riscv/riscv_sim $test > ${test%.elf}.cout 2>&1 && grep -q SUCCESS ${test%.elf}.cout
+run_elf_tests cout timeout 5 $SAILDIR/riscv/riscv_sim
+
+# The counters in a --stats-file should account for every instruction
+# retired. The interval is longer than the run, so the only summary
+# line is the one printed on exit.
+rm -f $DIR/sail.stats
+retired=
+counted=
+if timeout 5 $SAILDIR/riscv/riscv_sim --stats --stats-file $DIR/sail.stats --stats-interval 1000 \
+       $DIR/tests/rv64uc-v-rvc.elf > /dev/null 2> $DIR/stats.err
+then
+    retired=$(sed -n 's/^\[Sail\] Executed \([0-9]*\) instructions.*/\1/p' $DIR/stats.err)
+    counted=$($SAILDIR/etc/sail_stats.py $DIR/sail.stats | awk '$1 == "instructions" { print $2 }')
+fi
+if [ -n "$retired" ] && [ "$retired" = "$counted" ] &&
+   grep -q " instructions (.* MIPS)" $DIR/stats.err
+then
+    green "riscv_sim --stats-file" "ok"
+else
+    red "riscv_sim --stats-file" "fail"
+fi
+rm -f $DIR/stats.err $DIR/sail.stats
+
+# The atomics tests again with a second hart, taking turns so that the
+# run is repeatable. The second hart parks itself in the test's reset
+# code, so hart 0 has to pass while the LR/SC and AMO locking is on.
+for test in $DIR/tests/rv64ua-p-*.elf; do
+    if timeout 5 $SAILDIR/riscv/riscv_sim --harts 2 --deterministic $test > ${test%.elf}.harts 2>&1 &&
+       grep -q "SUCCESS (hart 0)" ${test%.elf}.harts && ! grep -q FAILURE ${test%.elf}.harts
     then
-	green "$(basename $test)" "ok"
+        green "$(basename $test) --harts 2" "ok"
     else
-	red "$(basename $test)" "fail"
+        red "$(basename $test) --harts 2" "fail"
     fi
 done
 
+if make -C $SAILDIR/riscv riscv_sim_int128;
+then
+    green "Building RISCV specification to C with 128-bit integers" "ok"
+else
+    red "Building RISCV specification to C with 128-bit integers" "fail"
+fi
+
+run_elf_tests int128out timeout 5 $SAILDIR/riscv/riscv_sim_int128
+
 finish_suite "RISCV tests"
 
 printf "</testsuites>\n" >> $DIR/tests.xml
@@ -3,6 +3,9 @@ set -e
 
 DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
 
+# Options such as -j N are passed on to the C, builtins and RISC-V
+# tests, which run their tests in parallel.
+
 cd $DIR
 
 printf "\n==========================================\n"
@@ -21,7 +24,7 @@ printf "\n==========================================\n"
 printf "C tests\n"
 printf "==========================================\n"
 
-./c/run_tests.py
+./c/run_tests.py "$@"
 
 printf "\n==========================================\n"
 printf "Lem tests\n"
@@ -33,7 +36,7 @@ printf "\n==========================================\n"
 printf "Builtins tests\n"
 printf "==========================================\n"
 
-./builtins/run_tests.py
+./builtins/run_tests.py "$@"
 
 printf "\n==========================================\n"
 printf "ARM spec tests\n"
@@ -45,4 +48,4 @@ printf "\n==========================================\n"
 printf "RISCV spec tests\n"
 printf "==========================================\n"
 
-./riscv/run_tests.sh
+./riscv/run_tests.sh "$@"
@@ -1,8 +1,13 @@
 import os
 import re
 import sys
+import glob
+import time
+import shutil
+import hashlib
 import subprocess
 import datetime
+import multiprocessing
 
 class color:
     NOTICE = '\033[94m'
@@ -24,6 +29,140 @@ def step(string):
         print(err)
         sys.exit(1)
 
+def parse_jobs():
+    """Number of tests to run at once, from -j N on the command line or
+    the SAIL_TEST_JOBS environment variable, defaulting to the number
+    of CPUs."""
+    jobs = os.environ.get('SAIL_TEST_JOBS', multiprocessing.cpu_count())
+    for i, arg in enumerate(sys.argv):
+        if arg == '-j' and i + 1 < len(sys.argv):
+            jobs = sys.argv[i + 1]
+        elif arg.startswith('-j') and len(arg) > 2:
+            jobs = arg[2:]
+    return max(1, int(jobs))
+
+jobs = parse_jobs()
+
+# Children that have been reaped while waiting for a free job slot,
+# mapped to their exit status and finishing time.
+finished = {}
+started = {}
+
+def reap():
+    pid, status = os.wait()
+    finished[pid] = (status, time.time())
+
+def fork_test():
+    """Like os.fork, but waits until fewer than jobs tests are running.
+    The parent has to collect the children with collect_results."""
+    while len(started) - len(finished) >= jobs:
+        reap()
+    pid = os.fork()
+    if pid != 0:
+        started[pid] = time.time()
+    return pid
+
+# Generated C, executables, and the objects for the runtime in lib/
+# are cached in SAIL_TEST_CACHE (test/.cache by default), keyed on a
+# hash of the command, the files it reads, and the binaries of the
+# tools it runs.
+cache_dir = os.environ.get('SAIL_TEST_CACHE', os.path.join(os.path.dirname(os.path.abspath(__file__)), '.cache'))
+tool_hashes = {}
+
+def hash_file(h, path):
+    with open(path, 'rb') as f:
+        for chunk in iter(lambda: f.read(1 << 20), b''):
+            h.update(chunk)
+
+def tool_hash(tool):
+    if tool not in tool_hashes:
+        path = tool if os.path.isabs(tool) else None
+        for d in os.environ.get('PATH', '').split(os.pathsep):
+            if path is None and os.access(os.path.join(d, tool), os.X_OK):
+                path = os.path.join(d, tool)
+        h = hashlib.sha1()
+        h.update(tool)
+        if path is not None:
+            hash_file(h, os.path.realpath(path))
+        tool_hashes[tool] = h.hexdigest()
+    return tool_hashes[tool]
+
+def cached_step(command, output, inputs, tools):
+    """Run step(command), which must create the file output from the
+    files in inputs using the programs in tools, unless the same
+    command has already been run on the same inputs."""
+    h = hashlib.sha1()
+    h.update(command)
+    for tool in tools:
+        h.update(tool_hash(tool))
+    for path in sorted(inputs):
+        h.update(path)
+        hash_file(h, path)
+    cached = os.path.join(cache_dir, h.hexdigest())
+    if os.path.exists(cached):
+        shutil.copy2(cached, output)
+        return
+    step(command)
+    if not os.path.isdir(cache_dir):
+        try:
+            os.makedirs(cache_dir)
+        except OSError:
+            pass
+    # Copy then rename, so that concurrent tests never see half a file.
+    tmp = '{}.{}'.format(cached, os.getpid())
+    shutil.copy2(output, tmp)
+    os.rename(tmp, cached)
+
+def sail_inputs(sail_dir, filename):
+    """The files read by sail for a test: the test itself, and the
+    library it may $include."""
+    return [filename] + glob.glob(os.path.join(sail_dir, 'lib', '*.sail'))
+
+def sail_to_c(sail_dir, sail_opts, filename, basename, inputs=[]):
+    """inputs are any other files read by sail because of sail_opts."""
+    cached_step('sail -no_warn -c {} {} 1> {}.c'.format(sail_opts, filename, basename),
+                '{}.c'.format(basename), sail_inputs(sail_dir, filename) + inputs, ['sail'])
+
+def sail_to_split_c(sail_dir, sail_opts, split, filename, basename):
+    """As sail_to_c, but with -c_split, writing basename.h and
+    basename_0.c onwards."""
+    step('sail -no_warn -c {} -c_split {} -o {} {}'.format(sail_opts, split, basename, filename))
+
+runtimes = {}
+
+def runtime_objects(sail_dir, c_opts):
+    """Compile the C runtime in lib/ with c_opts, to objects in the
+    cache, and return their paths. Called before forking the tests, so
+    they can all link against the same objects."""
+    if c_opts in runtimes:
+        return runtimes[c_opts]
+    headers = glob.glob(os.path.join(sail_dir, 'lib', '*.h'))
+    objs = []
+    for src in sorted(glob.glob(os.path.join(sail_dir, 'lib', '*.c'))):
+        obj = os.path.join(cache_dir, 'runtime', '{}_{}.o'.format(
+            os.path.splitext(os.path.basename(src))[0], hashlib.sha1(c_opts).hexdigest()[:12]))
+        if not os.path.isdir(os.path.dirname(obj)):
+            os.makedirs(os.path.dirname(obj))
+        cached_step('gcc {} -c {} -I {}/lib -o {}'.format(c_opts, src, sail_dir, obj), obj, [src] + headers, ['gcc'])
+        objs.append(obj)
+    runtimes[c_opts] = ' '.join(objs)
+    return runtimes[c_opts]
+
+def compile_c(sail_dir, c_opts, basename):
+    objs = runtime_objects(sail_dir, c_opts)
+    headers = glob.glob(os.path.join(sail_dir, 'lib', '*.h'))
+    cached_step('gcc {} {}.c {} -lgmp -lz -lpthread -I {}/lib -o {}'.format(c_opts, basename, objs, sail_dir, basename),
+                basename, ['{}.c'.format(basename)] + objs.split() + headers, ['gcc'])
+
+def compile_split_c(sail_dir, c_opts, split, basename, program):
+    """Compile the files written by sail_to_split_c one at a time, and
+    link them into program."""
+    objs = runtime_objects(sail_dir, c_opts)
+    for n in range(split):
+        step('gcc {} -c {}_{}.c -I {}/lib -o {}_{}.o'.format(c_opts, basename, n, sail_dir, basename, n))
+    split_objs = ' '.join('{}_{}.o'.format(basename, n) for n in range(split))
+    step('gcc {} {} {} -lgmp -lz -lpthread -o {}'.format(c_opts, split_objs, objs, program))
+
 def banner(string):
     print '-' * len(string)
     print string
@@ -33,19 +172,26 @@ def collect_results(name, tests):
     passes = 0
     failures = 0
     xml = ""
+    total = 0.0
+
+    while len(finished) < len(started):
+        reap()
 
-    for test in tests:
-        _, status = os.waitpid(tests[test], 0)
+    for test in sorted(tests):
+        pid = tests[test]
+        status, end = finished.pop(pid)
+        elapsed = end - started.pop(pid)
+        total += elapsed
         if status != 0:
             failures += 1
-            xml += '    <testcase name="{}">\n      <error message="fail">fail</error>\n    </testcase>\n'.format(test)
+            xml += '    <testcase name="{}" classname="{}" time="{:.3f}">\n      <error message="fail">fail</error>\n    </testcase>\n'.format(test, name, elapsed)
         else:
             passes += 1
-            xml += '    <testcase name="{}"/>\n'.format(test)
+            xml += '    <testcase name="{}" classname="{}" time="{:.3f}"/>\n'.format(test, name, elapsed)
 
     print '{}{} passes and {} failures{}'.format(color.NOTICE, passes, failures, color.END)
 
     time = datetime.datetime.utcnow()
-    suite = '  <testsuite name="{}" tests="{}" failures="{}" timestamp="{}">\n{}  </testsuite>\n'
-    xml = suite.format(name, passes + failures, failures, time, xml)
+    suite = '  <testsuite name="{}" tests="{}" failures="{}" time="{:.3f}" timestamp="{}">\n{}  </testsuite>\n'
+    xml = suite.format(name, passes + failures, failures, total, time, xml)
     return xml